@@ -20,7 +20,18 @@ pub fn build(b: *std.build.Builder) void {
     const c_exe = b.addExecutable("c-wasi", null);
     c_exe.addCSourceFiles(&.{"src/main.c"}, &.{ "-std=c99", "-Wall", "-Werror" });
     c_exe.linkLibC();
+    c_exe.linkSystemLibrary("zstd");
     c_exe.setTarget(target);
     c_exe.setBuildMode(mode);
     c_exe.install();
+
+    // The same engine without main(), for embedding through src/zigwasi.h.
+    const c_lib = b.addStaticLibrary("zigwasi", null);
+    c_lib.addCSourceFiles(&.{"src/main.c"}, &.{ "-std=c99", "-Wall", "-Werror", "-DZIG_WASI_LIBRARY" });
+    c_lib.linkLibC();
+    c_lib.linkSystemLibrary("zstd");
+    c_lib.setTarget(target);
+    c_lib.setBuildMode(mode);
+    c_lib.install();
+    b.installFile("src/zigwasi.h", "include/zigwasi.h");
 }
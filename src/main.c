@@ -5,6 +5,7 @@
 #include <limits.h>
 #include <math.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -12,17 +13,35 @@
 #include <inttypes.h>
 
 #include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
 #include <sys/mman.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 
 #ifdef __linux__
+#include <link.h>
+#include <linux/userfaultfd.h>
+#include <sys/ioctl.h>
 #include <sys/random.h>
+#include <sys/syscall.h>
+#endif
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define HAVE_AVX2_KERNELS
 #endif
 
 #include <zstd.h>
 
+#include "zigwasi.h"
+
 #if defined(__APPLE__)
 #define ZIG_TRIPLE_OS "macos"
 #elif defined(_WIN32)
@@ -135,7 +154,18 @@ enum wasi_errno_t {
     WASI_ENOTCAPABLE = 76,
 };
 
+/// While set, panic unwinds to this instead of ending the process, so
+/// that the library can report a trapping guest or a malformed module.
+/// Only the thread that set it may panic into it.
+static __thread jmp_buf *panic_jmp;
+/// Message of the last panic that unwound to panic_jmp.
+static __thread const char *panic_msg;
+
 static void panic(const char *msg) {
+    if (panic_jmp != NULL) {
+        panic_msg = msg;
+        longjmp(*panic_jmp, 1);
+    }
     fprintf(stderr, "%s\n", msg);
     abort();
 }
@@ -168,17 +198,320 @@ static uint64_t rotr64(uint64_t n, unsigned c) {
     return (n >> c) | (n << ((-c) & mask));
 }
 
-static void *arena_alloc(size_t n) {
-    void *ptr = malloc(n);
-    if (!ptr) panic("out of memory");
+static size_t align_forward(size_t n, size_t alignment) {
+    return (n + alignment - 1) & ~(alignment - 1);
+}
+
+/// Not cryptographic; only tells cached inputs apart.
+static uint64_t hash_bytes(uint64_t hash, const char *ptr, size_t len) {
+    const uint64_t k0 = 0x9e3779b97f4a7c15u;
+    const uint64_t k1 = 0x87c37b91114253d5u;
+    hash ^= len * k0;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t word;
+        memcpy(&word, ptr + i, 8);
+        hash = rotl64(hash ^ (word * k1), 31) * k0;
+    }
+    if (i < len) {
+        uint64_t word = 0;
+        memcpy(&word, ptr + i, len - i);
+        hash = rotl64(hash ^ (word * k1), 31) * k0;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdu;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53u;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+#ifdef __linux__
+struct EngineCode {
+    uintptr_t addr;
+    uint64_t hash;
+    bool found;
+};
+
+static int engine_hashObject(struct dl_phdr_info *info, size_t size, void *context) {
+    (void)size;
+    struct EngineCode *code = context;
+    bool contains = false;
+    for (ElfW(Half) i = 0; i < info->dlpi_phnum; i += 1) {
+        const ElfW(Phdr) *phdr = &info->dlpi_phdr[i];
+        uintptr_t start = info->dlpi_addr + phdr->p_vaddr;
+        if (phdr->p_type == PT_LOAD && code->addr - start < phdr->p_memsz) contains = true;
+    }
+    if (!contains) return 0;
+    // Read-only segments hold the code and constants exactly as linked;
+    // writable ones are patched by relocations and change every run.
+    for (ElfW(Half) i = 0; i < info->dlpi_phnum; i += 1) {
+        const ElfW(Phdr) *phdr = &info->dlpi_phdr[i];
+        if (phdr->p_type != PT_LOAD || (phdr->p_flags & PF_W) != 0) continue;
+        code->hash = hash_bytes(code->hash, (const char *)(info->dlpi_addr + phdr->p_vaddr),
+                                phdr->p_filesz);
+    }
+    code->found = true;
+    return 1;
+}
+#endif
+
+/// Identifies the engine build so that nothing cached by another build
+/// is reused. Hashes the machine code of whichever object this engine was
+/// linked into, so any rebuild that changes the engine changes the hash
+/// and identical reproducible builds share caches.
+static uint64_t engine_hash(void) {
+    static uint64_t cached = 0;
+    uint64_t hash = __atomic_load_n(&cached, __ATOMIC_RELAXED);
+    if (hash != 0) return hash;
+    static const char engine_triple[] = ZIG_TRIPLE_ARCH;
+    hash = hash_bytes(0, engine_triple, sizeof(engine_triple));
+#ifdef __linux__
+    struct EngineCode code = { .addr = (uintptr_t)&engine_hash, .hash = hash, .found = false };
+    dl_iterate_phdr(engine_hashObject, &code);
+    if (!code.found) panic("unable to locate engine code");
+    hash = code.hash;
+#else
+    static const char engine_version[] = __DATE__ " " __TIME__;
+    hash = hash_bytes(hash, engine_version, sizeof(engine_version));
+#endif
+    if (hash == 0) hash = 1;
+    __atomic_store_n(&cached, hash, __ATOMIC_RELAXED);
+    return hash;
+}
+
+static size_t host_page_size;
+static bool host_has_bmi2 = false;
+static const size_t huge_page_size = 2 * 1024 * 1024;
+
+/// Bump allocator over a single reservation. Pages are committed on first
+/// write and everything is given back at once.
+struct Arena {
+    char *ptr;
+    /// Bytes handed out so far.
+    size_t len;
+    size_t capacity;
+    /// Largest len ever reached.
+    size_t high_water;
+};
+
+static const size_t arena_capacity = 256ul * 1024ul * 1024ul; // 256 MiB
+
+static void arena_init(struct Arena *arena, size_t capacity) {
+    capacity = align_forward(capacity, huge_page_size);
+    // Over-reserve so that the arena starts on a huge page boundary.
+    size_t reserve_len = capacity + huge_page_size;
+    char *base = mmap(NULL, reserve_len, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANON | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED) panic("out of memory");
+    char *aligned = (char *)align_forward((uintptr_t)base, huge_page_size);
+    if (aligned != base) munmap(base, aligned - base);
+    munmap(aligned + capacity, base + reserve_len - (aligned + capacity));
+    arena->ptr = aligned;
+    arena->len = 0;
+    arena->capacity = capacity;
+    arena->high_water = 0;
+}
+
+static void *arena_allocAligned(struct Arena *arena, size_t n, size_t alignment) {
+    size_t start = align_forward(arena->len, alignment);
+    if (start > arena->capacity || n > arena->capacity - start) panic("out of memory");
+    arena->len = start + n;
+    if (arena->len > arena->high_water) arena->high_water = arena->len;
+    return arena->ptr + start;
+}
+
+static void *arena_alloc(struct Arena *arena, size_t n) {
+    void *ptr = arena_allocAligned(arena, n, 16);
 #ifndef NDEBUG
     memset(ptr, 0xaa, n); // to match the zig version
 #endif
     return ptr;
 }
 
+/// Frees everything allocated at or after end and returns the whole pages
+/// among it to the kernel. Passing the arena base resets the arena.
+static void arena_restore(struct Arena *arena, void *end) {
+    size_t new_len = (char *)end - arena->ptr;
+    assert(new_len <= arena->len);
+    size_t page_start = align_forward(new_len, host_page_size);
+    size_t page_end = align_forward(arena->len, host_page_size);
+    if (page_start < page_end)
+        madvise(arena->ptr + page_start, page_end - page_start, MADV_DONTNEED);
+    arena->len = new_len;
+}
+
+static void arena_release(struct Arena *arena) {
+    munmap(arena->ptr, arena->capacity);
+    arena->ptr = NULL;
+    arena->len = 0;
+    arena->capacity = 0;
+}
+
+static void arena_printStats(const struct Arena *arena) {
+    fprintf(stderr, "arena: %zu bytes used, %zu bytes high water, %zu bytes reserved\n",
+        arena->len, arena->high_water, arena->capacity);
+}
+
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1) panic("clock_gettime failed");
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/// Resident set size in bytes, or 0 where it cannot be queried cheaply.
+static size_t resident_bytes(void) {
+#ifdef __linux__
+    int fd = open("/proc/self/statm", O_RDONLY|O_CLOEXEC);
+    if (fd == -1) return 0;
+    char buf[128];
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0) return 0;
+    buf[n] = 0;
+    unsigned long size, resident;
+    if (sscanf(buf, "%lu %lu", &size, &resident) != 2) return 0;
+    return resident * host_page_size;
+#else
+    return 0;
+#endif
+}
+
+#define max_startup_phases 32
+
+/// One step of startup. bytes, entries and ops are whatever the phase
+/// processed: module bytes read, section entries parsed and, for code,
+/// opcodes emitted.
+struct StartupPhase {
+    const char *name;
+    uint64_t ns;
+    uint64_t bytes;
+    uint64_t entries;
+    uint64_t ops;
+    uint32_t functions;
+    size_t rss;
+    /// Overlapped with the phases around it rather than part of the sum.
+    bool background;
+};
+
+/// ZIG_WASI_STARTUP_REPORT prints where startup time went once the start
+/// function is about to run; set it to "json" for a machine-readable report.
+static struct {
+    bool enabled;
+    bool json;
+    uint64_t start_ns;
+    uint64_t mark_ns;
+    uint32_t phases_len;
+    struct StartupPhase phases[max_startup_phases];
+} startup;
+
+static void startup_init(void) {
+    const char *env = getenv("ZIG_WASI_STARTUP_REPORT");
+    startup.enabled = env != NULL;
+    startup.json = env != NULL && strcmp(env, "json") == 0;
+    startup.phases_len = 0;
+    if (startup.enabled) startup.start_ns = startup.mark_ns = monotonic_ns();
+}
+
+static struct StartupPhase *startup_record(const char *name, uint64_t ns) {
+    if (startup.phases_len == max_startup_phases) return NULL;
+    struct StartupPhase *phase = &startup.phases[startup.phases_len];
+    startup.phases_len += 1;
+    memset(phase, 0, sizeof(struct StartupPhase));
+    phase->name = name;
+    phase->ns = ns;
+    phase->rss = resident_bytes();
+    return phase;
+}
+
+/// Ends the phase that began at the previous call.
+static void startup_phase(const char *name, uint64_t bytes, uint64_t entries, uint64_t ops,
+    uint32_t functions)
+{
+    if (!startup.enabled) return;
+    uint64_t now = monotonic_ns();
+    struct StartupPhase *phase = startup_record(name, now - startup.mark_ns);
+    if (phase != NULL) {
+        phase->bytes = bytes;
+        phase->entries = entries;
+        phase->ops = ops;
+        phase->functions = functions;
+    }
+    // Reading RSS is not free; keep it out of the next phase.
+    startup.mark_ns = monotonic_ns();
+}
+
+/// Records work done on another thread that took ns in total.
+static void startup_background(const char *name, uint64_t ns, uint64_t bytes) {
+    if (!startup.enabled) return;
+    struct StartupPhase *phase = startup_record(name, ns);
+    if (phase == NULL) return;
+    phase->bytes = bytes;
+    phase->background = true;
+}
+
+static void startup_print(const struct Arena *arena) {
+    if (!startup.enabled) return;
+    uint64_t total_ns = monotonic_ns() - startup.start_ns;
+    if (startup.json) {
+        fprintf(stderr, "{\"total_ns\":%" PRIu64 ",\"arena_used\":%zu,\"arena_high_water\":%zu,\"phases\":[",
+            total_ns, arena->len, arena->high_water);
+        for (uint32_t phase_i = 0; phase_i < startup.phases_len; phase_i += 1) {
+            const struct StartupPhase *phase = &startup.phases[phase_i];
+            fprintf(stderr, "%s{\"name\":\"%s\",\"ns\":%" PRIu64 ",\"bytes\":%" PRIu64
+                ",\"entries\":%" PRIu64 ",\"ops\":%" PRIu64 ",\"functions\":%u,\"rss\":%zu"
+                ",\"background\":%s}",
+                phase_i == 0 ? "" : ",", phase->name, phase->ns, phase->bytes, phase->entries,
+                phase->ops, phase->functions, phase->rss, phase->background ? "true" : "false");
+        }
+        fprintf(stderr, "]}\n");
+        return;
+    }
+    fprintf(stderr, "%-24s %10s %12s %9s %10s %9s %10s\n",
+        "phase", "ms", "bytes", "entries", "ops", "functions", "rss KiB");
+    for (uint32_t phase_i = 0; phase_i < startup.phases_len; phase_i += 1) {
+        const struct StartupPhase *phase = &startup.phases[phase_i];
+        fprintf(stderr, "%-24s %10.3f %12" PRIu64 " %9" PRIu64 " %10" PRIu64 " %9u %10zu%s\n",
+            phase->name, phase->ns / 1e6, phase->bytes, phase->entries, phase->ops,
+            phase->functions, phase->rss / 1024, phase->background ? " (background)" : "");
+    }
+    fprintf(stderr, "%-24s %10.3f\n", "total", total_ns / 1e6);
+    arena_printStats(arena);
+}
+
+static bool write_all(int fd, const void *ptr, size_t len) {
+    const char *bytes = ptr;
+    while (len > 0) {
+        ssize_t n = write(fd, bytes, len);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        bytes += n;
+        len -= n;
+    }
+    return true;
+}
+
+/// Returns false on end of file or error before len bytes were read.
+static bool read_all(int fd, void *ptr, size_t len) {
+    char *bytes = ptr;
+    while (len > 0) {
+        ssize_t n = read(fd, bytes, len);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        if (n == 0) return false;
+        bytes += n;
+        len -= n;
+    }
+    return true;
+}
+
 static int err_wrap(const char *prefix, int rc) {
     if (rc == -1) {
+        if (panic_jmp != NULL) panic(prefix);
         perror(prefix);
         abort();
     }
@@ -203,21 +536,46 @@ struct ByteSlice {
     size_t len;
 };
 
-static struct ByteSlice read_file_alloc(const char *file_path) {
-    FILE *f = fopen(file_path, "rb");
-    if (!f) {
+/// Maps the whole file read-only like map_file, or returns false if it
+/// cannot be read or is empty.
+static bool try_map_file(const char *file_path, struct ByteSlice *res) {
+    int fd = open(file_path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return false;
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size == 0) {
+        close(fd);
+        return false;
+    }
+    res->len = st.st_size;
+    res->ptr = mmap(NULL, res->len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (res->ptr == MAP_FAILED) return false;
+    madvise(res->ptr, res->len, MADV_SEQUENTIAL);
+    madvise(res->ptr, res->len, MADV_WILLNEED);
+    return true;
+}
+
+/// Maps the whole file read-only so the loader can parse it in place.
+static struct ByteSlice map_file(const char *file_path) {
+    int fd = open(file_path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
         fprintf(stderr, "failed to read %s: ", file_path);
         perror("");
         abort();
     }
-    if (fseek(f, 0L, SEEK_END) == -1) panic("failed to seek");
+    struct stat st;
+    err_wrap("stat module", fstat(fd, &st));
     struct ByteSlice res;
-    res.len = ftell(f);
-    res.ptr = malloc(res.len);
-    rewind(f);
-    size_t amt_read = fread(res.ptr, 1, res.len, f);
-    if (amt_read != res.len) panic("short read");
-    fclose(f);
+    res.len = st.st_size;
+    res.ptr = mmap(NULL, res.len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (res.ptr == MAP_FAILED) {
+        fprintf(stderr, "failed to map %s: ", file_path);
+        perror("");
+        abort();
+    }
+    madvise(res.ptr, res.len, MADV_SEQUENTIAL);
+    madvise(res.ptr, res.len, MADV_WILLNEED);
+    close(fd);
     return res;
 }
 
@@ -229,20 +587,32 @@ struct Preopen {
     size_t name_len;
 };
 
-static struct Preopen preopens_buffer[10];
-static size_t preopens_len = 0;
+#define max_preopens 10
+#define max_tracked_fds 1024
+
+/// The guest's view of host file descriptors. WASI fds name preopens
+/// first; any other fd is the host fd of that number, if the guest opened it.
+struct FdTable {
+    struct Preopen preopens[max_preopens];
+    uint32_t preopens_len;
+    /// Host fds opened by the guest, which it may close. The guest cannot
+    /// open fds beyond these.
+    uint8_t guest_fds[max_tracked_fds / 8];
+};
 
-static void add_preopen(int wasi_fd, const char *name, int host_fd) {
-    preopens_buffer[preopens_len].wasi_fd = wasi_fd;
-    preopens_buffer[preopens_len].host_fd = host_fd;
-    preopens_buffer[preopens_len].name = name;
-    preopens_buffer[preopens_len].name_len = strlen(name);
-    preopens_len += 1;
+static void add_preopen(struct FdTable *fds, int wasi_fd, const char *name, int host_fd) {
+    if (fds->preopens_len == max_preopens) panic("too many preopens");
+    struct Preopen *preopen = &fds->preopens[fds->preopens_len];
+    preopen->wasi_fd = wasi_fd;
+    preopen->host_fd = host_fd;
+    preopen->name = name;
+    preopen->name_len = strlen(name);
+    fds->preopens_len += 1;
 }
 
-static const struct Preopen *find_preopen(int32_t wasi_fd) {
-    for (size_t i = 0; i < preopens_len; i += 1) {
-        const struct Preopen *preopen = &preopens_buffer[i];
+static const struct Preopen *find_preopen(const struct FdTable *fds, int32_t wasi_fd) {
+    for (uint32_t i = 0; i < fds->preopens_len; i += 1) {
+        const struct Preopen *preopen = &fds->preopens[i];
         if (preopen->wasi_fd == wasi_fd) {
             return preopen;
         }
@@ -251,6 +621,10 @@ static const struct Preopen *find_preopen(int32_t wasi_fd) {
 }
 
 static const uint32_t max_memory = 2ul * 1024ul * 1024ul * 1024ul; // 2 GiB
+/// Address space reserved for the value stack, in slots. Pages are only
+/// committed as the stack grows into them.
+static const uint32_t max_stack_len = 64ul * 1024ul * 1024ul; // 256 MiB
+static const uint32_t initial_stack_len = 256ul * 1024ul; // 1 MiB
 
 static uint16_t read_u16_le(const char *ptr) {
     const uint8_t *u8_ptr = (const uint8_t *)ptr;
@@ -307,7 +681,7 @@ static void write_u64_le(char *ptr, uint64_t x) {
     u8_ptr[7] = (x >> 0x38);
 }
 
-static uint32_t read32_uleb128(const char *ptr, uint32_t *i) {
+static uint32_t read32_uleb128_slow(const char *ptr, uint32_t *i) {
     uint32_t result = 0;
     uint32_t shift = 0;
 
@@ -321,7 +695,7 @@ static uint32_t read32_uleb128(const char *ptr, uint32_t *i) {
     }
 }
 
-static int64_t read64_ileb128(const char *ptr, uint32_t *i) {
+static int64_t read64_ileb128_slow(const char *ptr, uint32_t *i) {
     int64_t result = 0;
     uint32_t shift = 0;
 
@@ -341,6 +715,210 @@ static int64_t read64_ileb128(const char *ptr, uint32_t *i) {
     }
 }
 
+#if (defined(__GNUC__) || defined(__clang__)) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define HAVE_WORD_LEB
+#endif
+
+#ifdef HAVE_WORD_LEB
+/// An 8-byte load at p cannot fault when it stays within p's page.
+static bool leb_canLoadWord(const char *p) {
+    return ((uintptr_t)p & (host_page_size - 1)) <= host_page_size - 8;
+}
+
+/// Packs the low 7 bits of each byte together.
+static uint64_t leb_compact(uint64_t word) {
+    word &= 0x7f7f7f7f7f7f7f7full;
+    word = (word & 0x007f007f007f007full) | ((word & 0x7f007f007f007f00ull) >> 1);
+    word = (word & 0x00003fff00003fffull) | ((word & 0x3fff00003fff0000ull) >> 2);
+    word = (word & 0x000000000fffffffull) | ((word & 0x0fffffff00000000ull) >> 4);
+    return word;
+}
+
+#ifdef HAVE_AVX2_KERNELS
+__attribute__((target("bmi2")))
+static uint64_t leb_compactBmi2(uint64_t word) {
+    return _pext_u64(word, 0x7f7f7f7f7f7f7f7full);
+}
+#endif
+
+/// Decodes a LEB128 of up to 8 bytes from a single load: the clear
+/// continuation bits give the length without a loop. Returns the length,
+/// or 0 when the LEB128 is longer.
+static uint32_t leb_readWord(const char *p, uint64_t *value) {
+    uint64_t word;
+    memcpy(&word, p, 8);
+    uint64_t ends = ~word & 0x8080808080808080ull;
+    if (ends == 0) return 0;
+    uint32_t len = __builtin_ctzll(ends) / 8 + 1;
+    if (len < 8) word &= ((uint64_t)1 << (8 * len)) - 1;
+#ifdef HAVE_AVX2_KERNELS
+    if (host_has_bmi2) {
+        *value = leb_compactBmi2(word);
+        return len;
+    }
+#endif
+    *value = leb_compact(word);
+    return len;
+}
+#endif
+
+static uint32_t read32_uleb128(const char *ptr, uint32_t *i) {
+    uint8_t first = ptr[*i];
+    if ((first & 0x80) == 0) {
+        *i += 1;
+        return first;
+    }
+#ifdef HAVE_WORD_LEB
+    if (leb_canLoadWord(ptr + *i)) {
+        uint64_t value;
+        uint32_t len = leb_readWord(ptr + *i, &value);
+        if (len == 0 || len > 5) panic("read32_uleb128 failed");
+        *i += len;
+        return value;
+    }
+#endif
+    return read32_uleb128_slow(ptr, i);
+}
+
+static int64_t read64_ileb128(const char *ptr, uint32_t *i) {
+    uint8_t first = ptr[*i];
+    if ((first & 0x80) == 0) {
+        *i += 1;
+        return (int64_t)((uint64_t)first << 57) >> 57;
+    }
+#ifdef HAVE_WORD_LEB
+    if (leb_canLoadWord(ptr + *i)) {
+        uint64_t value;
+        uint32_t len = leb_readWord(ptr + *i, &value);
+        if (len != 0) {
+            *i += len;
+            uint32_t shift = 64 - 7 * len;
+            return (int64_t)(value << shift) >> shift;
+        }
+    }
+#endif
+    return read64_ileb128_slow(ptr, i);
+}
+
+#define leb_bench_signed 0x80000000u
+
+/// Records the offset of each LEB128 immediate of the instructions in
+/// [i, end), tagging signed ones with leb_bench_signed, and returns the
+/// new count. Stops at an opcode it does not know; the decoder reports
+/// those.
+static uint32_t leb_benchBody(const char *ptr, uint32_t i, uint32_t end, uint32_t *offsets,
+    uint32_t offsets_len)
+{
+    offsets[offsets_len++] = i;
+    uint32_t local_sets_len = read32_uleb128_slow(ptr, &i);
+    for (uint32_t set_i = 0; set_i < local_sets_len && i < end; set_i += 1) {
+        offsets[offsets_len++] = i;
+        read32_uleb128_slow(ptr, &i);
+        i += 1;
+    }
+    while (i < end) {
+        uint8_t opcode = ptr[i];
+        i += 1;
+        uint32_t ulebs = 0;
+        switch (opcode) {
+            case 0x02: case 0x03: case 0x04: // block, loop, if
+                offsets[offsets_len++] = i | leb_bench_signed;
+                read64_ileb128_slow(ptr, &i);
+                break;
+            case 0x0e: // br_table
+                offsets[offsets_len++] = i;
+                ulebs = read32_uleb128_slow(ptr, &i) + 1;
+                break;
+            case 0x1c: // select t*
+                offsets[offsets_len++] = i;
+                i += read32_uleb128_slow(ptr, &i);
+                break;
+            case 0x0c: case 0x0d: case 0x10: case 0x3f: case 0x40: case 0xd0: case 0xd2:
+                ulebs = 1;
+                break;
+            case 0x11: ulebs = 2; break; // call_indirect
+            case 0x20: case 0x21: case 0x22: case 0x23: case 0x24: case 0x25: case 0x26:
+                ulebs = 1;
+                break;
+            case 0x41: case 0x42: // i32.const, i64.const
+                offsets[offsets_len++] = i | leb_bench_signed;
+                read64_ileb128_slow(ptr, &i);
+                break;
+            case 0x43: i += 4; break;
+            case 0x44: i += 8; break;
+            case 0xfc:
+                offsets[offsets_len++] = i;
+                switch (read32_uleb128_slow(ptr, &i)) {
+                    case 0: case 1: case 2: case 3: case 4: case 5: case 6: case 7: break;
+                    case 8: case 10: case 12: case 14: ulebs = 2; break;
+                    case 9: case 11: case 13: case 15: case 16: case 17: ulebs = 1; break;
+                    default: return offsets_len;
+                }
+                break;
+            case 0x00: case 0x01: case 0x05: case 0x0b: case 0x0f: case 0x1a: case 0x1b: case 0xd1:
+                break;
+            default:
+                if (opcode >= 0x28 && opcode <= 0x3e) ulebs = 2; // memarg
+                else if (opcode < 0x45 || opcode > 0xc4) return offsets_len;
+                break;
+        }
+        for (; ulebs > 0 && i < end; ulebs -= 1) {
+            offsets[offsets_len++] = i;
+            read32_uleb128_slow(ptr, &i);
+        }
+    }
+    return offsets_len;
+}
+
+/// ZIG_WASI_BENCH_LEB: walks the code section the way the decoder does,
+/// decodes each of its LEB128s (body sizes, locals and instruction
+/// immediates) with every available decoder, checks that they agree, and
+/// reports the time.
+static void leb_bench(struct Arena *arena, const char *ptr, uint32_t start, uint32_t end) {
+    enum { leb_bench_rounds = 32 };
+    // No LEB128 is shorter than a byte.
+    uint32_t *offsets = arena_alloc(arena, sizeof(uint32_t) * (end - start));
+    uint32_t offsets_len = 0;
+    for (uint32_t i = start; i < end;) {
+        offsets[offsets_len++] = i;
+        uint32_t body_len = read32_uleb128_slow(ptr, &i);
+        if (body_len > end - i) break;
+        offsets_len = leb_benchBody(ptr, i, i + body_len, offsets, offsets_len);
+        i += body_len;
+    }
+    if (offsets_len == 0) {
+        arena_restore(arena, offsets);
+        return;
+    }
+
+    const char *names[] = { "scalar", "swar", "bmi2" };
+    uint64_t checksums[3];
+    bool had_bmi2 = host_has_bmi2;
+    for (int variant = 0; variant < 3; variant += 1) {
+        if (variant == 2 && !had_bmi2) break;
+        host_has_bmi2 = variant == 2;
+        uint64_t checksum = 0;
+        uint64_t begin = monotonic_ns();
+        for (int round = 0; round < leb_bench_rounds; round += 1) {
+            for (uint32_t j = 0; j < offsets_len; j += 1) {
+                uint32_t i = offsets[j] & ~leb_bench_signed;
+                if ((offsets[j] & leb_bench_signed) != 0)
+                    checksum += variant == 0 ? read64_ileb128_slow(ptr, &i) : read64_ileb128(ptr, &i);
+                else
+                    checksum += variant == 0 ? read32_uleb128_slow(ptr, &i) : read32_uleb128(ptr, &i);
+                checksum += i;
+            }
+        }
+        uint64_t elapsed = monotonic_ns() - begin;
+        checksums[variant] = checksum;
+        if (checksum != checksums[0]) panic("LEB128 decoders disagree");
+        fprintf(stderr, "leb128 %-6s %u values: %.2f ns/value\n", names[variant], offsets_len,
+                (double)elapsed / ((double)offsets_len * leb_bench_rounds));
+    }
+    host_has_bmi2 = had_bmi2;
+    arena_restore(arena, offsets);
+}
+
 static int32_t read32_ileb128(const char *ptr, uint32_t *i) {
     return read64_ileb128(ptr, i);
 }
@@ -370,6 +948,132 @@ enum Section {
     Section_data_count,
 };
 
+/// Module bytes that may still be arriving from the decompressor. The
+/// loader waits for a prefix before reading it, so sections are parsed and
+/// function bodies decoded while the rest of the module is being inflated.
+struct ModuleInput {
+    char *ptr;
+    size_t len;
+    /// Length of the prefix of ptr that is final.
+    size_t avail;
+    /// Compressed source, unmapped once inflated.
+    struct ByteSlice src;
+    /// Whether thread is inflating; otherwise mi_init did.
+    bool background;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    /// Time the decompression thread was busy.
+    uint64_t inflate_ns;
+};
+
+static const size_t inflate_chunk_len = 256 * 1024;
+
+static void *mi_inflate(void *arg) {
+    struct ModuleInput *input = arg;
+    uint64_t start_ns = monotonic_ns();
+    ZSTD_DCtx *dctx = ZSTD_createDCtx();
+    if (dctx == NULL) panic("out of memory");
+    ZSTD_inBuffer in = { input->src.ptr, input->src.len, 0 };
+    size_t pos = 0;
+    while (pos < input->len) {
+        // Limit each step to one chunk so that progress is published early.
+        size_t end = pos + inflate_chunk_len;
+        if (end > input->len) end = input->len;
+        ZSTD_outBuffer out = { input->ptr, end, pos };
+        size_t rc = ZSTD_decompressStream(dctx, &out, &in);
+        if (ZSTD_isError(rc)) {
+            if (panic_jmp != NULL) panic("unable to decompress module");
+            fprintf(stderr, "unable to decompress module: %s\n", ZSTD_getErrorName(rc));
+            abort();
+        }
+        if (out.pos == pos && in.pos == in.size) panic("truncated module");
+        if (rc == 0 && out.pos < input->len) panic("module size mismatch");
+        pos = out.pos;
+
+        pthread_mutex_lock(&input->mutex);
+        __atomic_store_n(&input->avail, pos, __ATOMIC_RELEASE);
+        pthread_cond_broadcast(&input->cond);
+        pthread_mutex_unlock(&input->mutex);
+    }
+    ZSTD_freeDCtx(dctx);
+    input->inflate_ns = monotonic_ns() - start_ns;
+    return NULL;
+}
+
+/// Parses uncompressed modules in place and inflates zstd ones into an
+/// exactly sized buffer, on a background thread if background is set and
+/// otherwise right away.
+static void mi_init(struct ModuleInput *input, struct ByteSlice file, struct Arena *arena,
+    bool background)
+{
+    input->src = file;
+    if (file.len >= 4 && memcmp(file.ptr, "\0asm", 4) == 0) {
+        input->ptr = file.ptr;
+        input->len = file.len;
+        input->avail = file.len;
+        input->src.ptr = NULL;
+        input->inflate_ns = 0;
+        return;
+    }
+    unsigned long long content_size = ZSTD_getFrameContentSize(file.ptr, file.len);
+    if (content_size == ZSTD_CONTENTSIZE_ERROR) panic("module is neither wasm nor zstd");
+    if (content_size == ZSTD_CONTENTSIZE_UNKNOWN) panic("compressed module does not record its size");
+    if (content_size > UINT32_MAX) panic("module too large");
+    input->len = content_size;
+    input->ptr = arena_allocAligned(arena, input->len, 64);
+    input->avail = 0;
+    pthread_mutex_init(&input->mutex, NULL);
+    pthread_cond_init(&input->cond, NULL);
+    input->background = background;
+    if (!background) {
+        mi_inflate(input);
+    } else if (pthread_create(&input->thread, NULL, mi_inflate, input) != 0) {
+        panic("unable to start decompression thread");
+    }
+}
+
+/// Blocks until the first end bytes of the module are available.
+static void mi_wait(struct ModuleInput *input, size_t end) {
+    if (end > input->len) end = input->len;
+    if (__atomic_load_n(&input->avail, __ATOMIC_ACQUIRE) >= end) return;
+    pthread_mutex_lock(&input->mutex);
+    while (__atomic_load_n(&input->avail, __ATOMIC_ACQUIRE) < end)
+        pthread_cond_wait(&input->cond, &input->mutex);
+    pthread_mutex_unlock(&input->mutex);
+}
+
+static void mi_finish(struct ModuleInput *input) {
+    if (input->src.ptr == NULL) return;
+    if (input->background) pthread_join(input->thread, NULL);
+    pthread_mutex_destroy(&input->mutex);
+    pthread_cond_destroy(&input->cond);
+    munmap(input->src.ptr, input->src.len);
+    input->src.ptr = NULL;
+}
+
+/// Records section offsets starting at i until the section with id
+/// stop_at (which is not skipped) or, given -1, the end of the module.
+/// Returns the offset where scanning stopped.
+static uint32_t mi_scanSections(struct ModuleInput *input, uint32_t i,
+    uint32_t *section_starts, uint32_t *section_lens, int stop_at)
+{
+    while (i < input->len) {
+        // A section header is one id byte and at most five length bytes.
+        mi_wait(input, i + 6);
+        uint8_t section_id = input->ptr[i];
+        i += 1;
+        uint32_t section_len = read32_uleb128(input->ptr, &i);
+        if (section_id > Section_data_count) panic("bad section id");
+        section_starts[section_id] = i;
+        section_lens[section_id] = section_len;
+        if (section_id == stop_at) break;
+        mi_wait(input, i + section_len);
+        i += section_len;
+    }
+    return i;
+}
+
 enum Op {
     Op_unreachable,
     Op_br_void,
@@ -554,10 +1258,14 @@ enum Op {
     Op_sext32_64,
     Op_memcpy,
     Op_memset,
+    Op_memcpy_small,
+    Op_memset_small,
+    Op_memory_init,
+    Op_data_drop,
 
     Op_wrap_32_64 = Op_drop_32,
     Op_zext_64_32 = Op_const_0_32,
-    Op_last = Op_memset,
+    Op_last = Op_data_drop,
 };
 
 enum WasmOp {
@@ -785,134 +1493,577 @@ struct Function {
     struct ProgramCounter entry_pc;
     uint32_t type_idx;
     uint32_t locals_size;
+    /// Stack slots used by a call beyond its parameters: locals, return
+    /// address and the deepest operand stack.
+    uint32_t max_stack_size;
+    /// Offset of the body in the module, just past its size.
+    uint32_t code_begin;
+    uint32_t code_len;
 };
 
-enum ImpMod {
-    ImpMod_wasi_snapshot_preview1,
+struct VirtualMachine;
+
+struct Import {
+    /// Index into host_functions; fn is resolved from it.
+    uint32_t host_idx;
+    uint32_t type_idx;
+    void (*fn)(struct VirtualMachine *vm);
 };
 
-enum ImpName {
-    ImpName_args_get,
-    ImpName_args_sizes_get,
-    ImpName_clock_time_get,
-    ImpName_debug,
-    ImpName_debug_slice,
-    ImpName_environ_get,
-    ImpName_environ_sizes_get,
-    ImpName_fd_close,
-    ImpName_fd_fdstat_get,
-    ImpName_fd_filestat_get,
-    ImpName_fd_filestat_set_size,
-    ImpName_fd_filestat_set_times,
-    ImpName_fd_pread,
-    ImpName_fd_prestat_dir_name,
-    ImpName_fd_prestat_get,
-    ImpName_fd_pwrite,
-    ImpName_fd_read,
-    ImpName_fd_readdir,
-    ImpName_fd_write,
-    ImpName_path_create_directory,
-    ImpName_path_filestat_get,
-    ImpName_path_open,
-    ImpName_path_remove_directory,
-    ImpName_path_rename,
-    ImpName_path_unlink_file,
-    ImpName_proc_exit,
-    ImpName_random_get,
+struct DataSegment {
+    /// Offset of the segment bytes in the module.
+    uint32_t offset;
+    /// Zero once the segment has been dropped.
+    uint32_t len;
 };
 
-struct Import {
-    enum ImpMod mod;
-    enum ImpName name;
-    uint32_t type_idx;
+#define max_export_name_len 56
+
+/// An exported function. Exports with longer names cannot be called.
+struct Export {
+    uint32_t func_idx;
+    uint32_t name_len;
+    char name[max_export_name_len];
+};
+
+/// The decoded module: code and declarations that do not change once it is
+/// loaded, so that instances running on several threads can share it.
+/// Lazy decoding is the exception, and is not used with shared modules.
+struct Module {
+    const char *mod_ptr;
+    /// The file mapping mod_ptr points into, a cached image or an
+    /// uncompressed module file; ptr is NULL when mod_ptr is in the arena.
+    struct ByteSlice mapping;
+    uint8_t *opcodes;
+    uint32_t *operands;
+    struct Function *functions;
+    /// Type index to start of type in module_bytes.
+    struct TypeInfo *types;
+    struct Import *imports;
+    uint32_t imports_len;
+    struct Export *exports;
+    uint32_t exports_len;
+    uint32_t types_len;
+    uint32_t functions_len;
+    uint32_t globals_len;
+    uint32_t table_len;
+    uint32_t datas_len;
+    /// End of the part of memory written by active data segments.
+    uint32_t memory_init_len;
+    /// Set when functions are decoded on first call; code_end is where the
+    /// next one is appended to the code image.
+    struct Decoder *decoder;
+    struct ProgramCounter code_end;
+    /// Registered through the library; Import.host_idx past
+    /// host_functions_len indexes these.
+    const struct zw_host_function *extra_hosts;
+    uint32_t extra_hosts_len;
 };
 
+/// State of one running guest. Everything here belongs to a single thread
+/// except the module.
 struct VirtualMachine {
+    struct Module *module;
     uint32_t *stack;
     /// Points to one after the last stack item.
     uint32_t stack_top;
+    /// Committed stack slots. The reservation is max_stack_len.
+    uint32_t stack_len;
     struct ProgramCounter pc;
     /// Actual memory usage of the WASI code. The capacity is max_memory.
     uint32_t memory_len;
-    const char *mod_ptr;
-    uint8_t *opcodes;
-    uint32_t *operands;
-    struct Function *functions;
-    /// Type index to start of type in module_bytes.
-    struct TypeInfo *types;
+    /// memory.grow fails past this; at most max_memory.
+    uint32_t memory_limit;
     uint64_t *globals;
     char *memory;
-    struct Import *imports;
-    uint32_t imports_len;
     const char **args;
+    /// NULL for an empty environment.
+    const char **env;
+    struct FdTable fds;
+    /// The import being called, for host functions that serve several.
+    uint32_t import_idx;
     uint32_t *table;
+    struct DataSegment *datas;
+    /// While not -1, the state is saved to this directory just before the
+    /// first host call that depends on the invocation; see snap_reached.
+    int snapshot_dir;
+    uint64_t snapshot_key;
+    /// Bytes at the start of memory backed by a private mapping of their
+    /// pristine contents; discarding pages there does not zero them.
+    uint32_t memory_file_len;
+    /// When set, proc_exit stores the code in exit_code and jumps here
+    /// instead of ending the process.
+    jmp_buf *exit_jmp;
+    int exit_code;
 };
 
-static int to_host_fd(int32_t wasi_fd) {
-    const struct Preopen *preopen = find_preopen(wasi_fd);
-    if (!preopen) return wasi_fd;
-    return preopen->host_fd;
+/// Returns the host fd behind a preopen or an fd the guest opened itself,
+/// or -1 for any other fd: those belong to the engine or to other
+/// instances.
+static int to_host_fd(const struct VirtualMachine *vm, int32_t wasi_fd) {
+    const struct Preopen *preopen = find_preopen(&vm->fds, wasi_fd);
+    if (preopen != NULL) return preopen->host_fd;
+    if (wasi_fd < 0 || wasi_fd >= max_tracked_fds) return -1;
+    if ((vm->fds.guest_fds[wasi_fd / 8] & (1 << (wasi_fd % 8))) == 0) return -1;
+    return wasi_fd;
 }
 
-static enum wasi_errno_t to_wasi_err(int err) {
-    switch (err) {
-        case E2BIG: return WASI_E2BIG;
-        case EACCES: return WASI_EACCES;
-        case EADDRINUSE: return WASI_EADDRINUSE;
-        case EADDRNOTAVAIL: return WASI_EADDRNOTAVAIL;
-        case EAFNOSUPPORT: return WASI_EAFNOSUPPORT;
-        case EAGAIN: return WASI_EAGAIN;
-        case EALREADY: return WASI_EALREADY;
-        case EBADF: return WASI_EBADF;
-        case EBADMSG: return WASI_EBADMSG;
-        case EBUSY: return WASI_EBUSY;
-        case ECANCELED: return WASI_ECANCELED;
-        case ECHILD: return WASI_ECHILD;
-        case ECONNABORTED: return WASI_ECONNABORTED;
-        case ECONNREFUSED: return WASI_ECONNREFUSED;
-        case ECONNRESET: return WASI_ECONNRESET;
-        case EDEADLK: return WASI_EDEADLK;
-        case EDESTADDRREQ: return WASI_EDESTADDRREQ;
-        case EDOM: return WASI_EDOM;
-        case EDQUOT: return WASI_EDQUOT;
-        case EEXIST: return WASI_EEXIST;
-        case EFAULT: return WASI_EFAULT;
-        case EFBIG: return WASI_EFBIG;
-        case EHOSTUNREACH: return WASI_EHOSTUNREACH;
-        case EIDRM: return WASI_EIDRM;
-        case EILSEQ: return WASI_EILSEQ;
-        case EINPROGRESS: return WASI_EINPROGRESS;
-        case EINTR: return WASI_EINTR;
-        case EINVAL: return WASI_EINVAL;
-        case EIO: return WASI_EIO;
-        case EISCONN: return WASI_EISCONN;
-        case EISDIR: return WASI_EISDIR;
-        case ELOOP: return WASI_ELOOP;
-        case EMFILE: return WASI_EMFILE;
-        case EMLINK: return WASI_EMLINK;
-        case EMSGSIZE: return WASI_EMSGSIZE;
-        case EMULTIHOP: return WASI_EMULTIHOP;
-        case ENAMETOOLONG: return WASI_ENAMETOOLONG;
-        case ENETDOWN: return WASI_ENETDOWN;
-        case ENETRESET: return WASI_ENETRESET;
-        case ENETUNREACH: return WASI_ENETUNREACH;
-        case ENFILE: return WASI_ENFILE;
-        case ENOBUFS: return WASI_ENOBUFS;
-        case ENODEV: return WASI_ENODEV;
-        case ENOENT: return WASI_ENOENT;
-        case ENOEXEC: return WASI_ENOEXEC;
-        case ENOLCK: return WASI_ENOLCK;
-        case ENOLINK: return WASI_ENOLINK;
-        case ENOMEM: return WASI_ENOMEM;
-        case ENOMSG: return WASI_ENOMSG;
-        case ENOPROTOOPT: return WASI_ENOPROTOOPT;
-        case ENOSPC: return WASI_ENOSPC;
-        case ENOSYS: return WASI_ENOSYS;
-        case ENOTCONN: return WASI_ENOTCONN;
-        case ENOTDIR: return WASI_ENOTDIR;
-        case ENOTEMPTY: return WASI_ENOTEMPTY;
-        case ENOTRECOVERABLE: return WASI_ENOTRECOVERABLE;
-        case ENOTSOCK: return WASI_ENOTSOCK;
+#define memo_format_version 1
+
+/// What a path held when the guest first looked at it, or at the end of
+/// the run for outputs.
+enum MemoKind {
+    MK_missing,
+    MK_file,
+    MK_directory,
+    /// Anything else; never matches on replay.
+    MK_other,
+};
+
+/// A path the guest depends on or produces, named by the WASI fd of its
+/// preopen and the path under it, like "3/zig-cache/h/x".
+struct MemoPath {
+    char *path;
+    uint64_t path_hash;
+    enum MemoKind kind;
+    /// Hash of the contents of an input file.
+    uint64_t hash;
+};
+
+/// Everything a run read and wrote, recorded while ZIG_WASI_MEMO is set so
+/// that a later run with the same module, arguments and inputs can replay
+/// the outputs instead of running the guest.
+struct Memo {
+    bool recording;
+    /// Set when the guest did something the record cannot capture, like
+    /// reading stdin; the run is then not saved.
+    bool unusable;
+    struct MemoPath *inputs;
+    uint32_t inputs_len;
+    uint32_t inputs_cap;
+    struct MemoPath *outputs;
+    uint32_t outputs_len;
+    uint32_t outputs_cap;
+    /// Writes to stdout and stderr in order, each a u32 fd, a u32 length
+    /// and the bytes.
+    char *stdio;
+    size_t stdio_len;
+    size_t stdio_cap;
+    /// Paths of the fds the guest opened, to name paths relative to them.
+    char *fd_paths[max_tracked_fds];
+};
+
+static struct Memo memo;
+
+/// Names sub_path under the guest fd dir_fd, or returns false if the fd is
+/// neither a preopen nor one the guest opened.
+static bool memo_path(const struct FdTable *fds, int32_t dir_fd, const char *sub_path,
+    char *buf, size_t buf_len)
+{
+    int n;
+    if (find_preopen(fds, dir_fd) != NULL) {
+        n = snprintf(buf, buf_len, "%d/%s", (int)dir_fd, sub_path);
+    } else if (dir_fd >= 0 && dir_fd < max_tracked_fds && memo.fd_paths[dir_fd] != NULL) {
+        n = snprintf(buf, buf_len, "%s/%s", memo.fd_paths[dir_fd], sub_path);
+    } else {
+        return false;
+    }
+    return n >= 0 && (size_t)n < buf_len;
+}
+
+/// Splits a recorded path into the host fd of its preopen and the rest.
+static bool memo_resolve(const struct FdTable *fds, const char *path, int *host_fd,
+    const char **sub_path)
+{
+    char *end;
+    long wasi_fd = strtol(path, &end, 10);
+    if (end == path || *end != '/') return false;
+    const struct Preopen *preopen = find_preopen(fds, wasi_fd);
+    if (preopen == NULL) return false;
+    *host_fd = preopen->host_fd;
+    *sub_path = end + 1;
+    return true;
+}
+
+static void memo_pathState(int dir_fd, const char *sub_path, enum MemoKind *kind, uint64_t *hash) {
+    *hash = 0;
+    struct stat st;
+    if (fstatat(dir_fd, sub_path, &st, 0) == -1) {
+        *kind = MK_missing;
+    } else if (S_ISDIR(st.st_mode)) {
+        *kind = MK_directory;
+    } else if (!S_ISREG(st.st_mode)) {
+        *kind = MK_other;
+    } else {
+        *kind = MK_other;
+        int fd = openat(dir_fd, sub_path, O_RDONLY | O_CLOEXEC);
+        if (fd == -1) return;
+        if (fstat(fd, &st) == 0) {
+            if (st.st_size == 0) {
+                *kind = MK_file;
+                *hash = hash_bytes(0, NULL, 0);
+            } else {
+                char *contents = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (contents != MAP_FAILED) {
+                    *kind = MK_file;
+                    *hash = hash_bytes(0, contents, st.st_size);
+                    munmap(contents, st.st_size);
+                }
+            }
+        }
+        close(fd);
+    }
+}
+
+static struct MemoPath *memo_find(struct MemoPath *paths, uint32_t paths_len,
+    const char *path, uint64_t path_hash)
+{
+    for (uint32_t i = 0; i < paths_len; i += 1) {
+        if (paths[i].path_hash == path_hash && strcmp(paths[i].path, path) == 0) return &paths[i];
+    }
+    return NULL;
+}
+
+static void memo_append(struct MemoPath **paths, uint32_t *paths_len, uint32_t *paths_cap,
+    const char *path, uint64_t path_hash)
+{
+    if (*paths_len == *paths_cap) {
+        *paths_cap = *paths_cap * 2 + 64;
+        *paths = realloc(*paths, sizeof(struct MemoPath) * *paths_cap);
+        if (*paths == NULL) panic("out of memory recording memo");
+    }
+    struct MemoPath *entry = &(*paths)[*paths_len];
+    *paths_len += 1;
+    entry->path = strdup(path);
+    entry->path_hash = path_hash;
+    entry->kind = MK_missing;
+    entry->hash = 0;
+}
+
+/// Records that the run depends on the current state of sub_path, unless
+/// an earlier look at it or the run's own writes already account for it.
+static void memo_input(const struct VirtualMachine *vm, int32_t dir_fd, const char *sub_path) {
+    char path[PATH_MAX + 32];
+    if (!memo_path(&vm->fds, dir_fd, sub_path, path, sizeof(path))) {
+        memo.unusable = true;
+        return;
+    }
+    uint64_t path_hash = hash_bytes(0, path, strlen(path));
+    if (memo_find(memo.inputs, memo.inputs_len, path, path_hash) != NULL ||
+        memo_find(memo.outputs, memo.outputs_len, path, path_hash) != NULL) return;
+    memo_append(&memo.inputs, &memo.inputs_len, &memo.inputs_cap, path, path_hash);
+    struct MemoPath *input = &memo.inputs[memo.inputs_len - 1];
+    memo_pathState(to_host_fd(vm, dir_fd), sub_path, &input->kind, &input->hash);
+}
+
+/// Records that the run may change sub_path; its final state is saved.
+static void memo_output(const struct VirtualMachine *vm, int32_t dir_fd, const char *sub_path) {
+    char path[PATH_MAX + 32];
+    if (!memo_path(&vm->fds, dir_fd, sub_path, path, sizeof(path))) {
+        memo.unusable = true;
+        return;
+    }
+    uint64_t path_hash = hash_bytes(0, path, strlen(path));
+    if (memo_find(memo.outputs, memo.outputs_len, path, path_hash) != NULL) return;
+    memo_append(&memo.outputs, &memo.outputs_len, &memo.outputs_cap, path, path_hash);
+}
+
+/// Remembers the path behind a newly opened guest fd, which is below
+/// max_tracked_fds.
+static void memo_opened(const struct VirtualMachine *vm, int32_t dir_fd, const char *sub_path, int fd) {
+    char path[PATH_MAX + 32];
+    if (!memo_path(&vm->fds, dir_fd, sub_path, path, sizeof(path))) {
+        memo.unusable = true;
+        return;
+    }
+    free(memo.fd_paths[fd]);
+    memo.fd_paths[fd] = strdup(path);
+}
+
+static void memo_closed(int fd) {
+    if (fd < 0 || fd >= max_tracked_fds) return;
+    free(memo.fd_paths[fd]);
+    memo.fd_paths[fd] = NULL;
+}
+
+static void memo_stdio(int32_t fd, const char *bytes, uint32_t len) {
+    if (memo.stdio_len + 8 + len > memo.stdio_cap) {
+        memo.stdio_cap = (memo.stdio_len + 8 + len) * 2;
+        memo.stdio = realloc(memo.stdio, memo.stdio_cap);
+        if (memo.stdio == NULL) panic("out of memory recording memo");
+    }
+    uint32_t fd_u32 = fd;
+    memcpy(memo.stdio + memo.stdio_len, &fd_u32, 4);
+    memcpy(memo.stdio + memo.stdio_len + 4, &len, 4);
+    memcpy(memo.stdio + memo.stdio_len + 8, bytes, len);
+    memo.stdio_len += 8 + len;
+}
+
+/// Memo files are keyed by the module, the engine build and the guest's
+/// command line.
+static uint64_t memo_key(uint64_t module_key, const char **args) {
+    uint64_t key = hash_bytes(module_key + memo_format_version, NULL, 0);
+    for (uint32_t i = 0; args[i] != NULL; i += 1)
+        key = hash_bytes(key, args[i], strlen(args[i]) + 1);
+    return key;
+}
+
+static void memo_name(char *buf, size_t buf_len, uint64_t key) {
+    snprintf(buf, buf_len, "memo-%016" PRIx64, key);
+}
+
+struct MemoHeader {
+    uint64_t key;
+    int32_t exit_code;
+    uint32_t inputs_len;
+    uint32_t outputs_len;
+    uint32_t reserved;
+    uint64_t stdio_len;
+};
+
+static bool memo_writePath(int fd, const struct MemoPath *entry, uint64_t contents_len) {
+    uint32_t path_len = strlen(entry->path);
+    uint32_t kind = entry->kind;
+    return write_all(fd, &path_len, sizeof(path_len)) &&
+        write_all(fd, entry->path, path_len) &&
+        write_all(fd, &kind, sizeof(kind)) &&
+        write_all(fd, &entry->hash, sizeof(entry->hash)) &&
+        write_all(fd, &contents_len, sizeof(contents_len));
+}
+
+/// Writes the record of the finished run to dir_fd. Outputs are saved as
+/// they are now. Like the image, a memo is only an optimization, so
+/// failing to write it is ignored.
+static void memo_save(const struct FdTable *fds, int dir_fd, uint64_t key, int exit_code) {
+    memo.recording = false;
+    if (memo.unusable) return;
+
+    char name[32];
+    memo_name(name, sizeof(name), key);
+    char tmp_name[64];
+    snprintf(tmp_name, sizeof(tmp_name), "%s.%ld.tmp", name, (long)getpid());
+    int fd = openat(dir_fd, tmp_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd == -1) return;
+
+    struct MemoHeader header;
+    memset(&header, 0, sizeof(header));
+    header.key = key;
+    header.exit_code = exit_code;
+    header.inputs_len = memo.inputs_len;
+    header.outputs_len = memo.outputs_len;
+    header.stdio_len = memo.stdio_len;
+    bool ok = write_all(fd, &header, sizeof(header));
+    for (uint32_t i = 0; ok && i < memo.inputs_len; i += 1)
+        ok = memo_writePath(fd, &memo.inputs[i], 0);
+    for (uint32_t i = 0; ok && i < memo.outputs_len; i += 1) {
+        struct MemoPath *output = &memo.outputs[i];
+        int host_fd;
+        const char *sub_path;
+        struct stat st;
+        ok = memo_resolve(fds, output->path, &host_fd, &sub_path);
+        if (!ok) break;
+        if (fstatat(host_fd, sub_path, &st, 0) == -1) {
+            output->kind = MK_missing;
+            ok = memo_writePath(fd, output, 0);
+        } else if (S_ISDIR(st.st_mode)) {
+            output->kind = MK_directory;
+            ok = memo_writePath(fd, output, 0);
+        } else if (S_ISREG(st.st_mode)) {
+            output->kind = MK_file;
+            int file_fd = openat(host_fd, sub_path, O_RDONLY | O_CLOEXEC);
+            ok = file_fd != -1 && fstat(file_fd, &st) == 0 &&
+                memo_writePath(fd, output, st.st_size);
+            if (ok && st.st_size != 0) {
+                char *contents = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, file_fd, 0);
+                ok = contents != MAP_FAILED && write_all(fd, contents, st.st_size);
+                if (contents != MAP_FAILED) munmap(contents, st.st_size);
+            }
+            if (file_fd != -1) close(file_fd);
+        } else {
+            ok = false;
+        }
+    }
+    ok = ok && write_all(fd, memo.stdio, memo.stdio_len);
+    close(fd);
+    if (!ok || renameat(dir_fd, tmp_name, dir_fd, name) == -1)
+        unlinkat(dir_fd, tmp_name, 0);
+}
+
+/// One path of a memo file.
+struct MemoRecord {
+    char path[PATH_MAX + 32];
+    enum MemoKind kind;
+    uint64_t hash;
+    const char *contents;
+    uint64_t contents_len;
+};
+
+/// Reads the path at *pos of a memo file, or returns false if the file
+/// ends or is malformed there.
+static bool memo_readPath(const char *file, size_t file_len, size_t *pos, struct MemoRecord *record) {
+    uint32_t path_len, kind;
+    if (file_len - *pos < sizeof(path_len)) return false;
+    memcpy(&path_len, file + *pos, sizeof(path_len));
+    *pos += sizeof(path_len);
+    if (path_len >= sizeof(record->path) || file_len - *pos < path_len + 4 + 8 + 8) return false;
+    memcpy(record->path, file + *pos, path_len);
+    record->path[path_len] = 0;
+    *pos += path_len;
+    memcpy(&kind, file + *pos, 4);
+    memcpy(&record->hash, file + *pos + 4, 8);
+    memcpy(&record->contents_len, file + *pos + 12, 8);
+    *pos += 4 + 8 + 8;
+    record->kind = kind;
+    if (file_len - *pos < record->contents_len) return false;
+    record->contents = file + *pos;
+    *pos += record->contents_len;
+    return true;
+}
+
+/// Replays the memo for key from dir_fd if every input it recorded is
+/// unchanged: writes its outputs, then its stdout and stderr, and stores
+/// its exit code. Returns false, having changed nothing, when there is no
+/// such memo or an input differs.
+static bool memo_replay(const struct FdTable *fds, int dir_fd, uint64_t key, int *exit_code) {
+    char name[32];
+    memo_name(name, sizeof(name), key);
+    int fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return false;
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(struct MemoHeader)) {
+        close(fd);
+        return false;
+    }
+    size_t file_len = st.st_size;
+    char *file = mmap(NULL, file_len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (file == MAP_FAILED) return false;
+
+    struct MemoHeader header;
+    memcpy(&header, file, sizeof(header));
+    uint32_t records_len = header.inputs_len + header.outputs_len;
+    struct MemoRecord record;
+    int host_fd;
+    const char *sub_path;
+
+    // Check the whole file and every input before touching anything.
+    bool ok = header.key == key;
+    size_t pos = sizeof(header);
+    for (uint32_t i = 0; ok && i < records_len; i += 1) {
+        ok = memo_readPath(file, file_len, &pos, &record) &&
+            memo_resolve(fds, record.path, &host_fd, &sub_path);
+        if (ok && i < header.inputs_len) {
+            enum MemoKind kind;
+            uint64_t hash;
+            memo_pathState(host_fd, sub_path, &kind, &hash);
+            ok = kind != MK_other && kind == record.kind && hash == record.hash;
+        }
+    }
+    size_t stdio_pos = pos;
+    while (ok && pos < file_len) {
+        uint32_t stdio_fd, len;
+        ok = file_len - pos >= 8;
+        if (!ok) break;
+        memcpy(&stdio_fd, file + pos, 4);
+        memcpy(&len, file + pos + 4, 4);
+        pos += 8;
+        ok = find_preopen(fds, stdio_fd) != NULL && file_len - pos >= len;
+        pos += len;
+    }
+    if (!ok) {
+        munmap(file, file_len);
+        return false;
+    }
+
+    // Outputs are in the order the run first touched them, so directories
+    // come before their files.
+    pos = sizeof(header);
+    for (uint32_t i = 0; i < records_len; i += 1) {
+        memo_readPath(file, file_len, &pos, &record);
+        if (i < header.inputs_len) continue;
+        memo_resolve(fds, record.path, &host_fd, &sub_path);
+        if (record.kind == MK_directory) {
+            mkdirat(host_fd, sub_path, 0777);
+        } else if (record.kind == MK_file) {
+            int out_fd = openat(host_fd, sub_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (out_fd == -1 || !write_all(out_fd, record.contents, record.contents_len))
+                panic("unable to replay memoized output");
+            close(out_fd);
+        } else {
+            unlinkat(host_fd, sub_path, 0);
+        }
+    }
+    for (pos = stdio_pos; pos < file_len;) {
+        uint32_t stdio_fd, len;
+        memcpy(&stdio_fd, file + pos, 4);
+        memcpy(&len, file + pos + 4, 4);
+        write_all(find_preopen(fds, stdio_fd)->host_fd, file + pos + 8, len);
+        pos += 8 + len;
+    }
+    munmap(file, file_len);
+    *exit_code = header.exit_code;
+    return true;
+}
+
+static enum wasi_errno_t to_wasi_err(int err) {
+    switch (err) {
+        case E2BIG: return WASI_E2BIG;
+        case EACCES: return WASI_EACCES;
+        case EADDRINUSE: return WASI_EADDRINUSE;
+        case EADDRNOTAVAIL: return WASI_EADDRNOTAVAIL;
+        case EAFNOSUPPORT: return WASI_EAFNOSUPPORT;
+        case EAGAIN: return WASI_EAGAIN;
+        case EALREADY: return WASI_EALREADY;
+        case EBADF: return WASI_EBADF;
+        case EBADMSG: return WASI_EBADMSG;
+        case EBUSY: return WASI_EBUSY;
+        case ECANCELED: return WASI_ECANCELED;
+        case ECHILD: return WASI_ECHILD;
+        case ECONNABORTED: return WASI_ECONNABORTED;
+        case ECONNREFUSED: return WASI_ECONNREFUSED;
+        case ECONNRESET: return WASI_ECONNRESET;
+        case EDEADLK: return WASI_EDEADLK;
+        case EDESTADDRREQ: return WASI_EDESTADDRREQ;
+        case EDOM: return WASI_EDOM;
+        case EDQUOT: return WASI_EDQUOT;
+        case EEXIST: return WASI_EEXIST;
+        case EFAULT: return WASI_EFAULT;
+        case EFBIG: return WASI_EFBIG;
+        case EHOSTUNREACH: return WASI_EHOSTUNREACH;
+        case EIDRM: return WASI_EIDRM;
+        case EILSEQ: return WASI_EILSEQ;
+        case EINPROGRESS: return WASI_EINPROGRESS;
+        case EINTR: return WASI_EINTR;
+        case EINVAL: return WASI_EINVAL;
+        case EIO: return WASI_EIO;
+        case EISCONN: return WASI_EISCONN;
+        case EISDIR: return WASI_EISDIR;
+        case ELOOP: return WASI_ELOOP;
+        case EMFILE: return WASI_EMFILE;
+        case EMLINK: return WASI_EMLINK;
+        case EMSGSIZE: return WASI_EMSGSIZE;
+        case EMULTIHOP: return WASI_EMULTIHOP;
+        case ENAMETOOLONG: return WASI_ENAMETOOLONG;
+        case ENETDOWN: return WASI_ENETDOWN;
+        case ENETRESET: return WASI_ENETRESET;
+        case ENETUNREACH: return WASI_ENETUNREACH;
+        case ENFILE: return WASI_ENFILE;
+        case ENOBUFS: return WASI_ENOBUFS;
+        case ENODEV: return WASI_ENODEV;
+        case ENOENT: return WASI_ENOENT;
+        case ENOEXEC: return WASI_ENOEXEC;
+        case ENOLCK: return WASI_ENOLCK;
+        case ENOLINK: return WASI_ENOLINK;
+        case ENOMEM: return WASI_ENOMEM;
+        case ENOMSG: return WASI_ENOMSG;
+        case ENOPROTOOPT: return WASI_ENOPROTOOPT;
+        case ENOSPC: return WASI_ENOSPC;
+        case ENOSYS: return WASI_ENOSYS;
+        case ENOTCONN: return WASI_ENOTCONN;
+        case ENOTDIR: return WASI_ENOTDIR;
+        case ENOTEMPTY: return WASI_ENOTEMPTY;
+        case ENOTRECOVERABLE: return WASI_ENOTRECOVERABLE;
+        case ENOTSOCK: return WASI_ENOTSOCK;
         case EOPNOTSUPP: return WASI_EOPNOTSUPP;
         case ENOTTY: return WASI_ENOTTY;
         case ENXIO: return WASI_ENXIO;
@@ -1012,39 +2163,67 @@ static enum wasi_errno_t finish_wasi_stat(struct VirtualMachine *vm,
     return WASI_ESUCCESS;
 }
 
+/// Sizes of a NULL terminated string list, as args_sizes_get and
+/// environ_sizes_get return them.
+static enum wasi_errno_t wasi_strings_sizes_get(struct VirtualMachine *vm,
+    const char **strings, uint32_t count, uint32_t buf_size)
+{
+    uint32_t strings_len = 0;
+    size_t buf_len = 0;
+    while (strings != NULL && strings[strings_len]) {
+        buf_len += strlen(strings[strings_len]) + 1;
+        strings_len += 1;
+    }
+    write_u32_le(vm->memory + count, strings_len);
+    write_u32_le(vm->memory + buf_size, buf_len);
+    return WASI_ESUCCESS;
+}
+
+/// Copies a NULL terminated string list into the guest, as args_get and
+/// environ_get do.
+static enum wasi_errno_t wasi_strings_get(struct VirtualMachine *vm,
+    const char **strings, uint32_t ptrs, uint32_t buf)
+{
+    uint32_t buf_i = 0;
+    for (uint32_t string_i = 0; strings != NULL && strings[string_i]; string_i += 1) {
+        const char *string = strings[string_i];
+        // Write the string to the buffer.
+        uint32_t string_ptr = buf + buf_i;
+        uint32_t string_len = strlen(string) + 1;
+        memcpy(vm->memory + buf + buf_i, string, string_len);
+        buf_i += string_len;
+
+        write_u32_le(vm->memory + ptrs + 4 * string_i, string_ptr);
+    }
+    return WASI_ESUCCESS;
+}
+
 /// fn args_sizes_get(argc: *usize, argv_buf_size: *usize) errno_t;
 static enum wasi_errno_t wasi_args_sizes_get(struct VirtualMachine *vm,
     uint32_t argc, uint32_t argv_buf_size)
 {
-    uint32_t args_len = 0;
-    size_t buf_size = 0;
-    while (vm->args[args_len]) {
-        buf_size += strlen(vm->args[args_len]) + 1;
-        args_len += 1;
-    }
-    write_u32_le(vm->memory + argc, args_len);
-    write_u32_le(vm->memory + argv_buf_size, buf_size);
-    return WASI_ESUCCESS;
+    return wasi_strings_sizes_get(vm, vm->args, argc, argv_buf_size);
 }
 
 /// extern fn args_get(argv: [*][*:0]u8, argv_buf: [*]u8) errno_t;
 static enum wasi_errno_t wasi_args_get(struct VirtualMachine *vm,
     uint32_t argv, uint32_t argv_buf)
 {
-    uint32_t argv_buf_i = 0;
-    uint32_t arg_i = 0;
-    for (;; arg_i += 1) {
-        const char *arg = vm->args[arg_i];
-        if (!arg) break;
-        // Write the arg to the buffer.
-        uint32_t argv_ptr = argv_buf + argv_buf_i;
-        uint32_t arg_len = strlen(arg) + 1;
-        memcpy(vm->memory + argv_buf + argv_buf_i, arg, arg_len);
-        argv_buf_i += arg_len;
-
-        write_u32_le(vm->memory + argv + 4 * arg_i , argv_ptr);
-    }
-    return WASI_ESUCCESS;
+    return wasi_strings_get(vm, vm->args, argv, argv_buf);
+}
+
+/// fn environ_sizes_get(environ_count: *usize, environ_buf_size: *usize) errno_t;
+static enum wasi_errno_t wasi_environ_sizes_get(struct VirtualMachine *vm,
+    uint32_t environ_count, uint32_t environ_buf_size)
+{
+    return wasi_strings_sizes_get(vm, vm->env, environ_count, environ_buf_size);
+}
+
+/// extern fn environ_get(environ: [*][*:0]u8, environ_buf: [*]u8) errno_t;
+static enum wasi_errno_t wasi_environ_get(struct VirtualMachine *vm,
+    uint32_t environ, uint32_t environ_buf)
+{
+    return wasi_strings_get(vm, vm->env, environ, environ_buf);
 }
 
 /// extern fn random_get(buf: [*]u8, buf_len: usize) errno_t;
@@ -1071,7 +2250,7 @@ static enum wasi_errno_t wasi_random_get(struct VirtualMachine *vm,
 static enum wasi_errno_t wasi_fd_prestat_get(struct VirtualMachine *vm,
     int32_t fd, uint32_t buf)
 {
-    const struct Preopen *preopen = find_preopen(fd);
+    const struct Preopen *preopen = find_preopen(&vm->fds, fd);
     if (!preopen) return WASI_EBADF;
     write_u32_le(vm->memory + buf + 0, 0);
     write_u32_le(vm->memory + buf + 4, preopen->name_len);
@@ -1082,7 +2261,7 @@ static enum wasi_errno_t wasi_fd_prestat_get(struct VirtualMachine *vm,
 static enum wasi_errno_t wasi_fd_prestat_dir_name(struct VirtualMachine *vm,
         int32_t fd, uint32_t path, uint32_t path_len)
 {
-    const struct Preopen *preopen = find_preopen(fd);
+    const struct Preopen *preopen = find_preopen(&vm->fds, fd);
     if (!preopen) return WASI_EBADF;
     if (path_len != preopen->name_len)
         panic("wasi_fd_prestat_dir_name expects correct name_len");
@@ -1092,8 +2271,14 @@ static enum wasi_errno_t wasi_fd_prestat_dir_name(struct VirtualMachine *vm,
 
 /// extern fn fd_close(fd: fd_t) errno_t;
 static enum wasi_errno_t wasi_fd_close(struct VirtualMachine *vm, int32_t fd) {
-    int host_fd = to_host_fd(fd);
-    close(host_fd);
+    // Preopens and fds the guest did not open may be shared with other
+    // instances, so only the guest's own fds are really closed.
+    if (find_preopen(&vm->fds, fd) != NULL) return WASI_ESUCCESS;
+    if (fd < 0 || fd >= max_tracked_fds) return WASI_EBADF;
+    if ((vm->fds.guest_fds[fd / 8] & (1 << (fd % 8))) == 0) return WASI_EBADF;
+    vm->fds.guest_fds[fd / 8] &= ~(1 << (fd % 8));
+    if (memo.recording) memo_closed(fd);
+    close(fd);
     return WASI_ESUCCESS;
 }
 
@@ -1104,7 +2289,10 @@ static enum wasi_errno_t wasi_fd_read(
     uint32_t iovs_len, // usize
     uint32_t nread // *usize
 ) {
-    int host_fd = to_host_fd(fd);
+    int host_fd = to_host_fd(vm, fd);
+    if (host_fd == -1) return WASI_EBADF;
+    // What the guest reads from stdin is not recorded.
+    if (memo.recording && fd == 0) memo.unusable = true;
     uint32_t i = 0;
     size_t total_read = 0;
     for (; i < iovs_len; i += 1) {
@@ -1127,13 +2315,16 @@ static enum wasi_errno_t wasi_fd_read(
 static enum wasi_errno_t wasi_fd_write(struct VirtualMachine *vm,
         int32_t fd, uint32_t iovs, uint32_t iovs_len, uint32_t nwritten)
 {
-    int host_fd = to_host_fd(fd);
+    int host_fd = to_host_fd(vm, fd);
+    if (host_fd == -1) return WASI_EBADF;
     size_t total_written = 0;
     for (uint32_t i = 0; i < iovs_len; i += 1) {
         uint32_t ptr = read_u32_le(vm->memory + iovs + i * 8 + 0);
         uint32_t len = read_u32_le(vm->memory + iovs + i * 8 + 4);
         ssize_t written = write(host_fd, vm->memory + ptr, len);
         if (written < 0) return to_wasi_err(errno);
+        if (memo.recording && (fd == 1 || fd == 2) && find_preopen(&vm->fds, fd) != NULL)
+            memo_stdio(fd, vm->memory + ptr, written);
         total_written += written;
         if (written != len) break;
     }
@@ -1149,7 +2340,8 @@ static enum wasi_errno_t wasi_fd_pwrite(
     uint64_t offset, // wasi.filesize_t,
     uint32_t written_ptr // *usize
 ) {
-    int host_fd = to_host_fd(fd);
+    int host_fd = to_host_fd(vm, fd);
+    if (host_fd == -1) return WASI_EBADF;
     uint32_t i = 0;
     size_t written = 0;
     for (; i < iovs_len; i += 1) {
@@ -1191,7 +2383,8 @@ static enum wasi_errno_t wasi_path_open(
     memcpy(sub_path, vm->memory + path, path_len);
     sub_path[path_len] = 0;
 
-    int host_fd = to_host_fd(dirfd);
+    int host_fd = to_host_fd(vm, dirfd);
+    if (host_fd == -1) return WASI_EBADF;
     uint32_t flags =
         (((oflags & WASI_O_CREAT) != 0) ? O_CREAT : 0) |
         (((oflags & WASI_O_DIRECTORY) != 0) ? O_DIRECTORY : 0) |
@@ -1211,9 +2404,21 @@ static enum wasi_errno_t wasi_path_open(
     } else if ((fs_rights_base & WASI_RIGHT_FD_READ) != 0) {
         flags |= O_RDONLY; // no-op because O_RDONLY is 0
     }
+    if (memo.recording) {
+        // Whatever a write does not truncate away is an input too.
+        if ((flags & O_TRUNC) == 0) memo_input(vm, dirfd, sub_path);
+        if ((flags & (O_ACCMODE | O_CREAT | O_TRUNC)) != O_RDONLY) memo_output(vm, dirfd, sub_path);
+    }
     mode_t mode = 0644;
     int res_fd = openat(host_fd, sub_path, flags, mode);
     if (res_fd == -1) return to_wasi_err(errno);
+    // An fd that cannot be tracked would never be closed by inst_reset.
+    if (res_fd >= max_tracked_fds) {
+        close(res_fd);
+        return WASI_EMFILE;
+    }
+    vm->fds.guest_fds[res_fd / 8] |= 1 << (res_fd % 8);
+    if (memo.recording) memo_opened(vm, dirfd, sub_path, res_fd);
     write_u32_le(vm->memory + fd, res_fd);
     return WASI_ESUCCESS;
 }
@@ -1230,7 +2435,9 @@ static enum wasi_errno_t wasi_path_filestat_get(
     memcpy(sub_path, vm->memory + path, path_len);
     sub_path[path_len] = 0;
 
-    int host_fd = to_host_fd(fd);
+    int host_fd = to_host_fd(vm, fd);
+    if (host_fd == -1) return WASI_EBADF;
+    if (memo.recording) memo_input(vm, fd, sub_path);
     struct stat st;
     if (fstatat(host_fd, sub_path, &st, 0) == -1) return to_wasi_err(errno);
     return finish_wasi_stat(vm, buf, st);
@@ -1244,7 +2451,12 @@ static enum wasi_errno_t wasi_path_create_directory(struct VirtualMachine *vm,
     memcpy(sub_path, vm->memory + path, path_len);
     sub_path[path_len] = 0;
 
-    int host_fd = to_host_fd(wasi_fd);
+    int host_fd = to_host_fd(vm, wasi_fd);
+    if (host_fd == -1) return WASI_EBADF;
+    if (memo.recording) {
+        memo_input(vm, wasi_fd, sub_path);
+        memo_output(vm, wasi_fd, sub_path);
+    }
     if (mkdirat(host_fd, sub_path, 0777) == -1) return to_wasi_err(errno);
     return WASI_ESUCCESS;
 }
@@ -1266,15 +2478,26 @@ static enum wasi_errno_t wasi_path_rename(
     memcpy(new_path, vm->memory + new_path_ptr, new_path_len);
     new_path[new_path_len] = 0;
 
-    int old_host_fd = to_host_fd(old_fd);
-    int new_host_fd = to_host_fd(new_fd);
+    int old_host_fd = to_host_fd(vm, old_fd);
+    int new_host_fd = to_host_fd(vm, new_fd);
+    if (old_host_fd == -1 || new_host_fd == -1) return WASI_EBADF;
+    if (memo.recording) {
+        // Outputs are saved as paths, so the files under a moved directory
+        // would be lost.
+        struct stat st;
+        if (fstatat(old_host_fd, old_path, &st, 0) == 0 && S_ISDIR(st.st_mode)) memo.unusable = true;
+        memo_input(vm, old_fd, old_path);
+        memo_output(vm, old_fd, old_path);
+        memo_output(vm, new_fd, new_path);
+    }
     if (renameat(old_host_fd, old_path, new_host_fd, new_path) == -1) return to_wasi_err(errno);
     return WASI_ESUCCESS;
 }
 
 /// extern fn fd_filestat_get(fd: fd_t, buf: *filestat_t) errno_t;
 static enum wasi_errno_t wasi_fd_filestat_get(struct VirtualMachine *vm, int32_t fd, uint32_t buf) {
-    int host_fd = to_host_fd(fd);
+    int host_fd = to_host_fd(vm, fd);
+    if (host_fd == -1) return WASI_EBADF;
     struct stat st;
     if (fstat(host_fd, &st) == -1) return to_wasi_err(errno);
     return finish_wasi_stat(vm, buf, st);
@@ -1283,7 +2506,8 @@ static enum wasi_errno_t wasi_fd_filestat_get(struct VirtualMachine *vm, int32_t
 static enum wasi_errno_t wasi_fd_filestat_set_size( struct VirtualMachine *vm,
         int32_t fd, uint64_t size)
 {
-    int host_fd = to_host_fd(fd);
+    int host_fd = to_host_fd(vm, fd);
+    if (host_fd == -1) return WASI_EBADF;
     if (ftruncate(host_fd, size) == -1) return to_wasi_err(errno);
     return WASI_ESUCCESS;
 }
@@ -1296,7 +2520,8 @@ static enum wasi_errno_t wasi_fd_filestat_set_size( struct VirtualMachine *vm,
 ///     fs_rights_inheriting: rights_t, u64
 /// };
 static enum wasi_errno_t wasi_fd_fdstat_get(struct VirtualMachine *vm, int32_t fd, uint32_t buf) {
-    int host_fd = to_host_fd(fd);
+    int host_fd = to_host_fd(vm, fd);
+    if (host_fd == -1) return WASI_EBADF;
     struct stat st;
     if (fstat(host_fd, &st) == -1) return to_wasi_err(errno);
     write_u16_le(vm->memory + buf + 0x00, to_wasi_filetype(st.st_mode));
@@ -1363,10 +2588,12 @@ static enum StackType Label_operandType(const struct Label *label, uint32_t inde
 }
 
 #define max_stack_depth (1 << 12)
+#define max_small_move_len 16
 
 struct StackInfo {
     uint32_t top_index;
     uint32_t top_offset;
+    uint32_t max_offset;
     uint32_t types[max_stack_depth >> 5];
     uint32_t offsets[max_stack_depth];
 };
@@ -1380,10 +2607,12 @@ static enum StackType si_local(const struct StackInfo *si, uint32_t local_idx) {
 }
 
 static void si_push(struct StackInfo *si, enum StackType entry_type) {
+    if (si->top_index == max_stack_depth) panic("function exceeds max stack depth");
     bs_setValue(si->types, si->top_index, entry_type);
     si->offsets[si->top_index] = si->top_offset;
     si->top_index += 1;
     si->top_offset += 1 + entry_type;
+    if (si->top_offset > si->max_offset) si->max_offset = si->top_offset;
 }
 
 static void si_pop(struct StackInfo *si, enum StackType entry_type) {
@@ -1393,12 +2622,86 @@ static void si_pop(struct StackInfo *si, enum StackType entry_type) {
     assert(si->top_offset == si->offsets[si->top_index]);
 }
 
-static void vm_decodeCode(struct VirtualMachine *vm, struct TypeInfo *func_type_info,
-    uint32_t *code_i, struct ProgramCounter *pc, struct StackInfo *stack)
+/// A type the decoding of a function looked at: type index ref, or the
+/// type of function id ref when dep_function_bit is set.
+struct DecodeDep {
+    uint32_t ref;
+    struct TypeInfo type;
+};
+
+#define dep_function_bit 0x80000000u
+
+/// Decoding state of one thread. Code is written into opcodes and
+/// operands; when relocs is not NULL the operand index of every branch
+/// target written is recorded there so that the code can be moved.
+struct Decoder {
+    uint8_t *opcodes;
+    uint32_t *operands;
+    uint32_t *relocs;
+    uint32_t relocs_len;
+    /// When set, functions are looked up here before being decoded, and
+    /// every function is appended to fn_out for the next run.
+    const struct FnCache *fn_cache;
+    struct DecodeDep *deps;
+    uint32_t deps_len;
+    uint32_t deps_cap;
+    char *fn_out;
+    size_t fn_out_len;
+    size_t fn_out_cap;
+    struct StackInfo stack;
+    struct Label labels[1 << 9];
+};
+
+static void dec_init(struct Decoder *dec, uint8_t *opcodes, uint32_t *operands,
+    uint32_t *relocs, const struct FnCache *fn_cache)
+{
+    dec->opcodes = opcodes;
+    dec->operands = operands;
+    dec->relocs = relocs;
+    dec->relocs_len = 0;
+    dec->fn_cache = fn_cache;
+    dec->deps = NULL;
+    dec->deps_len = 0;
+    dec->deps_cap = 0;
+    dec->fn_out = NULL;
+    dec->fn_out_len = 0;
+    dec->fn_out_cap = 0;
+}
+
+static void dec_deinit(struct Decoder *dec) {
+    free(dec->deps);
+    free(dec->fn_out);
+}
+
+static void dec_addDep(struct Decoder *dec, uint32_t ref, const struct TypeInfo *type) {
+    if (dec->fn_cache == NULL) return;
+    if (dec->deps_len == dec->deps_cap) {
+        dec->deps_cap = dec->deps_cap * 2 + 16;
+        dec->deps = realloc(dec->deps, sizeof(struct DecodeDep) * dec->deps_cap);
+        if (dec->deps == NULL) panic("out of memory");
+    }
+    dec->deps[dec->deps_len].ref = ref;
+    dec->deps[dec->deps_len].type = *type;
+    dec->deps_len += 1;
+}
+
+static void dec_setTarget(struct Decoder *dec, uint32_t ref, struct ProgramCounter target) {
+    dec->operands[ref + 0] = target.opcode;
+    dec->operands[ref + 1] = target.operand;
+    if (dec->relocs != NULL) {
+        dec->relocs[dec->relocs_len] = ref;
+        dec->relocs_len += 1;
+    }
+}
+
+static void vm_decodeCode(struct VirtualMachine *vm, struct Decoder *dec,
+    struct TypeInfo *func_type_info, uint32_t *code_i, struct ProgramCounter *pc)
 {
-    const char *mod_ptr = vm->mod_ptr;
-    uint8_t *opcodes = vm->opcodes;
-    uint32_t *operands = vm->operands;
+    const char *mod_ptr = vm->module->mod_ptr;
+    uint8_t *opcodes = dec->opcodes;
+    uint32_t *operands = dec->operands;
+    struct StackInfo *stack = &dec->stack;
+    struct Label *labels = dec->labels;
 
     // push return address
     uint32_t frame_size = stack->top_offset;
@@ -1407,7 +2710,6 @@ static void vm_decodeCode(struct VirtualMachine *vm, struct TypeInfo *func_type_
 
     uint32_t unreachable_depth = 0;
     uint32_t label_i = 0;
-    static struct Label labels[1 << 9];
 #ifndef NDEBUG
     memset(labels, 0xaa, sizeof(struct Label) * (1 << 9)); // to match the zig version
 #endif
@@ -1420,6 +2722,7 @@ static void vm_decodeCode(struct VirtualMachine *vm, struct TypeInfo *func_type_
     enum {
         State_default,
         State_bool_not,
+        State_const_32,
     } state = State_default;
 
     for (;;) {
@@ -1778,7 +3081,10 @@ static void vm_decodeCode(struct VirtualMachine *vm, struct TypeInfo *func_type_
                                 break;
                             default: panic("unexpected param type");
                         }
-                    } else label->type_info = vm->types[block_type];
+                    } else {
+                        label->type_info = vm->module->types[block_type];
+                        dec_addDep(dec, block_type, &label->type_info);
+                    }
 
                     uint32_t param_i = label->type_info.param_count;
                     while (param_i > 0) {
@@ -1854,8 +3160,7 @@ static void vm_decodeCode(struct VirtualMachine *vm, struct TypeInfo *func_type_
                     pc->operand += 3;
                 } else unreachable_depth = 0;
 
-                operands[label->extra.else_ref + 0] = pc->opcode;
-                operands[label->extra.else_ref + 1] = pc->operand;
+                dec_setTarget(dec, label->extra.else_ref, *pc);
                 for (uint32_t param_i = 0; param_i < label->type_info.param_count; param_i += 1)
                     si_push(stack, bs_isSet(&label->type_info.param_types, param_i));
             }
@@ -1865,15 +3170,12 @@ static void vm_decodeCode(struct VirtualMachine *vm, struct TypeInfo *func_type_
             if (unreachable_depth <= 1) {
                 struct Label *label = &labels[label_i];
                 struct ProgramCounter *target_pc = (label->opcode == WasmOp_loop) ? &label->extra.loop_pc : pc;
-                if (label->opcode == WasmOp_if) {
-                    operands[label->extra.else_ref + 0] = target_pc->opcode;
-                    operands[label->extra.else_ref + 1] = target_pc->operand;
-                }
+                if (label->opcode == WasmOp_if)
+                    dec_setTarget(dec, label->extra.else_ref, *target_pc);
                 uint32_t ref = label->ref_list;
                 while (ref != UINT32_MAX) {
                     uint32_t next_ref = operands[ref];
-                    operands[ref + 0] = target_pc->opcode;
-                    operands[ref + 1] = target_pc->operand;
+                    dec_setTarget(dec, ref, *target_pc);
                     ref = next_ref;
                 }
 
@@ -2078,20 +3380,21 @@ static void vm_decodeCode(struct VirtualMachine *vm, struct TypeInfo *func_type_
                 uint32_t fn_id = read32_uleb128(mod_ptr, code_i);
                 if (unreachable_depth == 0) {
                     uint32_t type_idx;
-                    if (fn_id < vm->imports_len) {
+                    if (fn_id < vm->module->imports_len) {
                         opcodes[pc->opcode + 0] = Op_call_import;
                         opcodes[pc->opcode + 1] = fn_id;
                         pc->opcode += 2;
-                        type_idx = vm->imports[fn_id].type_idx;
+                        type_idx = vm->module->imports[fn_id].type_idx;
                     } else {
-                        uint32_t fn_idx = fn_id - vm->imports_len;
+                        uint32_t fn_idx = fn_id - vm->module->imports_len;
                         opcodes[pc->opcode] = Op_call_func;
                         pc->opcode += 1;
                         operands[pc->operand] = fn_idx;
                         pc->operand += 1;
-                        type_idx = vm->functions[fn_idx].type_idx;
+                        type_idx = vm->module->functions[fn_idx].type_idx;
                     }
-                    struct TypeInfo *type_info = &vm->types[type_idx];
+                    struct TypeInfo *type_info = &vm->module->types[type_idx];
+                    dec_addDep(dec, fn_id | dep_function_bit, type_info);
 
                     for (uint32_t param_i = type_info->param_count; param_i > 0; ) {
                         param_i -= 1;
@@ -2111,7 +3414,8 @@ static void vm_decodeCode(struct VirtualMachine *vm, struct TypeInfo *func_type_
                     opcodes[pc->opcode] = Op_call_indirect;
                     pc->opcode += 1;
 
-                    struct TypeInfo *type_info = &vm->types[type_idx];
+                    struct TypeInfo *type_info = &vm->module->types[type_idx];
+                    dec_addDep(dec, type_idx, type_info);
                     for (uint32_t param_i = type_info->param_count; param_i > 0; ) {
                         param_i -= 1;
                         si_pop(stack, bs_isSet(&type_info->param_types, param_i));
@@ -2605,21 +3909,72 @@ static void vm_decodeCode(struct VirtualMachine *vm, struct TypeInfo *func_type_
             case WasmOp_prefixed:
             switch (prefixed_opcode) {
                 case WasmPrefixedOp_memory_copy:
-                if (mod_ptr[*code_i + 0] != 0 || mod_ptr[*code_i + 1] != 0)
-                    panic("unexpected memory index");
-                *code_i += 2;
-                if (unreachable_depth == 0) {
-                    opcodes[pc->opcode] = Op_memcpy;
-                    pc->opcode += 1;
-                }
-                break;
-
                 case WasmPrefixedOp_memory_fill:
                 if (mod_ptr[*code_i] != 0) panic("unexpected memory index");
                 *code_i += 1;
+                if (prefixed_opcode == WasmPrefixedOp_memory_copy) {
+                    if (mod_ptr[*code_i] != 0) panic("unexpected memory index");
+                    *code_i += 1;
+                }
                 if (unreachable_depth == 0) {
-                    opcodes[pc->opcode] = Op_memset;
-                    pc->opcode += 1;
+                    // A small constant length replaces the const instruction
+                    // that pushed it with an inline move.
+                    uint32_t small_len = UINT32_MAX;
+                    if (state == State_const_32) {
+                        switch ((enum Op)opcodes[pc->opcode - 1]) {
+                            case Op_const_0_32: small_len = 0; break;
+                            case Op_const_1_32: small_len = 1; break;
+                            case Op_const_32: small_len = operands[pc->operand - 1]; break;
+                            default: break;
+                        }
+                    }
+                    if (small_len <= max_small_move_len) {
+                        pc->opcode -= 1;
+                        if (opcodes[pc->opcode] == Op_const_32) pc->operand -= 1;
+                        switch (prefixed_opcode) {
+                            case WasmPrefixedOp_memory_copy: opcodes[pc->opcode] = Op_memcpy_small; break;
+                            case WasmPrefixedOp_memory_fill: opcodes[pc->opcode] = Op_memset_small; break;
+                            default: panic("unexpected opcode");
+                        }
+                        pc->opcode += 1;
+                        operands[pc->operand] = small_len;
+                        pc->operand += 1;
+                    } else {
+                        switch (prefixed_opcode) {
+                            case WasmPrefixedOp_memory_copy: opcodes[pc->opcode] = Op_memcpy; break;
+                            case WasmPrefixedOp_memory_fill: opcodes[pc->opcode] = Op_memset; break;
+                            default: panic("unexpected opcode");
+                        }
+                        pc->opcode += 1;
+                    }
+                }
+                break;
+
+                case WasmPrefixedOp_memory_init:
+                {
+                    uint32_t data_idx = read32_uleb128(mod_ptr, code_i);
+                    if (data_idx >= vm->module->datas_len) panic("invalid data index");
+                    if (mod_ptr[*code_i] != 0) panic("unexpected memory index");
+                    *code_i += 1;
+                    if (unreachable_depth == 0) {
+                        opcodes[pc->opcode] = Op_memory_init;
+                        pc->opcode += 1;
+                        operands[pc->operand] = data_idx;
+                        pc->operand += 1;
+                    }
+                }
+                break;
+
+                case WasmPrefixedOp_data_drop:
+                {
+                    uint32_t data_idx = read32_uleb128(mod_ptr, code_i);
+                    if (data_idx >= vm->module->datas_len) panic("invalid data index");
+                    if (unreachable_depth == 0) {
+                        opcodes[pc->opcode] = Op_data_drop;
+                        pc->opcode += 1;
+                        operands[pc->operand] = data_idx;
+                        pc->operand += 1;
+                    }
                 }
                 break;
 
@@ -2628,8 +3983,9 @@ static void vm_decodeCode(struct VirtualMachine *vm, struct TypeInfo *func_type_
             break;
         }
         switch (opcode) {
-            default:             state = State_default;  break;
-            case WasmOp_i32_eqz: state = State_bool_not; break;
+            default:               state = State_default;  break;
+            case WasmOp_i32_eqz:   state = State_bool_not; break;
+            case WasmOp_i32_const: state = State_const_32; break;
         }
 
         //for (uint32_t i = old_pc.opcode; i < pc->opcode; i += 1) {
@@ -2641,52 +3997,402 @@ static void vm_decodeCode(struct VirtualMachine *vm, struct TypeInfo *func_type_
     }
 }
 
-static void vm_push_u32(struct VirtualMachine *vm, uint32_t value) {
-    vm->stack[vm->stack_top + 0] = value;
-    vm->stack_top += 1;
-}
+/// Bump whenever the decoder output or the layout of FnCacheEntry changes.
+#define fn_cache_format_version 1
 
-static void vm_push_i32(struct VirtualMachine *vm, int32_t value) {
-    vm_push_u32(vm, (uint32_t)value);
-}
+static const char fn_cache_magic[8] = "zwasfn";
+static const char fn_cache_name[] = "functions";
 
-static void vm_push_u64(struct VirtualMachine *vm, uint64_t value) {
-    vm->stack[vm->stack_top + 0] = (uint32_t)(value >> 0);
-    vm->stack[vm->stack_top + 1] = (uint32_t)(value >> 32);
-    vm->stack_top += 2;
-}
+/// Decoded functions of earlier runs, found by the contents of their body
+/// so that a rebuilt module only has to decode the functions that changed.
+struct FnCache {
+    const char *pack;
+    size_t pack_len;
+    /// Open addressing table of entry offsets into pack; 0 is empty.
+    uint32_t *slots;
+    uint32_t slots_mask;
+};
 
-static void vm_push_i64(struct VirtualMachine *vm, int64_t value) {
-    vm_push_u64(vm, (uint64_t)value);
-}
+struct FnCacheHeader {
+    char magic[8];
+    uint64_t engine;
+    uint32_t entries_len;
+    uint32_t reserved;
+};
 
-static void vm_push_f32(struct VirtualMachine *vm, float value) {
-    uint32_t integer;
-    memcpy(&integer, &value, sizeof(integer));
-    vm_push_u32(vm, integer);
-}
+/// One decoded function. Branch targets are stored relative to the start
+/// of the function. Followed by the deps, relocs, operands, body and
+/// opcodes, padded to 8 bytes.
+struct FnCacheEntry {
+    uint64_t key;
+    struct TypeInfo type;
+    uint32_t imports_len;
+    uint32_t code_len;
+    uint32_t locals_size;
+    uint32_t max_stack_size;
+    uint32_t deps_len;
+    uint32_t relocs_len;
+    struct ProgramCounter code_size;
+};
 
-static void vm_push_f64(struct VirtualMachine *vm, double value) {
-    uint64_t integer;
-    memcpy(&integer, &value, sizeof(integer));
-    vm_push_u64(vm, integer);
+static size_t fc_entrySize(const struct FnCacheEntry *entry) {
+    return align_forward(sizeof(struct FnCacheEntry) +
+        sizeof(struct DecodeDep) * entry->deps_len +
+        sizeof(uint32_t) * entry->relocs_len +
+        sizeof(uint32_t) * entry->code_size.operand +
+        entry->code_len + entry->code_size.opcode, 8);
 }
 
-static uint32_t vm_pop_u32(struct VirtualMachine *vm) {
-    vm->stack_top -= 1;
-    return vm->stack[vm->stack_top + 0];
+static bool type_eql(const struct TypeInfo *a, const struct TypeInfo *b) {
+    return a->param_count == b->param_count && a->param_types == b->param_types &&
+        a->result_count == b->result_count && a->result_types == b->result_types;
 }
 
-static int32_t vm_pop_i32(struct VirtualMachine *vm) {
-    return (int32_t)vm_pop_u32(vm);
+/// Covers what a decoded body was checked against besides its
+/// dependencies: memory.init and data.drop name data segments, so a body
+/// is only reused in a module with as many of them.
+static uint64_t fc_key(const struct VirtualMachine *vm, const struct Function *func) {
+    const struct TypeInfo *type = &vm->module->types[func->type_idx];
+    uint64_t module_shape = (uint64_t)vm->module->datas_len << 32 | vm->module->imports_len;
+    uint64_t seed = hash_bytes(module_shape, (const char *)type, sizeof(struct TypeInfo));
+    return hash_bytes(seed, vm->module->mod_ptr + func->code_begin, func->code_len);
 }
 
-static uint64_t vm_pop_u64(struct VirtualMachine *vm) {
-    vm->stack_top -= 2;
-    return vm->stack[vm->stack_top + 0] | (uint64_t)vm->stack[vm->stack_top + 1] << 32;
+/// Maps the pack written by the previous run. Returns NULL when there is
+/// none or it was written by another build.
+static struct FnCache *fc_open(struct Arena *arena, int dir_fd) {
+    int fd = openat(dir_fd, fn_cache_name, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    const char *pack = MAP_FAILED;
+    if (fd != -1) {
+        if (fstat(fd, &st) != -1 && (size_t)st.st_size >= sizeof(struct FnCacheHeader) &&
+            (uint64_t)st.st_size <= UINT32_MAX)
+            pack = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+    }
+
+    struct FnCache *cache = arena_alloc(arena, sizeof(struct FnCache));
+    const struct FnCacheHeader *header = (const struct FnCacheHeader *)pack;
+    uint32_t entries_len = 0;
+    if (pack != MAP_FAILED && memcmp(header->magic, fn_cache_magic, sizeof(fn_cache_magic)) == 0 &&
+        header->engine == engine_hash() + fn_cache_format_version)
+    {
+        entries_len = header->entries_len;
+    } else if (pack != MAP_FAILED) {
+        munmap((void *)pack, st.st_size);
+        pack = MAP_FAILED;
+    }
+    cache->pack = pack != MAP_FAILED ? pack : NULL;
+    cache->pack_len = pack != MAP_FAILED ? (size_t)st.st_size : 0;
+
+    uint32_t slots_len = 16;
+    while (slots_len < entries_len * 2) slots_len *= 2;
+    cache->slots = arena_alloc(arena, sizeof(uint32_t) * slots_len);
+    memset(cache->slots, 0, sizeof(uint32_t) * slots_len);
+    cache->slots_mask = slots_len - 1;
+
+    size_t offset = sizeof(struct FnCacheHeader);
+    for (uint32_t entry_i = 0; entry_i < entries_len; entry_i += 1) {
+        if (offset + sizeof(struct FnCacheEntry) > (size_t)st.st_size) break;
+        const struct FnCacheEntry *entry = (const struct FnCacheEntry *)(pack + offset);
+        size_t entry_size = fc_entrySize(entry);
+        if (entry_size > (size_t)st.st_size - offset) break;
+        uint32_t slot_i = entry->key & cache->slots_mask;
+        while (cache->slots[slot_i] != 0) slot_i = (slot_i + 1) & cache->slots_mask;
+        cache->slots[slot_i] = offset;
+        offset += entry_size;
+    }
+    return cache;
 }
 
-static int64_t vm_pop_i64(struct VirtualMachine *vm) {
+static bool fc_matches(const struct VirtualMachine *vm, const struct Function *func,
+    const struct FnCacheEntry *entry)
+{
+    if (entry->code_len != func->code_len || entry->imports_len != vm->module->imports_len ||
+        !type_eql(&entry->type, &vm->module->types[func->type_idx])) return false;
+
+    const struct DecodeDep *deps = (const struct DecodeDep *)(entry + 1);
+    const char *body = (const char *)(deps + entry->deps_len) +
+        sizeof(uint32_t) * (entry->relocs_len + entry->code_size.operand);
+    if (memcmp(body, vm->module->mod_ptr + func->code_begin, func->code_len) != 0) return false;
+
+    // The same body decodes the same way as long as every type it looked
+    // at is unchanged.
+    for (uint32_t dep_i = 0; dep_i < entry->deps_len; dep_i += 1) {
+        uint32_t type_idx = deps[dep_i].ref;
+        if (type_idx & dep_function_bit) {
+            uint32_t fn_id = type_idx & ~dep_function_bit;
+            if (fn_id < vm->module->imports_len) {
+                type_idx = vm->module->imports[fn_id].type_idx;
+            } else if (fn_id - vm->module->imports_len < vm->module->functions_len) {
+                type_idx = vm->module->functions[fn_id - vm->module->imports_len].type_idx;
+            } else return false;
+        }
+        if (type_idx >= vm->module->types_len || !type_eql(&deps[dep_i].type, &vm->module->types[type_idx]))
+            return false;
+    }
+    return true;
+}
+
+static char *fc_reserve(struct Decoder *dec, size_t n) {
+    if (dec->fn_out_cap - dec->fn_out_len < n) {
+        while (dec->fn_out_cap - dec->fn_out_len < n) dec->fn_out_cap = dec->fn_out_cap * 2 + 4096;
+        dec->fn_out = realloc(dec->fn_out, dec->fn_out_cap);
+        if (dec->fn_out == NULL) panic("out of memory");
+    }
+    char *ptr = dec->fn_out + dec->fn_out_len;
+    dec->fn_out_len += n;
+    return ptr;
+}
+
+/// Copies a cached decoding of func to pc, if there is one.
+static bool fc_restore(struct VirtualMachine *vm, struct Decoder *dec, struct Function *func,
+    uint64_t key, struct ProgramCounter *pc)
+{
+    const struct FnCache *cache = dec->fn_cache;
+    const struct FnCacheEntry *entry = NULL;
+    for (uint32_t slot_i = key & cache->slots_mask; cache->slots[slot_i] != 0;
+         slot_i = (slot_i + 1) & cache->slots_mask)
+    {
+        const struct FnCacheEntry *candidate =
+            (const struct FnCacheEntry *)(cache->pack + cache->slots[slot_i]);
+        if (candidate->key == key && fc_matches(vm, func, candidate)) {
+            entry = candidate;
+            break;
+        }
+    }
+    if (entry == NULL) return false;
+
+    const uint32_t *relocs = (const uint32_t *)((const struct DecodeDep *)(entry + 1) + entry->deps_len);
+    const uint32_t *operands = relocs + entry->relocs_len;
+    const uint8_t *opcodes = (const uint8_t *)(operands + entry->code_size.operand) + entry->code_len;
+    memcpy(dec->opcodes + pc->opcode, opcodes, entry->code_size.opcode);
+    uint32_t *dest = dec->operands + pc->operand;
+    memcpy(dest, operands, sizeof(uint32_t) * entry->code_size.operand);
+    for (uint32_t reloc_i = 0; reloc_i < entry->relocs_len; reloc_i += 1) {
+        uint32_t ref = relocs[reloc_i];
+        dest[ref + 0] += pc->opcode;
+        dest[ref + 1] += pc->operand;
+        if (dec->relocs != NULL) {
+            dec->relocs[dec->relocs_len] = pc->operand + ref;
+            dec->relocs_len += 1;
+        }
+    }
+
+    func->entry_pc = *pc;
+    func->locals_size = entry->locals_size;
+    func->max_stack_size = entry->max_stack_size;
+    pc->opcode += entry->code_size.opcode;
+    pc->operand += entry->code_size.operand;
+
+    size_t entry_size = fc_entrySize(entry);
+    memcpy(fc_reserve(dec, entry_size), entry, entry_size);
+    return true;
+}
+
+/// Appends the function just decoded from func->entry_pc to end to fn_out.
+static void fc_record(struct VirtualMachine *vm, struct Decoder *dec, const struct Function *func,
+    uint64_t key, struct ProgramCounter end, uint32_t relocs_start)
+{
+    struct FnCacheEntry header;
+    memset(&header, 0, sizeof(header));
+    header.key = key;
+    header.type = vm->module->types[func->type_idx];
+    header.imports_len = vm->module->imports_len;
+    header.code_len = func->code_len;
+    header.locals_size = func->locals_size;
+    header.max_stack_size = func->max_stack_size;
+    header.deps_len = dec->deps_len;
+    header.relocs_len = dec->relocs_len - relocs_start;
+    header.code_size.opcode = end.opcode - func->entry_pc.opcode;
+    header.code_size.operand = end.operand - func->entry_pc.operand;
+    size_t entry_size = fc_entrySize(&header);
+
+    char *ptr = fc_reserve(dec, entry_size);
+    memset(ptr, 0, entry_size);
+    memcpy(ptr, &header, sizeof(header));
+    struct DecodeDep *deps = (struct DecodeDep *)(ptr + sizeof(header));
+    memcpy(deps, dec->deps, sizeof(struct DecodeDep) * header.deps_len);
+    uint32_t *relocs = (uint32_t *)(deps + header.deps_len);
+    uint32_t *operands = relocs + header.relocs_len;
+    memcpy(operands, dec->operands + func->entry_pc.operand, sizeof(uint32_t) * header.code_size.operand);
+    for (uint32_t reloc_i = 0; reloc_i < header.relocs_len; reloc_i += 1) {
+        uint32_t ref = dec->relocs[relocs_start + reloc_i] - func->entry_pc.operand;
+        relocs[reloc_i] = ref;
+        operands[ref + 0] -= func->entry_pc.opcode;
+        operands[ref + 1] -= func->entry_pc.operand;
+    }
+    char *body = (char *)(operands + header.code_size.operand);
+    memcpy(body, vm->module->mod_ptr + func->code_begin, func->code_len);
+    memcpy(body + func->code_len, dec->opcodes + func->entry_pc.opcode, header.code_size.opcode);
+}
+
+static void fc_close(struct FnCache *cache) {
+    if (cache->pack != NULL) munmap((void *)cache->pack, cache->pack_len);
+    cache->pack = NULL;
+}
+
+/// Replaces the pack with the functions recorded by decs. Like the image,
+/// the pack is only an optimization and failing to write it is ignored.
+static void fc_save(int dir_fd, struct Decoder *const *decs, uint32_t decs_len,
+    uint32_t entries_len)
+{
+    char tmp_name[64];
+    snprintf(tmp_name, sizeof(tmp_name), "%s.%ld.tmp", fn_cache_name, (long)getpid());
+    int fd = openat(dir_fd, tmp_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd == -1) return;
+    struct FnCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, fn_cache_magic, sizeof(fn_cache_magic));
+    header.engine = engine_hash() + fn_cache_format_version;
+    header.entries_len = entries_len;
+    bool ok = write(fd, &header, sizeof(header)) == sizeof(header);
+    for (uint32_t dec_i = 0; ok && dec_i < decs_len; dec_i += 1) {
+        const struct Decoder *dec = decs[dec_i];
+        size_t written = 0;
+        while (ok && written < dec->fn_out_len) {
+            ssize_t rc = write(fd, dec->fn_out + written, dec->fn_out_len - written);
+            ok = rc > 0;
+            if (ok) written += rc;
+        }
+    }
+    close(fd);
+    if (!ok || renameat(dir_fd, tmp_name, dir_fd, fn_cache_name) == -1)
+        unlinkat(dir_fd, tmp_name, 0);
+}
+
+static void vm_decodeFunction(struct VirtualMachine *vm, struct Decoder *dec,
+    struct Function *func, struct ProgramCounter *pc)
+{
+    uint64_t key = 0;
+    uint32_t relocs_start = dec->relocs_len;
+    if (dec->fn_cache != NULL) {
+        key = fc_key(vm, func);
+        if (fc_restore(vm, dec, func, key, pc)) return;
+        dec->deps_len = 0;
+    }
+
+    uint32_t code_i = func->code_begin;
+    struct StackInfo *stack = &dec->stack;
+    stack->top_index = 0;
+    stack->top_offset = 0;
+    stack->max_offset = 0;
+    struct TypeInfo *type_info = &vm->module->types[func->type_idx];
+    for (uint32_t param_i = 0; param_i < type_info->param_count; param_i += 1)
+        si_push(stack, bs_isSet(&type_info->param_types, param_i));
+    uint32_t params_size = stack->top_offset;
+
+    for (uint32_t local_sets_count = read32_uleb128(vm->module->mod_ptr, &code_i);
+         local_sets_count > 0; local_sets_count -= 1)
+    {
+        uint32_t local_set_count = read32_uleb128(vm->module->mod_ptr, &code_i);
+        enum StackType local_type;
+        switch (read64_ileb128(vm->module->mod_ptr, &code_i)) {
+            case -1: case -3: local_type = ST_32; break;
+            case -2: case -4: local_type = ST_64; break;
+            default: panic("unexpected local type");
+        }
+        for (; local_set_count > 0; local_set_count -= 1)
+            si_push(stack, local_type);
+    }
+    func->locals_size = stack->top_offset - params_size;
+
+    func->entry_pc = *pc;
+    //fprintf(stderr, "decoding func id %u with pc %u:%u\n", func->id, pc->opcode, pc->operand);
+    vm_decodeCode(vm, dec, type_info, &code_i, pc);
+    if (code_i != func->code_begin + func->code_len) panic("bad code size");
+    func->max_stack_size = stack->max_offset - params_size;
+    if (dec->fn_cache != NULL) fc_record(vm, dec, func, key, *pc, relocs_start);
+}
+
+/// Entry opcode index of functions that have not been decoded yet.
+#define undecoded_pc UINT32_MAX
+/// Return address of calls made by the host: returning to it ends vm_run.
+#define host_return_pc (UINT32_MAX - 1)
+#define max_decode_threads 16
+#define min_parallel_decode_functions 1024
+
+/// A range of functions decoded by one thread into its own buffers, with
+/// program counters relative to the start of those buffers.
+struct DecodeJob {
+    struct VirtualMachine *vm;
+    struct Function *functions;
+    uint32_t functions_len;
+    struct Decoder *dec;
+    /// End of the decoded code once the job is done.
+    struct ProgramCounter pc;
+    pthread_t thread;
+};
+
+static void *vm_runDecodeJob(void *arg) {
+    struct DecodeJob *job = arg;
+    job->pc.opcode = 0;
+    job->pc.operand = 0;
+    for (uint32_t func_i = 0; func_i < job->functions_len; func_i += 1)
+        vm_decodeFunction(job->vm, job->dec, &job->functions[func_i], &job->pc);
+    return NULL;
+}
+
+/// One thread per core for modules with enough functions to be worth it.
+/// ZIG_WASI_DECODE_THREADS overrides the count.
+static uint32_t decode_threadCount(uint32_t functions_len) {
+    const char *env = getenv("ZIG_WASI_DECODE_THREADS");
+    long n;
+    if (env != NULL) n = strtol(env, NULL, 10);
+    else if (functions_len < min_parallel_decode_functions) n = 1;
+    else n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n > max_decode_threads) n = max_decode_threads;
+    if (n > (long)functions_len) n = functions_len;
+    if (n < 1) n = 1;
+    return n;
+}
+
+static void vm_push_u32(struct VirtualMachine *vm, uint32_t value) {
+    vm->stack[vm->stack_top + 0] = value;
+    vm->stack_top += 1;
+}
+
+static void vm_push_i32(struct VirtualMachine *vm, int32_t value) {
+    vm_push_u32(vm, (uint32_t)value);
+}
+
+static void vm_push_u64(struct VirtualMachine *vm, uint64_t value) {
+    vm->stack[vm->stack_top + 0] = (uint32_t)(value >> 0);
+    vm->stack[vm->stack_top + 1] = (uint32_t)(value >> 32);
+    vm->stack_top += 2;
+}
+
+static void vm_push_i64(struct VirtualMachine *vm, int64_t value) {
+    vm_push_u64(vm, (uint64_t)value);
+}
+
+static void vm_push_f32(struct VirtualMachine *vm, float value) {
+    uint32_t integer;
+    memcpy(&integer, &value, sizeof(integer));
+    vm_push_u32(vm, integer);
+}
+
+static void vm_push_f64(struct VirtualMachine *vm, double value) {
+    uint64_t integer;
+    memcpy(&integer, &value, sizeof(integer));
+    vm_push_u64(vm, integer);
+}
+
+static uint32_t vm_pop_u32(struct VirtualMachine *vm) {
+    vm->stack_top -= 1;
+    return vm->stack[vm->stack_top + 0];
+}
+
+static int32_t vm_pop_i32(struct VirtualMachine *vm) {
+    return (int32_t)vm_pop_u32(vm);
+}
+
+static uint64_t vm_pop_u64(struct VirtualMachine *vm) {
+    vm->stack_top -= 2;
+    return vm->stack[vm->stack_top + 0] | (uint64_t)vm->stack[vm->stack_top + 1] << 32;
+}
+
+static int64_t vm_pop_i64(struct VirtualMachine *vm) {
     return (int64_t)vm_pop_u64(vm);
 }
 
@@ -2704,321 +4410,938 @@ static double vm_pop_f64(struct VirtualMachine *vm) {
     return result;
 }
 
-static void vm_callImport(struct VirtualMachine *vm, const struct Import *import) {
-    switch (import->mod) {
-        case ImpMod_wasi_snapshot_preview1: switch (import->name) {
-            case ImpName_fd_prestat_get:
-            {
-                uint32_t buf = vm_pop_u32(vm);
-                int32_t fd = vm_pop_i32(vm);
-                vm_push_u32(vm, wasi_fd_prestat_get(vm, fd, buf));
-            }
-            break;
-            case ImpName_fd_prestat_dir_name:
-            {
-                uint32_t path_len = vm_pop_u32(vm);
-                uint32_t path = vm_pop_u32(vm);
-                int32_t fd = vm_pop_i32(vm);
-                vm_push_u32(vm, wasi_fd_prestat_dir_name(vm, fd, path, path_len));
-            }
-            break;
-            case ImpName_fd_close:
-            {
-                int32_t fd = vm_pop_i32(vm);
-                vm_push_u32(vm, wasi_fd_close(vm, fd));
-            }
-            break;
-            case ImpName_fd_read:
-            {
-                uint32_t nread = vm_pop_u32(vm);
-                uint32_t iovs_len = vm_pop_u32(vm);
-                uint32_t iovs = vm_pop_u32(vm);
-                int32_t fd = vm_pop_i32(vm);
-                vm_push_u32(vm, wasi_fd_read(vm, fd, iovs, iovs_len, nread));
-            }
-            break;
-            case ImpName_fd_filestat_get:
-            {
-                uint32_t buf = vm_pop_u32(vm);
-                int32_t fd = vm_pop_i32(vm);
-                vm_push_u32(vm, wasi_fd_filestat_get(vm, fd, buf));
-            }
-            break;
-            case ImpName_fd_filestat_set_size:
-            {
-                uint64_t size = vm_pop_u64(vm);
-                int32_t fd = vm_pop_i32(vm);
-                vm_push_u32(vm, wasi_fd_filestat_set_size(vm, fd, size));
-            }
-            break;
-            case ImpName_fd_filestat_set_times:
-            {
-                panic("unexpected call to fd_filestat_set_times");
-            }
-            break;
-            case ImpName_fd_fdstat_get:
-            {
-                uint32_t buf = vm_pop_u32(vm);
-                int32_t fd = vm_pop_i32(vm);
-                vm_push_u32(vm, wasi_fd_fdstat_get(vm, fd, buf));
-            }
-            break;
-            case ImpName_fd_readdir:
-            {
-                panic("unexpected call to fd_readdir");
-            }
-            break;
-            case ImpName_fd_write:
-            {
-                uint32_t nwritten = vm_pop_u32(vm);
-                uint32_t iovs_len = vm_pop_u32(vm);
-                uint32_t iovs = vm_pop_u32(vm);
-                int32_t fd = vm_pop_i32(vm);
-                vm_push_u32(vm, wasi_fd_write(vm, fd, iovs, iovs_len, nwritten));
-            }
-            break;
-            case ImpName_fd_pwrite:
-            {
-                uint32_t nwritten = vm_pop_u32(vm);
-                uint64_t offset = vm_pop_u64(vm);
-                uint32_t iovs_len = vm_pop_u32(vm);
-                uint32_t iovs = vm_pop_u32(vm);
-                int32_t fd = vm_pop_i32(vm);
-                vm_push_u32(vm, wasi_fd_pwrite(vm, fd, iovs, iovs_len, offset, nwritten));
-            }
-            break;
-            case ImpName_proc_exit:
-            {
-                uint32_t code = vm_pop_u32(vm);
-                exit(code);
-            }
-            break;
-            case ImpName_args_sizes_get:
-            {
-                uint32_t argv_buf_size = vm_pop_u32(vm);
-                uint32_t argc = vm_pop_u32(vm);
-                vm_push_u32(vm, wasi_args_sizes_get(vm, argc, argv_buf_size));
-            }
-            break;
-            case ImpName_args_get:
-            {
-                uint32_t argv_buf = vm_pop_u32(vm);
-                uint32_t argv = vm_pop_u32(vm);
-                vm_push_u32(vm, wasi_args_get(vm, argv, argv_buf));
-            }
-            break;
-            case ImpName_random_get:
-            {
-                uint32_t buf_len = vm_pop_u32(vm);
-                uint32_t buf = vm_pop_u32(vm);
-                vm_push_u32(vm, wasi_random_get(vm, buf, buf_len));
-            }
-            break;
-            case ImpName_environ_sizes_get:
-            {
-                panic("unexpected call to environ_sizes_get");
-            }
-            break;
-            case ImpName_environ_get:
-            {
-                panic("unexpected call to environ_get");
-            }
-            break;
-            case ImpName_path_filestat_get:
-            {
-                uint32_t buf = vm_pop_u32(vm);
-                uint32_t path_len = vm_pop_u32(vm);
-                uint32_t path = vm_pop_u32(vm);
-                uint32_t flags = vm_pop_u32(vm);
-                int32_t fd = vm_pop_i32(vm);
-                vm_push_u32(vm, wasi_path_filestat_get(vm, fd, flags, path, path_len, buf));
-            }
-            break;
-            case ImpName_path_create_directory:
-            {
-                uint32_t path_len = vm_pop_u32(vm);
-                uint32_t path = vm_pop_u32(vm);
-                int32_t fd = vm_pop_i32(vm);
-                vm_push_u32(vm, wasi_path_create_directory(vm, fd, path, path_len));
-            }
-            break;
-            case ImpName_path_rename:
-            {
-                uint32_t new_path_len = vm_pop_u32(vm);
-                uint32_t new_path = vm_pop_u32(vm);
-                int32_t new_fd = vm_pop_i32(vm);
-                uint32_t old_path_len = vm_pop_u32(vm);
-                uint32_t old_path = vm_pop_u32(vm);
-                int32_t old_fd = vm_pop_i32(vm);
-                vm_push_u32(vm, wasi_path_rename(
-                    vm,
-                    old_fd,
-                    old_path,
-                    old_path_len,
-                    new_fd,
-                    new_path,
-                    new_path_len
-                ));
-            }
-            break;
-            case ImpName_path_open:
-            {
-                uint32_t fd = vm_pop_u32(vm);
-                uint32_t fs_flags = vm_pop_u32(vm);
-                uint64_t fs_rights_inheriting = vm_pop_u64(vm);
-                uint64_t fs_rights_base = vm_pop_u64(vm);
-                uint32_t oflags = vm_pop_u32(vm);
-                uint32_t path_len = vm_pop_u32(vm);
-                uint32_t path = vm_pop_u32(vm);
-                uint32_t dirflags = vm_pop_u32(vm);
-                int32_t dirfd = vm_pop_i32(vm);
-                vm_push_u32(vm, wasi_path_open(
-                    vm,
-                    dirfd,
-                    dirflags,
-                    path,
-                    path_len,
-                    oflags,
-                    fs_rights_base,
-                    fs_rights_inheriting,
-                    fs_flags,
-                    fd
-                ));
-            }
-            break;
-            case ImpName_path_remove_directory:
-            {
-                panic("unexpected call to path_remove_directory");
-            }
-            break;
-            case ImpName_path_unlink_file:
-            {
-                panic("unexpected call to path_unlink_file");
-            }
-            break;
-            case ImpName_clock_time_get:
-            {
-                uint32_t timestamp = vm_pop_u32(vm);
-                uint64_t precision = vm_pop_u64(vm);
-                uint32_t clock_id = vm_pop_u32(vm);
-                vm_push_u32(vm, wasi_clock_time_get(vm, clock_id, precision, timestamp));
-            }
-            break;
-            case ImpName_fd_pread:
-            {
-                panic("unexpected call to fd_pread");
-            }
-            break;
-            case ImpName_debug:
-            {
-                uint64_t number = vm_pop_u64(vm);
-                uint32_t text = vm_pop_u32(vm);
-                wasi_debug(vm, text, number);
-            }
-            break;
-            case ImpName_debug_slice:
-            {
-                uint32_t len = vm_pop_u32(vm);
-                uint32_t ptr = vm_pop_u32(vm);
-                wasi_debug_slice(vm, ptr, len);
-            }
-            break;
+/// Zero fills at least this large hand their whole wasm pages back to the
+/// kernel instead of writing every byte.
+static const uint32_t bulk_zero_threshold = 256 * 1024;
+/// Moves and fills at least this large use the vectorized kernels.
+static const uint32_t large_move_threshold = 4096;
+
+static bool host_has_avx2 = false;
+
+/// Overlap-safe because every load happens before the first store.
+static void memmove_small(char *dest, const char *src, uint32_t n) {
+    if (n >= 8) {
+        uint64_t head, tail;
+        memcpy(&head, src, 8);
+        memcpy(&tail, src + n - 8, 8);
+        memcpy(dest, &head, 8);
+        memcpy(dest + n - 8, &tail, 8);
+    } else if (n >= 4) {
+        uint32_t head, tail;
+        memcpy(&head, src, 4);
+        memcpy(&tail, src + n - 4, 4);
+        memcpy(dest, &head, 4);
+        memcpy(dest + n - 4, &tail, 4);
+    } else if (n >= 2) {
+        uint16_t head, tail;
+        memcpy(&head, src, 2);
+        memcpy(&tail, src + n - 2, 2);
+        memcpy(dest, &head, 2);
+        memcpy(dest + n - 2, &tail, 2);
+    } else if (n == 1) {
+        dest[0] = src[0];
+    }
+}
+
+static void memset_small(char *dest, uint8_t value, uint32_t n) {
+    uint64_t pattern = value * UINT64_C(0x0101010101010101);
+    if (n >= 8) {
+        memcpy(dest, &pattern, 8);
+        memcpy(dest + n - 8, &pattern, 8);
+    } else if (n >= 4) {
+        memcpy(dest, &pattern, 4);
+        memcpy(dest + n - 4, &pattern, 4);
+    } else if (n >= 2) {
+        memcpy(dest, &pattern, 2);
+        memcpy(dest + n - 2, &pattern, 2);
+    } else if (n == 1) {
+        dest[0] = value;
+    }
+}
+
+#ifdef HAVE_AVX2_KERNELS
+__attribute__((target("avx2")))
+static void memmove_avx2(char *dest, const char *src, size_t n) {
+    size_t i = 0;
+    if (dest <= src || dest >= src + n) {
+        for (; i + 64 <= n; i += 64) {
+            __m256i a = _mm256_loadu_si256((const __m256i *)(src + i + 0));
+            __m256i b = _mm256_loadu_si256((const __m256i *)(src + i + 32));
+            _mm256_storeu_si256((__m256i *)(dest + i + 0), a);
+            _mm256_storeu_si256((__m256i *)(dest + i + 32), b);
+        }
+        memmove(dest + i, src + i, n - i);
+    } else {
+        // Overlapping with dest after src: copy from the end backwards.
+        for (; i + 64 <= n; i += 64) {
+            __m256i a = _mm256_loadu_si256((const __m256i *)(src + n - i - 32));
+            __m256i b = _mm256_loadu_si256((const __m256i *)(src + n - i - 64));
+            _mm256_storeu_si256((__m256i *)(dest + n - i - 32), a);
+            _mm256_storeu_si256((__m256i *)(dest + n - i - 64), b);
         }
-        break;
+        memmove(dest, src, n - i);
     }
 }
 
-static void vm_call(struct VirtualMachine *vm, const struct Function *func) {
-    //struct TypeInfo *type_info = &vm->types[func->type_idx];
-    //fprintf(stderr, "enter fn_id: %u, param_count: %u, result_count: %u, locals_size: %u\n",
-    //    func->id, type_info->param_count, type_info->result_count, func->locals_size);
+__attribute__((target("avx2")))
+static void memset_avx2(char *dest, uint8_t value, size_t n) {
+    __m256i pattern = _mm256_set1_epi8((char)value);
+    size_t i = 0;
+    for (; i + 64 <= n; i += 64) {
+        _mm256_storeu_si256((__m256i *)(dest + i + 0), pattern);
+        _mm256_storeu_si256((__m256i *)(dest + i + 32), pattern);
+    }
+    memset(dest + i, value, n - i);
+}
+#endif
 
-    // Push zeroed locals to stack
-    memset(&vm->stack[vm->stack_top], 0, func->locals_size * sizeof(uint32_t));
-    vm->stack_top += func->locals_size;
+static void detect_host_features(void) {
+    host_page_size = sysconf(_SC_PAGESIZE);
+#ifdef HAVE_AVX2_KERNELS
+    __builtin_cpu_init();
+    host_has_avx2 = __builtin_cpu_supports("avx2");
+    host_has_bmi2 = __builtin_cpu_supports("bmi2");
+#endif
+}
 
-    vm_push_u32(vm, vm->pc.opcode);
-    vm_push_u32(vm, vm->pc.operand);
+/// memory.copy semantics: the ranges may overlap.
+static void vm_memmove(char *dest, const char *src, uint32_t n) {
+#ifdef HAVE_AVX2_KERNELS
+    if (n >= large_move_threshold && host_has_avx2) {
+        memmove_avx2(dest, src, n);
+        return;
+    }
+#endif
+    memmove(dest, src, n);
+}
 
-    vm->pc = func->entry_pc;
+static void vm_memset(struct VirtualMachine *vm, uint32_t dest, uint8_t value, uint32_t n) {
+#ifdef __linux__
+    // The memory is a private anonymous mapping whose base is host page
+    // aligned, and wasm pages are a multiple of the host page size, so
+    // discarding whole wasm pages makes them read back as zero.
+    if (value == 0 && n >= bulk_zero_threshold) {
+        uint32_t begin = (dest + wasm_page_size - 1) & ~(wasm_page_size - 1);
+        uint32_t end = (dest + n) & ~(wasm_page_size - 1);
+        if (begin < vm->memory_file_len) begin = vm->memory_file_len;
+        if (begin < end && madvise(vm->memory + begin, end - begin, MADV_DONTNEED) == 0) {
+            memset(vm->memory + dest, 0, begin - dest);
+            memset(vm->memory + end, 0, dest + n - end);
+            return;
+        }
+    }
+#endif
+#ifdef HAVE_AVX2_KERNELS
+    if (n >= large_move_threshold && host_has_avx2) {
+        memset_avx2(vm->memory + dest, value, n);
+        return;
+    }
+#endif
+    memset(vm->memory + dest, value, n);
 }
 
-static void vm_br_void(struct VirtualMachine *vm) {
-    uint32_t stack_adjust = vm->operands[vm->pc.operand];
+static void host_fd_prestat_get(struct VirtualMachine *vm) {
+    uint32_t buf = vm_pop_u32(vm);
+    int32_t fd = vm_pop_i32(vm);
+    vm_push_u32(vm, wasi_fd_prestat_get(vm, fd, buf));
+}
 
-    vm->stack_top -= stack_adjust;
+static void host_fd_prestat_dir_name(struct VirtualMachine *vm) {
+    uint32_t path_len = vm_pop_u32(vm);
+    uint32_t path = vm_pop_u32(vm);
+    int32_t fd = vm_pop_i32(vm);
+    vm_push_u32(vm, wasi_fd_prestat_dir_name(vm, fd, path, path_len));
+}
 
-    vm->pc.opcode = vm->operands[vm->pc.operand + 1];
-    vm->pc.operand = vm->operands[vm->pc.operand + 2];
+static void host_fd_close(struct VirtualMachine *vm) {
+    int32_t fd = vm_pop_i32(vm);
+    vm_push_u32(vm, wasi_fd_close(vm, fd));
 }
 
-static void vm_br_u32(struct VirtualMachine *vm) {
-    uint32_t stack_adjust = vm->operands[vm->pc.operand];
+static void host_fd_read(struct VirtualMachine *vm) {
+    uint32_t nread = vm_pop_u32(vm);
+    uint32_t iovs_len = vm_pop_u32(vm);
+    uint32_t iovs = vm_pop_u32(vm);
+    int32_t fd = vm_pop_i32(vm);
+    vm_push_u32(vm, wasi_fd_read(vm, fd, iovs, iovs_len, nread));
+}
 
-    uint32_t result = vm_pop_u32(vm);
-    vm->stack_top -= stack_adjust;
-    vm_push_u32(vm, result);
+static void host_fd_filestat_get(struct VirtualMachine *vm) {
+    uint32_t buf = vm_pop_u32(vm);
+    int32_t fd = vm_pop_i32(vm);
+    vm_push_u32(vm, wasi_fd_filestat_get(vm, fd, buf));
+}
 
-    vm->pc.opcode = vm->operands[vm->pc.operand + 1];
-    vm->pc.operand = vm->operands[vm->pc.operand + 2];
+static void host_fd_filestat_set_size(struct VirtualMachine *vm) {
+    uint64_t size = vm_pop_u64(vm);
+    int32_t fd = vm_pop_i32(vm);
+    vm_push_u32(vm, wasi_fd_filestat_set_size(vm, fd, size));
 }
 
-static void vm_br_u64(struct VirtualMachine *vm) {
-    uint32_t stack_adjust = vm->operands[vm->pc.operand];
+static void host_fd_filestat_set_times(struct VirtualMachine *vm) {
+    panic("unexpected call to fd_filestat_set_times");
+}
 
-    uint64_t result = vm_pop_u64(vm);
-    vm->stack_top -= stack_adjust;
-    vm_push_u64(vm, result);
+static void host_fd_fdstat_get(struct VirtualMachine *vm) {
+    uint32_t buf = vm_pop_u32(vm);
+    int32_t fd = vm_pop_i32(vm);
+    vm_push_u32(vm, wasi_fd_fdstat_get(vm, fd, buf));
+}
 
-    vm->pc.opcode = vm->operands[vm->pc.operand + 1];
-    vm->pc.operand = vm->operands[vm->pc.operand + 2];
+static void host_fd_readdir(struct VirtualMachine *vm) {
+    panic("unexpected call to fd_readdir");
 }
 
-static void vm_return_void(struct VirtualMachine *vm) {
-    uint32_t stack_adjust = vm->operands[vm->pc.operand + 0];
-    uint32_t frame_size = vm->operands[vm->pc.operand + 1];
+static void host_fd_write(struct VirtualMachine *vm) {
+    uint32_t nwritten = vm_pop_u32(vm);
+    uint32_t iovs_len = vm_pop_u32(vm);
+    uint32_t iovs = vm_pop_u32(vm);
+    int32_t fd = vm_pop_i32(vm);
+    vm_push_u32(vm, wasi_fd_write(vm, fd, iovs, iovs_len, nwritten));
+}
 
-    vm->stack_top -= stack_adjust;
-    vm->pc.operand = vm_pop_u32(vm);
-    vm->pc.opcode = vm_pop_u32(vm);
+static void host_fd_pwrite(struct VirtualMachine *vm) {
+    uint32_t nwritten = vm_pop_u32(vm);
+    uint64_t offset = vm_pop_u64(vm);
+    uint32_t iovs_len = vm_pop_u32(vm);
+    uint32_t iovs = vm_pop_u32(vm);
+    int32_t fd = vm_pop_i32(vm);
+    vm_push_u32(vm, wasi_fd_pwrite(vm, fd, iovs, iovs_len, offset, nwritten));
+}
 
-    vm->stack_top -= frame_size;
+static void host_proc_exit(struct VirtualMachine *vm) {
+    uint32_t code = vm_pop_u32(vm);
+    if (vm->exit_jmp != NULL) {
+        vm->exit_code = code;
+        longjmp(*vm->exit_jmp, 1);
+    }
+    exit(code);
 }
 
-static void vm_return_u32(struct VirtualMachine *vm) {
-    uint32_t stack_adjust = vm->operands[vm->pc.operand + 0];
-    uint32_t frame_size = vm->operands[vm->pc.operand + 1];
+static void host_args_sizes_get(struct VirtualMachine *vm) {
+    uint32_t argv_buf_size = vm_pop_u32(vm);
+    uint32_t argc = vm_pop_u32(vm);
+    vm_push_u32(vm, wasi_args_sizes_get(vm, argc, argv_buf_size));
+}
 
-    uint32_t result = vm_pop_u32(vm);
+static void host_args_get(struct VirtualMachine *vm) {
+    uint32_t argv_buf = vm_pop_u32(vm);
+    uint32_t argv = vm_pop_u32(vm);
+    vm_push_u32(vm, wasi_args_get(vm, argv, argv_buf));
+}
 
-    vm->stack_top -= stack_adjust;
-    vm->pc.operand = vm_pop_u32(vm);
-    vm->pc.opcode = vm_pop_u32(vm);
+static void host_random_get(struct VirtualMachine *vm) {
+    uint32_t buf_len = vm_pop_u32(vm);
+    uint32_t buf = vm_pop_u32(vm);
+    vm_push_u32(vm, wasi_random_get(vm, buf, buf_len));
+}
 
-    vm->stack_top -= frame_size;
-    vm_push_u32(vm, result);
+static void host_environ_sizes_get(struct VirtualMachine *vm) {
+    uint32_t environ_buf_size = vm_pop_u32(vm);
+    uint32_t environ_count = vm_pop_u32(vm);
+    vm_push_u32(vm, wasi_environ_sizes_get(vm, environ_count, environ_buf_size));
 }
 
-static void vm_return_u64(struct VirtualMachine *vm) {
-    uint32_t stack_adjust = vm->operands[vm->pc.operand + 0];
-    uint32_t frame_size = vm->operands[vm->pc.operand + 1];
+static void host_environ_get(struct VirtualMachine *vm) {
+    uint32_t environ_buf = vm_pop_u32(vm);
+    uint32_t environ = vm_pop_u32(vm);
+    vm_push_u32(vm, wasi_environ_get(vm, environ, environ_buf));
+}
 
-    uint64_t result = vm_pop_u64(vm);
+static void host_path_filestat_get(struct VirtualMachine *vm) {
+    uint32_t buf = vm_pop_u32(vm);
+    uint32_t path_len = vm_pop_u32(vm);
+    uint32_t path = vm_pop_u32(vm);
+    uint32_t flags = vm_pop_u32(vm);
+    int32_t fd = vm_pop_i32(vm);
+    vm_push_u32(vm, wasi_path_filestat_get(vm, fd, flags, path, path_len, buf));
+}
 
-    vm->stack_top -= stack_adjust;
-    vm->pc.operand = vm_pop_u32(vm);
-    vm->pc.opcode = vm_pop_u32(vm);
+static void host_path_create_directory(struct VirtualMachine *vm) {
+    uint32_t path_len = vm_pop_u32(vm);
+    uint32_t path = vm_pop_u32(vm);
+    int32_t fd = vm_pop_i32(vm);
+    vm_push_u32(vm, wasi_path_create_directory(vm, fd, path, path_len));
+}
 
-    vm->stack_top -= frame_size;
-    vm_push_u64(vm, result);
+static void host_path_rename(struct VirtualMachine *vm) {
+    uint32_t new_path_len = vm_pop_u32(vm);
+    uint32_t new_path = vm_pop_u32(vm);
+    int32_t new_fd = vm_pop_i32(vm);
+    uint32_t old_path_len = vm_pop_u32(vm);
+    uint32_t old_path = vm_pop_u32(vm);
+    int32_t old_fd = vm_pop_i32(vm);
+    vm_push_u32(vm, wasi_path_rename(
+        vm,
+        old_fd,
+        old_path,
+        old_path_len,
+        new_fd,
+        new_path,
+        new_path_len
+    ));
 }
 
-static void vm_run(struct VirtualMachine *vm) {
-    uint8_t *opcodes = vm->opcodes;
-    uint32_t *operands = vm->operands;
-    struct ProgramCounter *pc = &vm->pc;
-    uint32_t global_0 = vm->globals[0];
-    for (;;) {
+static void host_path_open(struct VirtualMachine *vm) {
+    uint32_t fd = vm_pop_u32(vm);
+    uint32_t fs_flags = vm_pop_u32(vm);
+    uint64_t fs_rights_inheriting = vm_pop_u64(vm);
+    uint64_t fs_rights_base = vm_pop_u64(vm);
+    uint32_t oflags = vm_pop_u32(vm);
+    uint32_t path_len = vm_pop_u32(vm);
+    uint32_t path = vm_pop_u32(vm);
+    uint32_t dirflags = vm_pop_u32(vm);
+    int32_t dirfd = vm_pop_i32(vm);
+    vm_push_u32(vm, wasi_path_open(
+        vm,
+        dirfd,
+        dirflags,
+        path,
+        path_len,
+        oflags,
+        fs_rights_base,
+        fs_rights_inheriting,
+        fs_flags,
+        fd
+    ));
+}
+
+static void host_path_remove_directory(struct VirtualMachine *vm) {
+    panic("unexpected call to path_remove_directory");
+}
+
+static void host_path_unlink_file(struct VirtualMachine *vm) {
+    panic("unexpected call to path_unlink_file");
+}
+
+static void host_clock_time_get(struct VirtualMachine *vm) {
+    uint32_t timestamp = vm_pop_u32(vm);
+    uint64_t precision = vm_pop_u64(vm);
+    uint32_t clock_id = vm_pop_u32(vm);
+    vm_push_u32(vm, wasi_clock_time_get(vm, clock_id, precision, timestamp));
+}
+
+static void host_fd_pread(struct VirtualMachine *vm) {
+    panic("unexpected call to fd_pread");
+}
+
+static void host_debug(struct VirtualMachine *vm) {
+    uint64_t number = vm_pop_u64(vm);
+    uint32_t text = vm_pop_u32(vm);
+    wasi_debug(vm, text, number);
+}
+
+static void host_debug_slice(struct VirtualMachine *vm) {
+    uint32_t len = vm_pop_u32(vm);
+    uint32_t ptr = vm_pop_u32(vm);
+    wasi_debug_slice(vm, ptr, len);
+}
+
+/// Host functions that modules may import from wasi_snapshot_preview1.
+/// The signature lists parameter and result types, i for 32-bit and I for
+/// 64-bit values; each thunk pops the parameters and pushes the result.
+struct HostFunction {
+    const char *name;
+    const char *signature;
+    void (*fn)(struct VirtualMachine *vm);
+};
+
+static const struct HostFunction host_functions[] = {
+    { "args_get", "ii:i", host_args_get },
+    { "args_sizes_get", "ii:i", host_args_sizes_get },
+    { "clock_time_get", "iIi:i", host_clock_time_get },
+    { "debug", "iI:", host_debug },
+    { "debug_slice", "ii:", host_debug_slice },
+    { "environ_get", "ii:i", host_environ_get },
+    { "environ_sizes_get", "ii:i", host_environ_sizes_get },
+    { "fd_close", "i:i", host_fd_close },
+    { "fd_fdstat_get", "ii:i", host_fd_fdstat_get },
+    { "fd_filestat_get", "ii:i", host_fd_filestat_get },
+    { "fd_filestat_set_size", "iI:i", host_fd_filestat_set_size },
+    { "fd_filestat_set_times", "iIIi:i", host_fd_filestat_set_times },
+    { "fd_pread", "iiiIi:i", host_fd_pread },
+    { "fd_prestat_dir_name", "iii:i", host_fd_prestat_dir_name },
+    { "fd_prestat_get", "ii:i", host_fd_prestat_get },
+    { "fd_pwrite", "iiiIi:i", host_fd_pwrite },
+    { "fd_read", "iiii:i", host_fd_read },
+    { "fd_readdir", "iiiIi:i", host_fd_readdir },
+    { "fd_write", "iiii:i", host_fd_write },
+    { "path_create_directory", "iii:i", host_path_create_directory },
+    { "path_filestat_get", "iiiii:i", host_path_filestat_get },
+    { "path_open", "iiiiiIIii:i", host_path_open },
+    { "path_remove_directory", "iii:i", host_path_remove_directory },
+    { "path_rename", "iiiiii:i", host_path_rename },
+    { "path_unlink_file", "iii:i", host_path_unlink_file },
+    { "proc_exit", "i:", host_proc_exit },
+    { "random_get", "ii:i", host_random_get },
+};
+
+#define host_functions_len (sizeof(host_functions) / sizeof(host_functions[0]))
+#define host_table_len 128
+
+/// Perfect hash table of host_functions: slot i holds index + 1, or 0.
+static uint8_t host_table[host_table_len];
+static uint32_t host_seed;
+
+static uint32_t host_hash(uint32_t seed, const char *name, size_t len) {
+    uint32_t hash = 2166136261u ^ seed;
+    for (size_t i = 0; i < len; i += 1) {
+        hash ^= (uint8_t)name[i];
+        hash *= 16777619u;
+    }
+    return (hash ^ (hash >> 15)) & (host_table_len - 1);
+}
+
+/// Finds a seed for which no two host function names collide. Runs once
+/// per process before any module is loaded.
+static void host_initTable(void) {
+    for (host_seed = 1;; host_seed += 1) {
+        memset(host_table, 0, sizeof(host_table));
+        uint32_t host_i = 0;
+        for (; host_i < host_functions_len; host_i += 1) {
+            const char *name = host_functions[host_i].name;
+            uint32_t slot = host_hash(host_seed, name, strlen(name));
+            if (host_table[slot] != 0) break;
+            host_table[slot] = host_i + 1;
+        }
+        if (host_i == host_functions_len) return;
+    }
+}
+
+/// Returns the index into host_functions of name, or UINT32_MAX.
+static uint32_t host_lookup(struct ByteSlice name) {
+    uint8_t entry = host_table[host_hash(host_seed, name.ptr, name.len)];
+    if (entry == 0) return UINT32_MAX;
+    const char *candidate = host_functions[entry - 1].name;
+    if (strlen(candidate) != name.len || memcmp(candidate, name.ptr, name.len) != 0)
+        return UINT32_MAX;
+    return entry - 1;
+}
+
+static bool host_signatureMatches(const char *signature, const struct TypeInfo *type) {
+    uint32_t count = 0;
+    uint32_t types = 0;
+    for (; *signature != ':'; signature += 1, count += 1)
+        if (*signature == 'I') types |= (uint32_t)1 << count;
+    if (count != type->param_count ||
+        (types ^ type->param_types) & (((uint64_t)1 << count) - 1)) return false;
+    count = 0;
+    types = 0;
+    for (signature += 1; *signature != 0; signature += 1, count += 1)
+        if (*signature == 'I') types |= (uint32_t)1 << count;
+    return count == type->result_count &&
+        ((types ^ type->result_types) & (((uint64_t)1 << count) - 1)) == 0;
+}
+
+static void host_callRegistered(struct VirtualMachine *vm);
+
+/// Resolves an import to an index into host_functions or, past those, into
+/// the module's registered host functions, which take precedence. Returns
+/// UINT32_MAX if neither has it.
+static uint32_t host_resolve(const struct Module *module, struct ByteSlice mod_name,
+    struct ByteSlice name)
+{
+    for (uint32_t extra_i = 0; extra_i < module->extra_hosts_len; extra_i += 1) {
+        const struct zw_host_function *host = &module->extra_hosts[extra_i];
+        if (strlen(host->module_name) == mod_name.len &&
+            memcmp(host->module_name, mod_name.ptr, mod_name.len) == 0 &&
+            strlen(host->name) == name.len && memcmp(host->name, name.ptr, name.len) == 0)
+            return host_functions_len + extra_i;
+    }
+    if (mod_name.len != strlen("wasi_snapshot_preview1") ||
+        memcmp(mod_name.ptr, "wasi_snapshot_preview1", mod_name.len) != 0)
+        return UINT32_MAX;
+    return host_lookup(name);
+}
+
+static void vm_growStack(struct VirtualMachine *vm, uint64_t needed_len) {
+    if (needed_len > max_stack_len) panic("stack overflow");
+    uint64_t new_len = vm->stack_len > 0 ? vm->stack_len : initial_stack_len;
+    while (new_len < needed_len) new_len *= 2;
+    if (new_len > max_stack_len) new_len = max_stack_len;
+    err_wrap("growing stack", mprotect(vm->stack + vm->stack_len,
+        (new_len - vm->stack_len) * sizeof(uint32_t), PROT_READ | PROT_WRITE));
+    vm->stack_len = new_len;
+}
+
+static void vm_call(struct VirtualMachine *vm, struct Function *func) {
+    //struct TypeInfo *type_info = &vm->module->types[func->type_idx];
+    //fprintf(stderr, "enter fn_id: %u, param_count: %u, result_count: %u, locals_size: %u\n",
+    //    func->id, type_info->param_count, type_info->result_count, func->locals_size);
+
+    if (func->entry_pc.opcode == undecoded_pc)
+        vm_decodeFunction(vm, vm->module->decoder, func, &vm->module->code_end);
+
+    // One check per call covers every push the function body can make.
+    uint64_t needed_len = (uint64_t)vm->stack_top + func->max_stack_size;
+    if (needed_len > vm->stack_len) vm_growStack(vm, needed_len);
+
+    // Push zeroed locals to stack
+    memset(&vm->stack[vm->stack_top], 0, func->locals_size * sizeof(uint32_t));
+    vm->stack_top += func->locals_size;
+
+    vm_push_u32(vm, vm->pc.opcode);
+    vm_push_u32(vm, vm->pc.operand);
+
+    vm->pc = func->entry_pc;
+}
+
+static void vm_br_void(struct VirtualMachine *vm) {
+    uint32_t stack_adjust = vm->module->operands[vm->pc.operand];
+
+    vm->stack_top -= stack_adjust;
+
+    vm->pc.opcode = vm->module->operands[vm->pc.operand + 1];
+    vm->pc.operand = vm->module->operands[vm->pc.operand + 2];
+}
+
+static void vm_br_u32(struct VirtualMachine *vm) {
+    uint32_t stack_adjust = vm->module->operands[vm->pc.operand];
+
+    uint32_t result = vm_pop_u32(vm);
+    vm->stack_top -= stack_adjust;
+    vm_push_u32(vm, result);
+
+    vm->pc.opcode = vm->module->operands[vm->pc.operand + 1];
+    vm->pc.operand = vm->module->operands[vm->pc.operand + 2];
+}
+
+static void vm_br_u64(struct VirtualMachine *vm) {
+    uint32_t stack_adjust = vm->module->operands[vm->pc.operand];
+
+    uint64_t result = vm_pop_u64(vm);
+    vm->stack_top -= stack_adjust;
+    vm_push_u64(vm, result);
+
+    vm->pc.opcode = vm->module->operands[vm->pc.operand + 1];
+    vm->pc.operand = vm->module->operands[vm->pc.operand + 2];
+}
+
+static void vm_return_void(struct VirtualMachine *vm) {
+    uint32_t stack_adjust = vm->module->operands[vm->pc.operand + 0];
+    uint32_t frame_size = vm->module->operands[vm->pc.operand + 1];
+
+    vm->stack_top -= stack_adjust;
+    vm->pc.operand = vm_pop_u32(vm);
+    vm->pc.opcode = vm_pop_u32(vm);
+
+    vm->stack_top -= frame_size;
+}
+
+static void vm_return_u32(struct VirtualMachine *vm) {
+    uint32_t stack_adjust = vm->module->operands[vm->pc.operand + 0];
+    uint32_t frame_size = vm->module->operands[vm->pc.operand + 1];
+
+    uint32_t result = vm_pop_u32(vm);
+
+    vm->stack_top -= stack_adjust;
+    vm->pc.operand = vm_pop_u32(vm);
+    vm->pc.opcode = vm_pop_u32(vm);
+
+    vm->stack_top -= frame_size;
+    vm_push_u32(vm, result);
+}
+
+static void vm_return_u64(struct VirtualMachine *vm) {
+    uint32_t stack_adjust = vm->module->operands[vm->pc.operand + 0];
+    uint32_t frame_size = vm->module->operands[vm->pc.operand + 1];
+
+    uint64_t result = vm_pop_u64(vm);
+
+    vm->stack_top -= stack_adjust;
+    vm->pc.operand = vm_pop_u32(vm);
+    vm->pc.opcode = vm_pop_u32(vm);
+
+    vm->stack_top -= frame_size;
+    vm_push_u64(vm, result);
+}
+
+static const char snapshot_magic[8] = "zwasnap";
+#define snapshot_format_version 1
+#define snapshot_page_size 4096
+
+/// Header of a snapshot of the guest state, followed by globals, the
+/// table, data segment lengths, the stack, the indexes of the non-zero
+/// memory pages and then those pages.
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t format_version;
+    uint32_t memory_len;
+    uint64_t key;
+    /// Must match the code image the snapshot's program counters refer to.
+    struct ProgramCounter code_end;
+    /// Points at the Op_call_import that reached the snapshot point.
+    struct ProgramCounter pc;
+    uint32_t globals_len;
+    uint32_t table_len;
+    uint32_t datas_len;
+    uint32_t stack_top;
+    uint32_t pages_len;
+};
+
+static void snap_name(char *buf, size_t buf_len, uint64_t key) {
+    snprintf(buf, buf_len, "snapshot-%016" PRIx64, key);
+}
+
+static bool snap_pageIsZero(const char *page) {
+    const uint64_t *words = (const uint64_t *)page;
+    uint64_t any = 0;
+    for (size_t i = 0; i < snapshot_page_size / sizeof(uint64_t); i += 1) any |= words[i];
+    return any == 0;
+}
+
+/// Host functions the guest's startup code may call without making its
+/// state depend on the invocation: preopen discovery returns the same
+/// answers every time.
+static bool snap_isStartupCall(const char *name) {
+    return strcmp(name, "fd_prestat_get") == 0 || strcmp(name, "fd_prestat_dir_name") == 0;
+}
+
+/// Saves the guest state to the snapshot directory. Like the image, a
+/// snapshot is only an optimization, so failing to write it is ignored.
+static void snap_save(const struct VirtualMachine *vm, struct ProgramCounter pc) {
+    uint32_t pages_cap = (vm->memory_len + snapshot_page_size - 1) / snapshot_page_size;
+    uint32_t *pages = malloc(sizeof(uint32_t) * (pages_cap + 1));
+    if (pages == NULL) return;
+    uint32_t pages_len = 0;
+    for (uint32_t page_i = 0; page_i < pages_cap; page_i += 1) {
+        if (!snap_pageIsZero(vm->memory + (size_t)page_i * snapshot_page_size))
+            pages[pages_len++] = page_i;
+    }
+
+    struct SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, snapshot_magic, sizeof(snapshot_magic));
+    header.format_version = snapshot_format_version;
+    header.memory_len = vm->memory_len;
+    header.key = vm->snapshot_key;
+    header.code_end = vm->module->code_end;
+    header.pc = pc;
+    header.globals_len = vm->module->globals_len;
+    header.table_len = vm->module->table_len;
+    header.datas_len = vm->module->datas_len;
+    header.stack_top = vm->stack_top;
+    header.pages_len = pages_len;
+
+    char name[32];
+    snap_name(name, sizeof(name), vm->snapshot_key);
+    char tmp_name[64];
+    snprintf(tmp_name, sizeof(tmp_name), "%s.%ld.tmp", name, (long)getpid());
+    int fd = openat(vm->snapshot_dir, tmp_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd == -1) {
+        free(pages);
+        return;
+    }
+    bool ok = write_all(fd, &header, sizeof(header)) &&
+        write_all(fd, vm->globals, sizeof(uint64_t) * vm->module->globals_len) &&
+        write_all(fd, vm->table, sizeof(uint32_t) * vm->module->table_len);
+    for (uint32_t data_i = 0; ok && data_i < vm->module->datas_len; data_i += 1)
+        ok = write_all(fd, &vm->datas[data_i].len, sizeof(uint32_t));
+    ok = ok && write_all(fd, vm->stack, sizeof(uint32_t) * vm->stack_top) &&
+        write_all(fd, pages, sizeof(uint32_t) * pages_len);
+    for (uint32_t i = 0; ok && i < pages_len; i += 1)
+        ok = write_all(fd, vm->memory + (size_t)pages[i] * snapshot_page_size, snapshot_page_size);
+    close(fd);
+    free(pages);
+    if (!ok || renameat(vm->snapshot_dir, tmp_name, vm->snapshot_dir, name) == -1)
+        unlinkat(vm->snapshot_dir, tmp_name, 0);
+}
+
+/// Called before each direct host call while a snapshot is pending, once
+/// vm->pc is past the call's operands. The first call that is not part of
+/// the guest's fixed startup is the snapshot point: a restored run resumes
+/// by executing that call.
+static void snap_reached(struct VirtualMachine *vm, uint32_t import_idx) {
+    if (snap_isStartupCall(host_functions[vm->module->imports[import_idx].host_idx].name)) return;
+    struct ProgramCounter pc = vm->pc;
+    pc.opcode -= 2;
+    snap_save(vm, pc);
+    vm->snapshot_dir = -1;
+}
+
+#ifdef __linux__
+/// A restored snapshot whose memory pages are copied in by a handler
+/// thread when the guest first touches them, rather than all up front.
+struct LazySnapshot {
+    int uffd;
+    char *memory;
+    /// Page contents inside the still mapped snapshot file.
+    const char *pages;
+    /// Per memory page, its index into pages or UINT32_MAX if it is zero.
+    uint32_t *slots;
+    uint32_t memory_pages;
+    /// First-touch order recorded by an earlier run, used for prefetching.
+    uint32_t *order;
+    uint32_t order_len;
+    uint32_t order_next;
+    /// First-touch order of this run, saved if none was recorded yet.
+    uint32_t *touched;
+    uint32_t touched_len;
+    int dir_fd;
+    uint64_t key;
+    uint32_t faulted;
+    uint32_t prefetched;
+    uint32_t zeroed;
+};
+
+static struct LazySnapshot lazy_snapshot;
+
+static void snap_orderName(char *buf, size_t buf_len, uint64_t key) {
+    snprintf(buf, buf_len, "snapshot-%016" PRIx64 ".order", key);
+}
+
+/// Returns false if the page was already present.
+static bool snap_fillPage(struct LazySnapshot *lazy, uint32_t page_i) {
+    uintptr_t dst = (uintptr_t)(lazy->memory + (size_t)page_i * snapshot_page_size);
+    uint32_t slot = lazy->slots[page_i];
+    int rc;
+    if (slot == UINT32_MAX) {
+        struct uffdio_zeropage zeropage = { .range = { .start = dst, .len = snapshot_page_size } };
+        rc = ioctl(lazy->uffd, UFFDIO_ZEROPAGE, &zeropage);
+    } else {
+        struct uffdio_copy copy = {
+            .dst = dst,
+            .src = (uintptr_t)(lazy->pages + (size_t)slot * snapshot_page_size),
+            .len = snapshot_page_size,
+        };
+        rc = ioctl(lazy->uffd, UFFDIO_COPY, &copy);
+    }
+    if (rc == -1 && errno == EEXIST) return false;
+    if (rc == -1) panic("unable to fill snapshot page");
+    if (slot == UINT32_MAX) __atomic_fetch_add(&lazy->zeroed, 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+/// Serves the guest's page faults, and while it is not faulting, copies in
+/// pages in the order an earlier run first touched them.
+static void *snap_serveFaults(void *arg) {
+    struct LazySnapshot *lazy = arg;
+    struct pollfd pfd = { .fd = lazy->uffd, .events = POLLIN };
+    for (;;) {
+        int rc = poll(&pfd, 1, lazy->order_next < lazy->order_len ? 0 : -1);
+        if (rc == -1) {
+            if (errno == EINTR) continue;
+            panic("unable to poll userfaultfd");
+        }
+        if (rc == 0) {
+            uint32_t page_i = lazy->order[lazy->order_next++];
+            if (page_i < lazy->memory_pages && snap_fillPage(lazy, page_i))
+                __atomic_fetch_add(&lazy->prefetched, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+        struct uffd_msg msg;
+        ssize_t amt = read(lazy->uffd, &msg, sizeof(msg));
+        if (amt == -1 && (errno == EAGAIN || errno == EINTR)) continue;
+        if (amt != sizeof(msg)) panic("unable to read userfaultfd");
+        if (msg.event != UFFD_EVENT_PAGEFAULT) continue;
+        uint32_t page_i = (uint32_t)((msg.arg.pagefault.address - (uintptr_t)lazy->memory) /
+            snapshot_page_size);
+        // Racing a prefetch is harmless: the copy that won woke the guest.
+        if (!snap_fillPage(lazy, page_i)) continue;
+        __atomic_fetch_add(&lazy->faulted, 1, __ATOMIC_RELAXED);
+        if (lazy->touched != NULL && lazy->touched_len < lazy->memory_pages) {
+            lazy->touched[lazy->touched_len] = page_i;
+            __atomic_store_n(&lazy->touched_len, lazy->touched_len + 1, __ATOMIC_RELEASE);
+        }
+    }
+    return NULL;
+}
+
+/// Saves the recorded first-touch order and reports page-in counts.
+static void snap_lazyExit(void) {
+    struct LazySnapshot *lazy = &lazy_snapshot;
+    uint32_t faulted = __atomic_load_n(&lazy->faulted, __ATOMIC_RELAXED);
+    uint32_t prefetched = __atomic_load_n(&lazy->prefetched, __ATOMIC_RELAXED);
+    uint32_t zeroed = __atomic_load_n(&lazy->zeroed, __ATOMIC_RELAXED);
+    if (lazy->touched != NULL) {
+        uint32_t touched_len = __atomic_load_n(&lazy->touched_len, __ATOMIC_ACQUIRE);
+        char name[48];
+        snap_orderName(name, sizeof(name), lazy->key);
+        char tmp_name[80];
+        snprintf(tmp_name, sizeof(tmp_name), "%s.%ld.tmp", name, (long)getpid());
+        int fd = openat(lazy->dir_fd, tmp_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+        if (fd != -1) {
+            bool ok = write_all(fd, lazy->touched, sizeof(uint32_t) * touched_len);
+            close(fd);
+            if (!ok || renameat(lazy->dir_fd, tmp_name, lazy->dir_fd, name) == -1)
+                unlinkat(lazy->dir_fd, tmp_name, 0);
+        }
+    }
+    if (startup.enabled)
+        fprintf(stderr, "snapshot pages: %" PRIu32 " faulted, %" PRIu32 " prefetched, "
+            "%" PRIu32 " zero-filled, %" PRIu32 " total\n",
+            faulted, prefetched, zeroed, lazy->memory_pages);
+}
+
+/// Leaves the guest memory empty and registers it with userfaultfd so that
+/// snap_serveFaults fills each page on first access. The snapshot mapping
+/// must stay alive for the rest of the process. Returns false, having
+/// changed nothing, if userfaultfd is unavailable. page_indexes must be
+/// below memory_len in pages.
+static bool snap_restoreLazy(struct VirtualMachine *vm, int dir_fd, uint64_t key,
+    uint32_t memory_len, const uint32_t *page_indexes, uint32_t pages_len, const char *pages)
+{
+    if (host_page_size != snapshot_page_size || memory_len == 0) return false;
+    // Host calls hand guest memory to the kernel, so faults taken inside
+    // system calls must be served too, which rules out UFFD_USER_MODE_ONLY.
+    int uffd = syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    if (uffd == -1) return false;
+    struct uffdio_api api = { .api = UFFD_API };
+    if (ioctl(uffd, UFFDIO_API, &api) == -1) {
+        close(uffd);
+        return false;
+    }
+
+    struct LazySnapshot *lazy = &lazy_snapshot;
+    uint32_t memory_pages = memory_len / snapshot_page_size;
+    uint32_t *slots = malloc(sizeof(uint32_t) * memory_pages);
+    if (slots == NULL) panic("out of memory");
+    memset(slots, 0xff, sizeof(uint32_t) * memory_pages);
+    for (uint32_t i = 0; i < pages_len; i += 1) slots[page_indexes[i]] = i;
+
+    if (madvise(vm->memory, memory_len, MADV_DONTNEED) == -1)
+        panic("unable to discard memory for lazy snapshot restore");
+    struct uffdio_register reg = {
+        .range = { .start = (uintptr_t)vm->memory, .len = memory_len },
+        .mode = UFFDIO_REGISTER_MODE_MISSING,
+    };
+    if (ioctl(uffd, UFFDIO_REGISTER, &reg) == -1) {
+        close(uffd);
+        free(slots);
+        return false;
+    }
+
+    *lazy = (struct LazySnapshot){
+        .uffd = uffd,
+        .memory = vm->memory,
+        .pages = pages,
+        .slots = slots,
+        .memory_pages = memory_pages,
+        .dir_fd = dir_fd,
+        .key = key,
+    };
+    char name[48];
+    snap_orderName(name, sizeof(name), key);
+    int fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd != -1 && fstat(fd, &st) != -1 && st.st_size > 0 &&
+        (size_t)st.st_size <= sizeof(uint32_t) * memory_pages)
+    {
+        lazy->order = malloc(st.st_size);
+        if (lazy->order != NULL && read_all(fd, lazy->order, st.st_size))
+            lazy->order_len = st.st_size / sizeof(uint32_t);
+    } else {
+        lazy->touched = malloc(sizeof(uint32_t) * memory_pages);
+    }
+    if (fd != -1) close(fd);
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, snap_serveFaults, lazy) != 0)
+        panic("unable to start snapshot fault handler");
+    pthread_detach(thread);
+    atexit(snap_lazyExit);
+    return true;
+}
+#endif
+
+/// Replaces the freshly loaded guest state with a snapshot taken by an
+/// earlier run of the same module. Returns false, leaving the VM as it
+/// was, if there is no usable snapshot. With lazy set, memory is filled
+/// in on demand where userfaultfd is available.
+static bool snap_restore(struct VirtualMachine *vm, int dir_fd, uint64_t key, bool lazy) {
+    char name[32];
+    snap_name(name, sizeof(name), key);
+    int fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return false;
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(struct SnapshotHeader)) {
+        close(fd);
+        return false;
+    }
+    char *ptr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (ptr == MAP_FAILED) return false;
+
+    const struct SnapshotHeader *header = (const struct SnapshotHeader *)ptr;
+    size_t globals_offset = sizeof(struct SnapshotHeader);
+    size_t table_offset = globals_offset + sizeof(uint64_t) * header->globals_len;
+    size_t datas_offset = table_offset + sizeof(uint32_t) * header->table_len;
+    size_t stack_offset = datas_offset + sizeof(uint32_t) * header->datas_len;
+    size_t pages_offset = stack_offset + sizeof(uint32_t) * header->stack_top;
+    size_t memory_offset = pages_offset + sizeof(uint32_t) * header->pages_len;
+    size_t len = memory_offset + (size_t)snapshot_page_size * header->pages_len;
+    if (memcmp(header->magic, snapshot_magic, sizeof(snapshot_magic)) != 0 ||
+        header->format_version != snapshot_format_version || header->key != key ||
+        header->code_end.opcode != vm->module->code_end.opcode ||
+        header->code_end.operand != vm->module->code_end.operand ||
+        header->globals_len != vm->module->globals_len || header->table_len != vm->module->table_len ||
+        header->datas_len != vm->module->datas_len || header->memory_len > max_memory ||
+        header->stack_top > max_stack_len || len != (size_t)st.st_size)
+    {
+        munmap(ptr, st.st_size);
+        return false;
+    }
+    // Page indexes are strictly increasing and inside memory_len.
+    const uint32_t *pages = (const uint32_t *)(ptr + pages_offset);
+    uint32_t memory_pages = header->memory_len / snapshot_page_size;
+    for (uint32_t i = 0; i < header->pages_len; i += 1) {
+        if (pages[i] >= memory_pages || (i != 0 && pages[i] <= pages[i - 1])) {
+            munmap(ptr, st.st_size);
+            return false;
+        }
+    }
+
+    memcpy(vm->globals, ptr + globals_offset, sizeof(uint64_t) * header->globals_len);
+    memcpy(vm->table, ptr + table_offset, sizeof(uint32_t) * header->table_len);
+    const uint32_t *data_lens = (const uint32_t *)(ptr + datas_offset);
+    for (uint32_t data_i = 0; data_i < header->datas_len; data_i += 1)
+        vm->datas[data_i].len = data_lens[data_i];
+    if (header->stack_top > vm->stack_len) vm_growStack(vm, header->stack_top);
+    memcpy(vm->stack, ptr + stack_offset, sizeof(uint32_t) * header->stack_top);
+    vm->stack_top = header->stack_top;
+
+    vm->pc = header->pc;
+
+#ifdef __linux__
+    if (lazy && snap_restoreLazy(vm, dir_fd, key, header->memory_len, pages,
+            header->pages_len, ptr + memory_offset))
+    {
+        vm->memory_len = header->memory_len;
+        // Discarded registered pages would fault back in from the
+        // snapshot rather than read as zero, so bulk zeroing must write.
+        vm->memory_file_len = header->memory_len;
+        return true;
+    }
+#else
+    (void)lazy;
+#endif
+    // Memory past memory_init_len is still untouched and therefore zero;
+    // below it, pages missing from the snapshot were zeroed by the guest.
+    uint32_t init_pages = (vm->module->memory_init_len + snapshot_page_size - 1) / snapshot_page_size;
+    uint32_t next_page = 0;
+    for (uint32_t i = 0; i < header->pages_len; i += 1) {
+        uint32_t page_i = pages[i];
+        for (; next_page < page_i && next_page < init_pages; next_page += 1)
+            memset(vm->memory + (size_t)next_page * snapshot_page_size, 0, snapshot_page_size);
+        memcpy(vm->memory + (size_t)page_i * snapshot_page_size,
+            ptr + memory_offset + (size_t)i * snapshot_page_size, snapshot_page_size);
+        next_page = page_i + 1;
+    }
+    for (; next_page < init_pages; next_page += 1)
+        memset(vm->memory + (size_t)next_page * snapshot_page_size, 0, snapshot_page_size);
+    vm->memory_len = header->memory_len;
+    munmap(ptr, st.st_size);
+    return true;
+}
+
+/// Runs the guest until proc_exit or, when the outermost frame was called
+/// by the host, until that call returns.
+static void vm_run(struct VirtualMachine *vm) {
+    uint8_t *opcodes = vm->module->opcodes;
+    uint32_t *operands = vm->module->operands;
+    struct ProgramCounter *pc = &vm->pc;
+    uint32_t global_0 = vm->globals[0];
+    for (;;) {
         enum Op op = opcodes[pc->opcode];
         //fprintf(stderr, "stack[%u:%u]=%x:%x pc=%x:%x op=%u\n",
         //    vm->stack_top - 2, vm->stack_top - 1,
@@ -3102,34 +5425,55 @@ static void vm_run(struct VirtualMachine *vm) {
                 break;
             case Op_return_void:
                 vm_return_void(vm);
+                if (pc->opcode == host_return_pc) {
+                    vm->globals[0] = global_0;
+                    return;
+                }
                 break;
             case Op_return_32:
                 vm_return_u32(vm);
+                if (pc->opcode == host_return_pc) {
+                    vm->globals[0] = global_0;
+                    return;
+                }
                 break;
             case Op_return_64:
                 vm_return_u64(vm);
+                if (pc->opcode == host_return_pc) {
+                    vm->globals[0] = global_0;
+                    return;
+                }
                 break;
             case Op_call_import:
                 {
                     uint8_t import_idx = opcodes[pc->opcode];
                     pc->opcode += 1;
-                    vm_callImport(vm, &vm->imports[import_idx]);
+                    if (vm->snapshot_dir != -1) {
+                        vm->globals[0] = global_0;
+                        snap_reached(vm, import_idx);
+                    }
+                    vm->import_idx = import_idx;
+                    vm->module->imports[import_idx].fn(vm);
                 }
                 break;
             case Op_call_func:
                 {
                     uint32_t func_idx = operands[pc->operand];
                     pc->operand += 1;
-                    vm_call(vm, &vm->functions[func_idx]);
+                    vm_call(vm, &vm->module->functions[func_idx]);
                 }
                 break;
             case Op_call_indirect:
                 {
                     uint32_t fn_id = vm->table[vm_pop_u32(vm)];
-                    if (fn_id < vm->imports_len)
-                        vm_callImport(vm, &vm->imports[fn_id]);
-                    else
-                        vm_call(vm, &vm->functions[fn_id - vm->imports_len]);
+                    if (fn_id < vm->module->imports_len) {
+                        // An indirect host call cannot be replayed from a snapshot.
+                        vm->snapshot_dir = -1;
+                        vm->import_idx = fn_id;
+                        vm->module->imports[fn_id].fn(vm);
+                    } else {
+                        vm_call(vm, &vm->module->functions[fn_id - vm->module->imports_len]);
+                    }
                 }
                 break;
 
@@ -3345,7 +5689,7 @@ static void vm_run(struct VirtualMachine *vm) {
                     uint32_t page_count = vm_pop_u32(vm);
                     uint32_t old_page_count = vm->memory_len / wasm_page_size;
                     uint32_t new_len = vm->memory_len + page_count * wasm_page_size;
-                    if (new_len > max_memory) {
+                    if (new_len > vm->memory_limit) {
                         vm_push_i32(vm, -1);
                     } else {
                         vm->memory_len = new_len;
@@ -4054,10 +6398,9 @@ static void vm_run(struct VirtualMachine *vm) {
                     uint32_t n = vm_pop_u32(vm);
                     uint32_t src = vm_pop_u32(vm);
                     uint32_t dest = vm_pop_u32(vm);
-                    assert(dest + n <= vm->memory_len);
-                    assert(src + n <= vm->memory_len);
-                    assert(src + n <= dest || dest + n <= src); // overlapping
-                    memcpy(vm->memory + dest, vm->memory + src, n);
+                    if ((uint64_t)dest + n > vm->memory_len || (uint64_t)src + n > vm->memory_len)
+                        panic("out of bounds memory access");
+                    vm_memmove(vm->memory + dest, vm->memory + src, n);
                 }
                 break;
             case Op_memset:
@@ -4065,10 +6408,48 @@ static void vm_run(struct VirtualMachine *vm) {
                     uint32_t n = vm_pop_u32(vm);
                     uint8_t value = (uint8_t)vm_pop_u32(vm);
                     uint32_t dest = vm_pop_u32(vm);
-                    assert(dest + n <= vm->memory_len);
-                    memset(vm->memory + dest, value, n);
+                    if ((uint64_t)dest + n > vm->memory_len) panic("out of bounds memory access");
+                    vm_memset(vm, dest, value, n);
+                }
+                break;
+            case Op_memcpy_small:
+                {
+                    uint32_t n = operands[pc->operand];
+                    pc->operand += 1;
+                    uint32_t src = vm_pop_u32(vm);
+                    uint32_t dest = vm_pop_u32(vm);
+                    if ((uint64_t)dest + n > vm->memory_len || (uint64_t)src + n > vm->memory_len)
+                        panic("out of bounds memory access");
+                    memmove_small(vm->memory + dest, vm->memory + src, n);
+                }
+                break;
+            case Op_memset_small:
+                {
+                    uint32_t n = operands[pc->operand];
+                    pc->operand += 1;
+                    uint8_t value = (uint8_t)vm_pop_u32(vm);
+                    uint32_t dest = vm_pop_u32(vm);
+                    if ((uint64_t)dest + n > vm->memory_len) panic("out of bounds memory access");
+                    memset_small(vm->memory + dest, value, n);
+                }
+                break;
+            case Op_memory_init:
+                {
+                    const struct DataSegment *data = &vm->datas[operands[pc->operand]];
+                    pc->operand += 1;
+                    uint32_t n = vm_pop_u32(vm);
+                    uint32_t src = vm_pop_u32(vm);
+                    uint32_t dest = vm_pop_u32(vm);
+                    if ((uint64_t)src + n > data->len ||
+                        (uint64_t)dest + n > vm->memory_len)
+                        panic("out of bounds memory access");
+                    memcpy(vm->memory + dest, vm->module->mod_ptr + data->offset + src, n);
                 }
                 break;
+            case Op_data_drop:
+                vm->datas[operands[pc->operand]].len = 0;
+                pc->operand += 1;
+                break;
         }
     }
 }
@@ -4079,489 +6460,2236 @@ static size_t common_prefix(const char *a, const char *b) {
     return i;
 }
 
-int main(int argc, char **argv) {
-    char *memory = mmap( NULL, max_memory, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+/// Bump whenever the decoder output or the image layout changes.
+#define image_format_version 3
 
-    const char *zig_lib_dir_path = argv[1];
-    const char *cmake_binary_dir_path = argv[2];
-    const char *root_name = argv[3];
-    size_t argv_i = 4;
-    const char *wasm_file = argv[argv_i];
+static const char image_magic[8] = "zwasimg";
 
-    size_t cwd_path_len = common_prefix(zig_lib_dir_path, cmake_binary_dir_path);
-    const char *rel_cmake_bin_path = cmake_binary_dir_path + cwd_path_len;
+/// Header of a decoded module image in the cache directory. The arrays
+/// follow at the offsets computed by image_layout.
+struct ImageHeader {
+    char magic[8];
+    uint64_t key;
+    uint32_t start_fn_idx;
+    uint32_t memory_len;
+    uint32_t memory_init_len;
+    uint32_t types_len;
+    uint32_t imports_len;
+    uint32_t exports_len;
+    uint32_t functions_len;
+    uint32_t globals_len;
+    uint32_t table_len;
+    uint32_t datas_len;
+    /// Bytes of the segments that memory.init can still read.
+    uint32_t blob_len;
+    struct ProgramCounter code_len;
+};
 
-    size_t rel_cmake_bin_path_len = strlen(rel_cmake_bin_path);
+struct ImageLayout {
+    size_t types;
+    size_t imports;
+    size_t exports;
+    size_t functions;
+    size_t globals;
+    size_t table;
+    size_t datas;
+    size_t blob;
+    size_t memory;
+    size_t opcodes;
+    size_t operands;
+    size_t len;
+};
 
-    const char *new_argv[30];
-    char new_argv_buf[PATH_MAX + 1024];
-    uint32_t new_argv_i = 0;
-    uint32_t new_argv_buf_i = 0;
+static void image_layout(const struct ImageHeader *header, struct ImageLayout *layout) {
+    size_t i = align_forward(sizeof(struct ImageHeader), 64);
+    layout->types = i;
+    i = align_forward(i + sizeof(struct TypeInfo) * header->types_len, 64);
+    layout->imports = i;
+    i = align_forward(i + sizeof(struct Import) * header->imports_len, 64);
+    layout->exports = i;
+    i = align_forward(i + sizeof(struct Export) * header->exports_len, 64);
+    layout->functions = i;
+    i = align_forward(i + sizeof(struct Function) * header->functions_len, 64);
+    layout->globals = i;
+    i = align_forward(i + sizeof(uint64_t) * header->globals_len, 64);
+    layout->table = i;
+    i = align_forward(i + sizeof(uint32_t) * header->table_len, 64);
+    layout->datas = i;
+    i = align_forward(i + sizeof(struct DataSegment) * header->datas_len, 64);
+    layout->blob = i;
+    i = align_forward(i + header->blob_len, 64);
+    layout->memory = i;
+    i += header->memory_init_len;
+    // The code starts on its own page so that it can be made read-only.
+    layout->opcodes = align_forward(i, host_page_size);
+    layout->operands = align_forward(layout->opcodes + header->code_len.opcode, 64);
+    layout->len = layout->operands + sizeof(uint32_t) * header->code_len.operand;
+}
+
+/// Cached images are keyed by the module file contents and the build of
+/// the engine that decoded them.
+static uint64_t image_key(struct ByteSlice module_file) {
+    return hash_bytes(engine_hash() + image_format_version, module_file.ptr, module_file.len);
+}
 
-    int cache_dir = -1;
+/// Maps a cached image read-only and shared, so that every process running
+/// the module shares the physical pages of its code, types and functions.
+/// The few arrays that change at runtime are copied into the arena. Returns
+/// false when there is no usable image for key.
+static bool image_load(struct VirtualMachine *vm, struct Arena *arena, int dir_fd, uint64_t key,
+    uint32_t *start_fn_idx)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "image-%016" PRIx64, key);
+    int fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return false;
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(struct ImageHeader)) {
+        close(fd);
+        return false;
+    }
+    char *ptr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ptr == MAP_FAILED) return false;
+
+    const struct ImageHeader *header = (const struct ImageHeader *)ptr;
+    struct ImageLayout layout;
+    image_layout(header, &layout);
+    if (memcmp(header->magic, image_magic, sizeof(image_magic)) != 0 ||
+        header->key != key || layout.len != (size_t)st.st_size)
     {
-        char cache_dir_buf[PATH_MAX * 2];
-        size_t i = 0;
-        size_t cmake_binary_dir_path_len = strlen(cmake_binary_dir_path);
+        munmap(ptr, st.st_size);
+        return false;
+    }
+
+    vm->module->mod_ptr = ptr + layout.blob;
+    vm->module->mapping.ptr = ptr;
+    vm->module->mapping.len = st.st_size;
+    vm->module->types = (struct TypeInfo *)(ptr + layout.types);
+    vm->module->types_len = header->types_len;
+    const struct Import *imports = (const struct Import *)(ptr + layout.imports);
+    for (uint32_t imp_i = 0; imp_i < header->imports_len; imp_i += 1) {
+        if (imports[imp_i].host_idx >= host_functions_len) {
+            munmap(ptr, st.st_size);
+            return false;
+        }
+    }
+    vm->module->imports = arena_alloc(arena, sizeof(struct Import) * header->imports_len);
+    vm->module->imports_len = header->imports_len;
+    memcpy(vm->module->imports, imports, sizeof(struct Import) * header->imports_len);
+    // Host function addresses change from run to run.
+    for (uint32_t imp_i = 0; imp_i < vm->module->imports_len; imp_i += 1)
+        vm->module->imports[imp_i].fn = host_functions[vm->module->imports[imp_i].host_idx].fn;
+    vm->module->exports = (struct Export *)(ptr + layout.exports);
+    vm->module->exports_len = header->exports_len;
+    vm->module->functions = (struct Function *)(ptr + layout.functions);
+    vm->module->functions_len = header->functions_len;
+    vm->globals = arena_alloc(arena, sizeof(uint64_t) * header->globals_len);
+    vm->module->globals_len = header->globals_len;
+    memcpy(vm->globals, ptr + layout.globals, sizeof(uint64_t) * header->globals_len);
+    vm->table = NULL;
+    if (header->table_len != 0) {
+        vm->table = arena_alloc(arena, sizeof(uint32_t) * header->table_len);
+        memcpy(vm->table, ptr + layout.table, sizeof(uint32_t) * header->table_len);
+    }
+    vm->module->table_len = header->table_len;
+    vm->datas = arena_alloc(arena, sizeof(struct DataSegment) * header->datas_len);
+    vm->module->datas_len = header->datas_len;
+    memcpy(vm->datas, ptr + layout.datas, sizeof(struct DataSegment) * header->datas_len);
+    vm->memory_len = header->memory_len;
+    vm->module->memory_init_len = header->memory_init_len;
+    memcpy(vm->memory, ptr + layout.memory, header->memory_init_len);
+    vm->module->opcodes = (uint8_t *)(ptr + layout.opcodes);
+    vm->module->operands = (uint32_t *)(ptr + layout.operands);
+    vm->module->decoder = NULL;
+    vm->module->code_end = header->code_len;
+    *start_fn_idx = header->start_fn_idx;
+    return true;
+}
 
-        memcpy(cache_dir_buf + i, cmake_binary_dir_path, cmake_binary_dir_path_len);
-        i += cmake_binary_dir_path_len;
+/// Writes the freshly loaded module to the cache directory and returns
+/// whether it succeeded. The image is only an optimization, so failing to
+/// write it is not an error.
+static bool image_save(const struct VirtualMachine *vm, int dir_fd, uint64_t key, uint32_t start_fn_idx) {
+    struct ImageHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, image_magic, sizeof(image_magic));
+    header.key = key;
+    header.start_fn_idx = start_fn_idx;
+    header.memory_len = vm->memory_len;
+    header.memory_init_len = vm->module->memory_init_len;
+    header.types_len = vm->module->types_len;
+    header.imports_len = vm->module->imports_len;
+    header.exports_len = vm->module->exports_len;
+    header.functions_len = vm->module->functions_len;
+    header.globals_len = vm->module->globals_len;
+    header.table_len = vm->module->table_len;
+    header.datas_len = vm->module->datas_len;
+    header.blob_len = 0;
+    for (uint32_t data_i = 0; data_i < vm->module->datas_len; data_i += 1)
+        header.blob_len += vm->datas[data_i].len;
+    header.code_len = vm->module->code_end;
+    struct ImageLayout layout;
+    image_layout(&header, &layout);
+
+    char name[32];
+    snprintf(name, sizeof(name), "image-%016" PRIx64, key);
+    char tmp_name[64];
+    snprintf(tmp_name, sizeof(tmp_name), "%s.%ld.tmp", name, (long)getpid());
+    int fd = openat(dir_fd, tmp_name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd == -1) return false;
+    char *ptr = MAP_FAILED;
+    if (ftruncate(fd, layout.len) != -1)
+        ptr = mmap(NULL, layout.len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ptr == MAP_FAILED) {
+        unlinkat(dir_fd, tmp_name, 0);
+        return false;
+    }
 
-        cache_dir_buf[i] = '/';
-        i += 1;
+    memcpy(ptr, &header, sizeof(header));
+    memcpy(ptr + layout.types, vm->module->types, sizeof(struct TypeInfo) * header.types_len);
+    memcpy(ptr + layout.imports, vm->module->imports, sizeof(struct Import) * header.imports_len);
+    memcpy(ptr + layout.exports, vm->module->exports, sizeof(struct Export) * header.exports_len);
+    memcpy(ptr + layout.functions, vm->module->functions, sizeof(struct Function) * header.functions_len);
+    memcpy(ptr + layout.globals, vm->globals, sizeof(uint64_t) * header.globals_len);
+    memcpy(ptr + layout.table, vm->table, sizeof(uint32_t) * header.table_len);
+    // Segments that are still live move into the blob, which takes the
+    // place of the module for memory.init.
+    struct DataSegment *datas = (struct DataSegment *)(ptr + layout.datas);
+    uint32_t blob_i = 0;
+    for (uint32_t data_i = 0; data_i < header.datas_len; data_i += 1) {
+        const struct DataSegment *data = &vm->datas[data_i];
+        memcpy(ptr + layout.blob + blob_i, vm->module->mod_ptr + data->offset, data->len);
+        datas[data_i].offset = blob_i;
+        datas[data_i].len = data->len;
+        blob_i += data->len;
+    }
+    memcpy(ptr + layout.memory, vm->memory, header.memory_init_len);
+    memcpy(ptr + layout.opcodes, vm->module->opcodes, header.code_len.opcode);
+    memcpy(ptr + layout.operands, vm->module->operands, sizeof(uint32_t) * header.code_len.operand);
+    munmap(ptr, layout.len);
+
+    if (renameat(dir_fd, tmp_name, dir_fd, name) == -1) {
+        unlinkat(dir_fd, tmp_name, 0);
+        return false;
+    }
+    return true;
+}
 
-        memcpy(cache_dir_buf + i, "zig1-cache", strlen("zig1-cache"));
-        i += strlen("zig1-cache");
+/// Parses and decodes the module, pointing the VM at the result. Returns
+/// the function index of _start, or UINT32_MAX if there is none. Decoded functions are cached in
+/// cache_dir unless it is -1. With lazy_decode set, functions are only
+/// located and decoded on their first call. With one_thread set, no
+/// helper threads are started, so every panic happens on the caller's.
+static uint32_t vm_load(struct VirtualMachine *vm, struct Arena *arena,
+    struct ByteSlice module_file, int cache_dir, bool lazy_decode, bool one_thread)
+{
+    struct ModuleInput input;
+    mi_init(&input, module_file, arena, !one_thread);
+    char *mod_ptr = input.ptr;
+    vm->module->mapping.ptr = input.src.ptr == NULL ? module_file.ptr : NULL;
+    vm->module->mapping.len = module_file.len;
 
-        cache_dir_buf[i] = 0;
+    uint32_t i = 0;
 
-        mkdir(cache_dir_buf, 0777);
-        cache_dir = err_wrap("opening cache dir",
-                open(cache_dir_buf, O_DIRECTORY|O_RDONLY|O_CLOEXEC));
+    mi_wait(&input, 8);
+    if (mod_ptr[0] != 0 || mod_ptr[1] != 'a' || mod_ptr[2] != 's' || mod_ptr[3] != 'm') {
+        panic("bad magic");
     }
+    i += 4;
 
-    // Construct a new argv for the WASI code which has absolute paths
-    // converted to relative paths, and has the target and terminal status
+    uint32_t version = read_u32_le(mod_ptr + i);
+    i += 4;
+    if (version != 1) panic("bad wasm version");
+
+    uint32_t section_starts[13];
+    uint32_t section_lens[13];
+    memset(&section_starts, 0, sizeof(uint32_t) * 13);
+    memset(&section_lens, 0, sizeof(uint32_t) * 13);
+
+    // Everything in front of the code section is small; it is parsed as
+    // soon as it has been inflated and function bodies are then decoded one
+    // by one as they arrive.
+    mi_scanSections(&input, i, section_starts, section_lens, Section_code);
+    startup_phase("scan sections", section_starts[Section_code], 0, 0, 0);
+
+    // Map type indexes to offsets into the module.
+    struct TypeInfo *types;
+    uint32_t types_len;
+    {
+        i = section_starts[Section_type];
+        types_len = read32_uleb128(mod_ptr, &i);
+        types = arena_alloc(arena, sizeof(struct TypeInfo) * types_len);
+        for (size_t type_i = 0; type_i < types_len; type_i += 1) {
+            struct TypeInfo *info = &types[type_i];
+            if (mod_ptr[i] != 0x60) panic("bad type byte");
+            i += 1;
+
+            info->param_count = read32_uleb128(mod_ptr, &i);
+            if (info->param_count > 32) panic("found a type with over 32 parameters");
+            info->param_types = 0;
+            for (uint32_t param_i = 0; param_i < info->param_count; param_i += 1) {
+                int64_t param_type = read64_ileb128(mod_ptr, &i);
+                switch (param_type) {
+                    case -1: case -3: bs_unset(&info->param_types, param_i); break;
+                    case -2: case -4:   bs_set(&info->param_types, param_i); break;
+                    default: panic("unexpected param type");
+                }
+            }
+
+            info->result_count = read32_uleb128(mod_ptr, &i);
+            info->result_types = 0;
+            for (uint32_t result_i = 0; result_i < info->result_count; result_i += 1) {
+                int64_t result_type = read64_ileb128(mod_ptr, &i);
+                switch (result_type) {
+                    case -1: case -3: bs_unset(&info->result_types, result_i); break;
+                    case -2: case -4:   bs_set(&info->result_types, result_i); break;
+                    default: panic("unexpected result type");
+                }
+            }
+        }
+        startup_phase("types", section_lens[Section_type], types_len, 0, 0);
+    }
+
+    // Count the imported functions so we can correct function references.
+    struct Import *imports;
+    uint32_t imports_len;
+    {
+        i = section_starts[Section_import];
+        imports_len = read32_uleb128(mod_ptr, &i);
+        imports = arena_alloc(arena, sizeof(struct Import) * imports_len);
+        for (size_t imp_i = 0; imp_i < imports_len; imp_i += 1) {
+            struct Import *imp = &imports[imp_i];
+
+            struct ByteSlice mod_name = read_name(mod_ptr, &i);
+            struct ByteSlice sym_name = read_name(mod_ptr, &i);
+            imp->host_idx = host_resolve(vm->module, mod_name, sym_name);
+            if (imp->host_idx == UINT32_MAX) panic("unknown import");
+            const char *signature;
+            if (imp->host_idx < host_functions_len) {
+                imp->fn = host_functions[imp->host_idx].fn;
+                signature = host_functions[imp->host_idx].signature;
+            } else {
+                imp->fn = host_callRegistered;
+                signature = vm->module->extra_hosts[imp->host_idx - host_functions_len].signature;
+            }
+
+            uint32_t desc = read32_uleb128(mod_ptr, &i);
+            if (desc != 0) panic("external kind not function");
+            imp->type_idx = read32_uleb128(mod_ptr, &i);
+            if (!host_signatureMatches(signature, &types[imp->type_idx]))
+                panic("import signature mismatch");
+        }
+        startup_phase("imports", section_lens[Section_import], imports_len, 0, 0);
+    }
+
+    // Record the exported functions, among them _start.
+    struct Export *exports = NULL;
+    uint32_t exports_len = 0;
+    uint32_t start_fn_idx = UINT32_MAX;
+    if (section_starts[Section_export] != 0) {
+        i = section_starts[Section_export];
+        uint32_t count = read32_uleb128(mod_ptr, &i);
+        exports = arena_alloc(arena, sizeof(struct Export) * count);
+        for (; count > 0; count -= 1) {
+            struct ByteSlice name = read_name(mod_ptr, &i);
+            uint32_t desc = read32_uleb128(mod_ptr, &i);
+            uint32_t idx = read32_uleb128(mod_ptr, &i);
+            if (desc != 0 || name.len > max_export_name_len) continue;
+            struct Export *exp = &exports[exports_len];
+            exports_len += 1;
+            exp->func_idx = idx;
+            exp->name_len = name.len;
+            memcpy(exp->name, name.ptr, name.len);
+            if (name.len == strlen("_start") && memcmp(name.ptr, "_start", name.len) == 0)
+                start_fn_idx = idx;
+        }
+    }
+
+    // Map function indexes to offsets into the module and type index.
+    struct Function *functions;
+    uint32_t functions_len;
+    {
+        i = section_starts[Section_function];
+        functions_len = read32_uleb128(mod_ptr, &i);
+        functions = arena_alloc(arena, sizeof(struct Function) * functions_len);
+        for (size_t func_i = 0; func_i < functions_len; func_i += 1) {
+            struct Function *func = &functions[func_i];
+            func->id = imports_len + func_i;
+            func->type_idx = read32_uleb128(mod_ptr, &i);
+        }
+    }
+
+    // Allocate and initialize globals.
+    uint64_t *globals;
+    uint32_t globals_len;
+    {
+        i = section_starts[Section_global];
+        globals_len = read32_uleb128(mod_ptr, &i);
+        globals = arena_alloc(arena, sizeof(uint64_t) * globals_len);
+        for (size_t glob_i = 0; glob_i < globals_len; glob_i += 1) {
+            uint64_t *global = &globals[glob_i];
+            uint32_t content_type = read32_uleb128(mod_ptr, &i);
+            uint32_t mutability = read32_uleb128(mod_ptr, &i);
+            if (mutability != 1) panic("expected mutable global");
+            if (content_type != 0x7f) panic("unexpected content type");
+            uint8_t opcode = mod_ptr[i];
+            i += 1;
+            if (opcode != WasmOp_i32_const) panic("expected i32_const op");
+            uint32_t init = read32_ileb128(mod_ptr, &i);
+            *global = (uint32_t)init;
+        }
+    }
+    startup_phase("functions and globals",
+        section_lens[Section_export] + section_lens[Section_function] + section_lens[Section_global],
+        functions_len + globals_len, 0, 0);
+
+    // Allocate memory. It is initialized once the data section has arrived.
+    uint32_t memory_len;
+    {
+        i = section_starts[Section_memory];
+        uint32_t memories_len = read32_uleb128(mod_ptr, &i);
+        if (memories_len != 1) panic("unexpected memory count");
+        uint32_t flags = read32_uleb128(mod_ptr, &i);
+        (void)flags;
+        memory_len = read32_uleb128(mod_ptr, &i) * wasm_page_size;
+    }
+
+    uint32_t *table = NULL;
+    uint32_t table_len = 0;
+    {
+        i = section_starts[Section_table];
+        uint32_t table_count = read32_uleb128(mod_ptr, &i);
+        if (table_count > 1) {
+            panic("expected only one table section");
+        } else if (table_count == 1) {
+            uint32_t element_type = read32_uleb128(mod_ptr, &i);
+            (void)element_type;
+            uint32_t has_max = read32_uleb128(mod_ptr, &i);
+            if (has_max != 1) panic("expected has_max==1");
+            uint32_t initial = read32_uleb128(mod_ptr, &i);
+            (void)initial;
+            uint32_t maximum = read32_uleb128(mod_ptr, &i);
+
+            i = section_starts[Section_element];
+            uint32_t element_section_count = read32_uleb128(mod_ptr, &i);
+            if (element_section_count != 1) panic("expected one element section");
+            uint32_t flags = read32_uleb128(mod_ptr, &i);
+            (void)flags;
+            enum WasmOp opcode = mod_ptr[i];
+            i += 1;
+            if (opcode != WasmOp_i32_const) panic("expected op i32_const");
+            uint32_t offset = read32_uleb128(mod_ptr, &i);
+            enum WasmOp end = mod_ptr[i];
+            if (end != WasmOp_end) panic("expected op end");
+            i += 1;
+            uint32_t elem_count = read32_uleb128(mod_ptr, &i);
+
+            table_len = maximum;
+            table = arena_alloc(arena, sizeof(uint32_t) * table_len);
+            memset(table, 0, sizeof(uint32_t) * table_len);
+
+            for (uint32_t elem_i = 0; elem_i < elem_count; elem_i += 1) {
+                table[elem_i + offset] = read32_uleb128(mod_ptr, &i);
+            }
+        }
+        startup_phase("memory and table",
+            section_lens[Section_memory] + section_lens[Section_table] + section_lens[Section_element],
+            table_len, 0, 0);
+    }
+
+    vm->module->mod_ptr = mod_ptr;
+    vm->module->functions = functions;
+    vm->module->functions_len = functions_len;
+    vm->module->types = types;
+    vm->module->types_len = types_len;
+    vm->globals = globals;
+    vm->module->globals_len = globals_len;
+    vm->memory_len = memory_len;
+    vm->module->imports = imports;
+    vm->module->imports_len = imports_len;
+    vm->module->exports = exports;
+    vm->module->exports_len = exports_len;
+    vm->table = table;
+    vm->module->table_len = table_len;
+
+    // The data section follows the code, so instructions naming a data
+    // segment are checked against the data count section, which the
+    // format requires for them.
+    if (section_starts[Section_data_count] != 0) {
+        i = section_starts[Section_data_count];
+        vm->module->datas_len = read32_uleb128(mod_ptr, &i);
+    } else {
+        vm->module->datas_len = 0;
+    }
+
+    {
+        // Every instruction is at least one byte and decodes to at most one
+        // opcode and three operands per byte, so the code section size
+        // bounds the decoded image.
+        size_t code_len = section_lens[Section_code];
+        size_t operands_cap_offset = align_forward(code_len, 64);
+        size_t image_cap = operands_cap_offset + sizeof(uint32_t) * 3 * code_len;
+        char *image = arena_allocAligned(arena, image_cap, huge_page_size);
+#ifdef MADV_HUGEPAGE
+        madvise(image, image_cap, MADV_HUGEPAGE);
+#endif
+        vm->module->opcodes = (uint8_t *)image;
+        vm->module->operands = (uint32_t *)(image + operands_cap_offset);
+
+        uint32_t code_i = section_starts[Section_code];
+        mi_wait(&input, code_i + 5);
+        uint32_t codes_len = read32_uleb128(mod_ptr, &code_i);
+        if (codes_len != functions_len) panic("code/function length mismatch");
+        uint32_t code_start = code_i;
+        if (getenv("ZIG_WASI_BENCH_LEB")) {
+            uint32_t code_end = section_starts[Section_code] + section_lens[Section_code];
+            mi_wait(&input, code_end);
+            leb_bench(arena, mod_ptr, code_start, code_end);
+            startup_phase("leb128 benchmark", 0, 0, 0, 0);
+        }
+
+        uint32_t decode_threads = one_thread ? 1 : decode_threadCount(functions_len);
+        struct ProgramCounter pc;
+        pc.opcode = 0;
+        pc.operand = 0;
+        size_t operands_offset;
+        vm->module->decoder = NULL;
+        // Decoded functions are reused across module versions, except when
+        // decoding lazily, where most functions are never decoded at all.
+        struct FnCache *fn_cache = NULL;
+        if (cache_dir != -1 && !lazy_decode) fn_cache = fc_open(arena, cache_dir);
+        struct Decoder *decs[max_decode_threads];
+        uint32_t decs_len = 0;
+        if (lazy_decode) {
+            // Only locate the bodies. Each function is decoded on its first
+            // call and appended to the image, which stays writable.
+            vm->module->decoder = arena_alloc(arena, sizeof(struct Decoder));
+            dec_init(vm->module->decoder, vm->module->opcodes, vm->module->operands, NULL, NULL);
+            for (uint32_t func_i = 0; func_i < functions_len; func_i += 1) {
+                struct Function *func = &functions[func_i];
+                mi_wait(&input, code_i + 5);
+                func->code_len = read32_uleb128(mod_ptr, &code_i);
+                func->code_begin = code_i;
+                code_i += func->code_len;
+                func->entry_pc.opcode = undecoded_pc;
+                func->entry_pc.operand = 0;
+            }
+            vm->module->code_end = pc;
+        } else if (decode_threads == 1) {
+            struct Decoder *dec = arena_alloc(arena, sizeof(struct Decoder));
+            // Recording a function for the cache needs its branch targets.
+            uint32_t *relocs = fn_cache != NULL ? arena_alloc(arena, sizeof(uint32_t) * code_len) : NULL;
+            dec_init(dec, vm->module->opcodes, vm->module->operands, relocs, fn_cache);
+            decs[decs_len] = dec;
+            decs_len += 1;
+            for (uint32_t func_i = 0; func_i < functions_len; func_i += 1) {
+                struct Function *func = &functions[func_i];
+                mi_wait(&input, code_i + 5);
+                func->code_len = read32_uleb128(mod_ptr, &code_i);
+                func->code_begin = code_i;
+                code_i += func->code_len;
+                mi_wait(&input, code_i);
+                vm_decodeFunction(vm, dec, func, &pc);
+            }
+            //fprintf(stderr, "%u opcodes\n%u operands\n", pc.opcode, pc.operand);
+
+            // Pack the operands right behind the opcodes.
+            operands_offset = align_forward(pc.opcode, 64);
+            memmove(image + operands_offset, vm->module->operands, sizeof(uint32_t) * pc.operand);
+        } else {
+            // Split the functions into ranges of about equal code size and
+            // start decoding each range as soon as it has been inflated.
+            struct DecodeJob *jobs = arena_alloc(arena, sizeof(struct DecodeJob) * decode_threads);
+            uint32_t jobs_len = 0;
+            uint32_t range_start = 0;
+            for (uint32_t func_i = 0; func_i < functions_len; func_i += 1) {
+                struct Function *func = &functions[func_i];
+                mi_wait(&input, code_i + 5);
+                func->code_len = read32_uleb128(mod_ptr, &code_i);
+                func->code_begin = code_i;
+                code_i += func->code_len;
+                mi_wait(&input, code_i);
+
+                bool last = func_i + 1 == functions_len;
+                if (!last && (jobs_len + 1 == decode_threads ||
+                    (uint64_t)(code_i - code_start) * decode_threads < (uint64_t)(jobs_len + 1) * code_len))
+                    continue;
+
+                // The same bound as for the whole image applies to a range.
+                size_t range_len = code_i - functions[range_start].code_begin;
+                struct DecodeJob *job = &jobs[jobs_len];
+                job->vm = vm;
+                job->functions = &functions[range_start];
+                job->functions_len = func_i + 1 - range_start;
+                job->dec = arena_alloc(arena, sizeof(struct Decoder));
+                dec_init(job->dec,
+                    arena_alloc(arena, range_len),
+                    arena_alloc(arena, sizeof(uint32_t) * 3 * range_len),
+                    arena_alloc(arena, sizeof(uint32_t) * range_len),
+                    fn_cache);
+                decs[decs_len] = job->dec;
+                decs_len += 1;
+                if (pthread_create(&job->thread, NULL, vm_runDecodeJob, job) != 0)
+                    panic("unable to start decode thread");
+                jobs_len += 1;
+                range_start = func_i + 1;
+            }
+
+            for (uint32_t job_i = 0; job_i < jobs_len; job_i += 1) {
+                pthread_join(jobs[job_i].thread, NULL);
+                pc.opcode += jobs[job_i].pc.opcode;
+                pc.operand += jobs[job_i].pc.operand;
+            }
+            //fprintf(stderr, "%u opcodes\n%u operands\n", pc.opcode, pc.operand);
+
+            // Concatenate the ranges and rebase their program counters.
+            operands_offset = align_forward(pc.opcode, 64);
+            vm->module->operands = (uint32_t *)(image + operands_offset);
+            struct ProgramCounter base;
+            base.opcode = 0;
+            base.operand = 0;
+            for (uint32_t job_i = 0; job_i < jobs_len; job_i += 1) {
+                const struct DecodeJob *job = &jobs[job_i];
+                memcpy(vm->module->opcodes + base.opcode, job->dec->opcodes, job->pc.opcode);
+                uint32_t *operands = vm->module->operands + base.operand;
+                memcpy(operands, job->dec->operands, sizeof(uint32_t) * job->pc.operand);
+                for (uint32_t reloc_i = 0; reloc_i < job->dec->relocs_len; reloc_i += 1) {
+                    uint32_t ref = job->dec->relocs[reloc_i];
+                    operands[ref + 0] += base.opcode;
+                    operands[ref + 1] += base.operand;
+                }
+                for (uint32_t func_i = 0; func_i < job->functions_len; func_i += 1) {
+                    job->functions[func_i].entry_pc.opcode += base.opcode;
+                    job->functions[func_i].entry_pc.operand += base.operand;
+                }
+                base.opcode += job->pc.opcode;
+                base.operand += job->pc.operand;
+            }
+        }
+
+        if (fn_cache != NULL) {
+            fc_save(cache_dir, decs, decs_len, functions_len);
+            fc_close(fn_cache);
+        }
+        for (uint32_t dec_i = 0; dec_i < decs_len; dec_i += 1) dec_deinit(decs[dec_i]);
+
+        if (!lazy_decode) {
+            vm->module->code_end = pc;
+            // Give the unused tail of the reservation, including any decoder
+            // buffers, back and make the image read-only.
+            vm->module->operands = (uint32_t *)(image + operands_offset);
+            size_t image_len = align_forward(operands_offset + sizeof(uint32_t) * pc.operand, host_page_size);
+            arena_restore(arena, image + image_len);
+            err_wrap("protecting code image", mprotect(image, image_len, PROT_READ));
+        }
+        startup_phase(lazy_decode ? "locate code" : "decode code", code_len, functions_len,
+            pc.opcode, lazy_decode ? 0 : functions_len);
+    }
+
+    // Initialize memory from the data section.
+    {
+        mi_scanSections(&input, section_starts[Section_code] + section_lens[Section_code],
+            section_starts, section_lens, -1);
+        mi_finish(&input);
+        uint32_t code_end = section_starts[Section_code] + section_lens[Section_code];
+        startup_phase("scan trailing sections", input.len - code_end, 0, 0, 0);
+        if (input.inflate_ns != 0) startup_background("inflate", input.inflate_ns, input.len);
+
+        i = section_starts[Section_data];
+        vm->module->memory_init_len = 0;
+        uint64_t copied_len = 0;
+        uint32_t datas_len = read32_uleb128(mod_ptr, &i);
+        if (section_starts[Section_data_count] != 0 && datas_len != vm->module->datas_len)
+            panic("data count mismatch");
+        vm->module->datas_len = datas_len;
+        vm->datas = arena_alloc(arena, sizeof(struct DataSegment) * vm->module->datas_len);
+        for (uint32_t data_i = 0; data_i < vm->module->datas_len; data_i += 1) {
+            struct DataSegment *data = &vm->datas[data_i];
+            uint32_t mode = read32_uleb128(mod_ptr, &i);
+            bool active;
+            switch (mode) {
+                case 0: active = true; break;
+                case 1: active = false; break;
+                case 2:
+                    if (read32_uleb128(mod_ptr, &i) != 0) panic("unexpected memory index");
+                    active = true;
+                    break;
+                default: panic("unexpected data segment mode");
+            }
+            uint32_t offset = 0;
+            if (active) {
+                enum WasmOp opcode = mod_ptr[i];
+                i += 1;
+                if (opcode != WasmOp_i32_const) panic("expected opcode i32_const");
+                offset = read32_ileb128(mod_ptr, &i);
+                enum WasmOp end = mod_ptr[i];
+                if (end != WasmOp_end) panic("expected end opcode");
+                i += 1;
+            }
+            data->len = read32_uleb128(mod_ptr, &i);
+            data->offset = i;
+            i += data->len;
+            if (active) {
+                memcpy(vm->memory + offset, mod_ptr + data->offset, data->len);
+                copied_len += data->len;
+                if (offset + data->len > vm->module->memory_init_len)
+                    vm->module->memory_init_len = offset + data->len;
+                // Active segments are dropped once they have been applied.
+                data->len = 0;
+            }
+        }
+        startup_phase("data segments", copied_len, vm->module->datas_len, 0, 0);
+    }
+
+    return start_fn_idx;
+}
+
+/// Unmaps the module file or image and the memory and stack vm_setup
+/// mapped. The arena holding the rest is released separately.
+static void vm_release(struct VirtualMachine *vm) {
+    const struct ByteSlice *mapping = &vm->module->mapping;
+    if (mapping->ptr != NULL) munmap(mapping->ptr, mapping->len);
+    munmap(vm->memory, max_memory);
+    munmap(vm->stack, sizeof(uint32_t) * max_stack_len);
+}
+
+/// Opens, creating it if needed, the zig1-cache directory in the CMake
+/// binary dir, which is relative to dir_fd.
+static int open_cache_dir(int dir_fd, const char *cmake_binary_dir_path) {
+    char cache_dir_buf[PATH_MAX * 2];
+    size_t i = 0;
+    size_t cmake_binary_dir_path_len = strlen(cmake_binary_dir_path);
+
+    memcpy(cache_dir_buf + i, cmake_binary_dir_path, cmake_binary_dir_path_len);
+    i += cmake_binary_dir_path_len;
+
+    cache_dir_buf[i] = '/';
+    i += 1;
+
+    memcpy(cache_dir_buf + i, "zig1-cache", strlen("zig1-cache"));
+    i += strlen("zig1-cache");
+
+    cache_dir_buf[i] = 0;
+
+    mkdirat(dir_fd, cache_dir_buf, 0777);
+    return err_wrap("opening cache dir", openat(dir_fd, cache_dir_buf, O_DIRECTORY|O_RDONLY|O_CLOEXEC));
+}
+
+/// Guest command line and host directories for one run of the compiler.
+struct Invocation {
+    const char *argv[30];
+    char argv_buf[PATH_MAX + 1024];
+    int cwd;
+    int cache_dir;
+    int zig_lib_dir;
+    struct FdTable fds;
+};
+
+/// Builds the guest command line from the engine's arguments (zig lib dir,
+/// CMake binary dir, root name, module, then the module's own arguments),
+/// opens the directories relative to dir_fd, which is AT_FDCWD for the
+/// current one, and makes them the preopens. The guest's stdout and stderr
+/// both go to out_fd, or to the process's own when it is -1.
+static void inv_init(struct Invocation *inv, char **argv, int dir_fd, int out_fd) {
+    const char *zig_lib_dir_path = argv[1];
+    const char *cmake_binary_dir_path = argv[2];
+    const char *root_name = argv[3];
+    size_t argv_i = 4;
+
+    size_t cwd_path_len = common_prefix(zig_lib_dir_path, cmake_binary_dir_path);
+    const char *rel_cmake_bin_path = cmake_binary_dir_path + cwd_path_len;
+
+    size_t rel_cmake_bin_path_len = strlen(rel_cmake_bin_path);
+
+    uint32_t new_argv_i = 0;
+    uint32_t new_argv_buf_i = 0;
+
+    inv->cache_dir = open_cache_dir(dir_fd, cmake_binary_dir_path);
+
+    // Construct a new argv for the WASI code which has absolute paths
+    // converted to relative paths, and has the target and terminal status
     // autodetected.
 
     // wasm file path
-    new_argv[new_argv_i] = argv[argv_i];
+    inv->argv[new_argv_i] = argv[argv_i];
     new_argv_i += 1;
     argv_i += 1;
 
     for (; argv[argv_i]; argv_i += 1) {
-        new_argv[new_argv_i] = argv[argv_i];
+        inv->argv[new_argv_i] = argv[argv_i];
         new_argv_i += 1;
     }
 
     {
-        new_argv[new_argv_i] = "--name";
+        inv->argv[new_argv_i] = "--name";
         new_argv_i += 1;
 
-        new_argv[new_argv_i] = root_name;
+        inv->argv[new_argv_i] = root_name;
         new_argv_i += 1;
 
-        char *emit_bin_arg = new_argv_buf + new_argv_buf_i;
-        memcpy(new_argv_buf + new_argv_buf_i, "-femit-bin=", strlen("-femit-bin="));
+        char *emit_bin_arg = inv->argv_buf + new_argv_buf_i;
+        memcpy(inv->argv_buf + new_argv_buf_i, "-femit-bin=", strlen("-femit-bin="));
         new_argv_buf_i += strlen("-femit-bin=");
-        memcpy(new_argv_buf + new_argv_buf_i, rel_cmake_bin_path, rel_cmake_bin_path_len);
+        memcpy(inv->argv_buf + new_argv_buf_i, rel_cmake_bin_path, rel_cmake_bin_path_len);
         new_argv_buf_i += rel_cmake_bin_path_len;
-        new_argv_buf[new_argv_buf_i] = '/';
+        inv->argv_buf[new_argv_buf_i] = '/';
         new_argv_buf_i += 1;
-        memcpy(new_argv_buf + new_argv_buf_i, root_name, strlen(root_name));
+        memcpy(inv->argv_buf + new_argv_buf_i, root_name, strlen(root_name));
         new_argv_buf_i += strlen(root_name);
-        memcpy(new_argv_buf + new_argv_buf_i, ".c", 3);
+        memcpy(inv->argv_buf + new_argv_buf_i, ".c", 3);
         new_argv_buf_i += 3;
 
-        new_argv[new_argv_i] = emit_bin_arg;
-        new_argv_i += 1;
+        inv->argv[new_argv_i] = emit_bin_arg;
+        new_argv_i += 1;
+    }
+
+    {
+        inv->argv[new_argv_i] = "--pkg-begin";
+        new_argv_i += 1;
+
+        inv->argv[new_argv_i] = "build_options";
+        new_argv_i += 1;
+
+        char *build_options_path = inv->argv_buf + new_argv_buf_i;
+        memcpy(inv->argv_buf + new_argv_buf_i, rel_cmake_bin_path, rel_cmake_bin_path_len);
+        new_argv_buf_i += rel_cmake_bin_path_len;
+        inv->argv_buf[new_argv_buf_i] = '/';
+        new_argv_buf_i += 1;
+        memcpy(inv->argv_buf + new_argv_buf_i, "config.zig", strlen("config.zig"));
+        new_argv_buf_i += strlen("config.zig");
+        inv->argv_buf[new_argv_buf_i] = 0;
+        new_argv_buf_i += 1;
+
+        inv->argv[new_argv_i] = build_options_path;
+        new_argv_i += 1;
+
+        inv->argv[new_argv_i] = "--pkg-end";
+        new_argv_i += 1;
+    }
+
+    {
+        inv->argv[new_argv_i] = "-target";
+        new_argv_i += 1;
+
+        inv->argv[new_argv_i] = ZIG_TRIPLE_ARCH "-" ZIG_TRIPLE_OS;
+        new_argv_i += 1;
+    }
+
+    int stdout_fd = out_fd != -1 ? out_fd : STDOUT_FILENO;
+    int stderr_fd = out_fd != -1 ? out_fd : STDERR_FILENO;
+    if (isatty(stderr_fd) != 0) {
+        inv->argv[new_argv_i] = "--color";
+        new_argv_i += 1;
+
+        inv->argv[new_argv_i] = "on";
+        new_argv_i += 1;
+    }
+
+    inv->argv[new_argv_i] = NULL;
+
+    inv->cwd = err_wrap("opening cwd", openat(dir_fd, ".", O_DIRECTORY|O_RDONLY|O_CLOEXEC));
+    inv->zig_lib_dir = err_wrap("opening zig lib dir",
+        openat(dir_fd, zig_lib_dir_path, O_DIRECTORY|O_RDONLY|O_CLOEXEC));
+
+    memset(&inv->fds, 0, sizeof(inv->fds));
+    add_preopen(&inv->fds, 0, "stdin", STDIN_FILENO);
+    add_preopen(&inv->fds, 1, "stdout", stdout_fd);
+    add_preopen(&inv->fds, 2, "stderr", stderr_fd);
+    add_preopen(&inv->fds, 3, ".", inv->cwd);
+    add_preopen(&inv->fds, 4, "/cache", inv->cache_dir);
+    add_preopen(&inv->fds, 5, "/lib", inv->zig_lib_dir);
+}
+
+/// Makes vm run the invocation.
+static void inv_bind(struct Invocation *inv, struct VirtualMachine *vm) {
+    vm->args = inv->argv;
+    vm->fds = inv->fds;
+}
+
+/// Closes the directories inv_init opened, for processes that outlive the
+/// invocation.
+static void inv_deinit(struct Invocation *inv) {
+    close(inv->cwd);
+    close(inv->cache_dir);
+    close(inv->zig_lib_dir);
+}
+
+#define max_fork_request_len (64 * 1024)
+#define max_fork_request_args 16
+
+/// Sent on the control fd when a request's child has started and again
+/// when it has exited, or once, with pid 0, for a request that was
+/// rejected.
+struct ForkReply {
+    uint32_t pid;
+    /// fork_event_started, fork_event_exited or fork_event_rejected.
+    uint32_t event;
+    /// Exit code, or 128 plus the signal number that ended the child.
+    int32_t status;
+};
+
+enum {
+    fork_event_started,
+    fork_event_exited,
+    /// The request was too large, not NUL terminated or could not be
+    /// forked; no child runs it.
+    fork_event_rejected,
+};
+
+/// Servers wait for requests and for children with a single poll; the
+/// SIGCHLD handler makes the read end of this pipe readable.
+static int sigchld_pipe[2];
+
+static void on_sigchld(int sig) {
+    (void)sig;
+    int saved_errno = errno;
+    ssize_t rc = write(sigchld_pipe[1], "", 1);
+    (void)rc;
+    errno = saved_errno;
+}
+
+static void sigchld_init(void) {
+    err_wrap("creating SIGCHLD pipe", pipe(sigchld_pipe));
+    for (int i = 0; i < 2; i += 1) {
+        fcntl(sigchld_pipe[i], F_SETFD, FD_CLOEXEC);
+        fcntl(sigchld_pipe[i], F_SETFL, O_NONBLOCK);
+    }
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = on_sigchld;
+    action.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigemptyset(&action.sa_mask);
+    err_wrap("installing SIGCHLD handler", sigaction(SIGCHLD, &action, NULL));
+}
+
+/// Drains the SIGCHLD pipe and returns the next finished child, or -1.
+static pid_t sigchld_reap(int *exit_status) {
+    char drain[64];
+    while (read(sigchld_pipe[0], drain, sizeof(drain)) > 0) {}
+    int status;
+    pid_t pid = waitpid(-1, &status, WNOHANG);
+    if (pid <= 0) return -1;
+    *exit_status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    return pid;
+}
+
+static void sigchld_deinit(void) {
+    close(sigchld_pipe[0]);
+    close(sigchld_pipe[1]);
+    signal(SIGCHLD, SIG_DFL);
+}
+
+/// Runs one request in a forked child. The request is an argv for the
+/// engine, each string NUL terminated, with the working directory in
+/// place of the program name; its module is ignored in favor of the
+/// loaded one.
+static void fs_runChild(struct VirtualMachine *vm, struct Invocation *server_inv,
+    char *request, uint32_t request_len, int control_fd)
+{
+    close(control_fd);
+    sigchld_deinit();
+    inv_deinit(server_inv);
+
+    char *args[max_fork_request_args + 2];
+    uint32_t args_len = 0;
+    for (uint32_t i = 0; i < request_len; i += strlen(request + i) + 1) {
+        if (args_len == max_fork_request_args + 1) panic("too many arguments in fork request");
+        args[args_len++] = request + i;
+    }
+    args[args_len] = NULL;
+    if (args_len < 5) panic("malformed fork request");
+    if (chdir(args[0]) == -1) {
+        perror("changing to request directory");
+        exit(1);
+    }
+
+    struct Invocation inv;
+    inv_init(&inv, args, AT_FDCWD, -1);
+    inv_bind(&inv, vm);
+    vm_run(vm);
+    exit(0);
+}
+
+/// Reads and discards len bytes of a request too large for buf, which
+/// holds max_fork_request_len bytes. Returns false at end of file.
+static bool fs_skip(int control_fd, char *buf, uint32_t len) {
+    while (len > 0) {
+        uint32_t chunk_len = min_u32(len, max_fork_request_len);
+        if (!read_all(control_fd, buf, chunk_len)) return false;
+        len -= chunk_len;
+    }
+    return true;
+}
+
+/// Answers a request that gets no child.
+static void fs_reject(int control_fd, const char *reason) {
+    fprintf(stderr, "zig-wasi fork server: %s\n", reason);
+    struct ForkReply reply;
+    reply.pid = 0;
+    reply.event = fork_event_rejected;
+    reply.status = 1;
+    write_all(control_fd, &reply, sizeof(reply));
+}
+
+/// ZIG_WASI_FORK_SERVER=<fd>: instead of running, serves requests read
+/// from fd, which must be readable and writable (one end of a socket
+/// pair). A request is a little-endian u32 length and that many bytes, as
+/// described at fs_runChild. Every request runs in a child forked from the
+/// loaded VM, so the decoded code and initial memory are shared copy-on-
+/// write; children inherit the server's standard streams. Each child gets
+/// two ForkReply messages and a bad request one. The server exits once fd
+/// reaches end of file and its children have finished.
+static void fs_serve(struct VirtualMachine *vm, struct Invocation *inv, int control_fd) {
+    sigchld_init();
+
+    char *request = malloc(max_fork_request_len + 1);
+    if (request == NULL) panic("out of memory");
+    struct pollfd fds[2];
+    fds[0].fd = control_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = sigchld_pipe[0];
+    fds[1].events = POLLIN;
+    uint32_t running = 0;
+    while (fds[0].fd != -1 || running > 0) {
+        if (poll(fds, 2, -1) == -1) {
+            if (errno == EINTR) continue;
+            err_wrap("waiting for fork requests", -1);
+        }
+
+        if (fds[1].revents & POLLIN) {
+            int status;
+            pid_t pid;
+            while ((pid = sigchld_reap(&status)) != -1) {
+                struct ForkReply reply;
+                reply.pid = pid;
+                reply.event = fork_event_exited;
+                reply.status = status;
+                write_all(control_fd, &reply, sizeof(reply));
+                running -= 1;
+            }
+        }
+
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            uint32_t request_len;
+            if (!read_all(control_fd, &request_len, sizeof(request_len))) {
+                fds[0].fd = -1;
+                continue;
+            }
+            if (request_len > max_fork_request_len) {
+                // Skip it to stay in step with the stream.
+                if (!fs_skip(control_fd, request, request_len)) {
+                    fds[0].fd = -1;
+                    continue;
+                }
+                fs_reject(control_fd, "fork request too large");
+                continue;
+            }
+            if (!read_all(control_fd, request, request_len)) {
+                // Cut short by end of file, which ends the stream.
+                fds[0].fd = -1;
+                continue;
+            }
+            request[request_len] = 0;
+            if (request_len == 0 || request[request_len - 1] != 0) {
+                fs_reject(control_fd, "malformed fork request");
+                continue;
+            }
+
+            pid_t pid = fork();
+            if (pid == -1) {
+                fs_reject(control_fd, "unable to fork");
+                continue;
+            }
+            if (pid == 0) fs_runChild(vm, inv, request, request_len, control_fd);
+            running += 1;
+            struct ForkReply reply;
+            reply.pid = pid;
+            reply.event = fork_event_started;
+            reply.status = 0;
+            write_all(control_fd, &reply, sizeof(reply));
+        }
+    }
+    exit(0);
+}
+
+/// Reserves the VM's memory and stack and loads the module into it, from
+/// the image cache when possible, leaving the VM ready to run _start or to
+/// resume from a snapshot. cache_dir may be -1. For the library, which
+/// passes its module options, the VM is left before _start and there are
+/// no snapshots.
+static void vm_setup(struct VirtualMachine *vm, struct Arena *arena,
+    struct ByteSlice module_file, int cache_dir, const struct zw_module_options *library)
+{
+#ifndef NDEBUG
+    memset(vm, 0xaa, sizeof(struct VirtualMachine)); // to match the zig version
+#endif
+    // Callers that catch a panic through panic_jmp unmap memory and stack
+    // only once they are no longer MAP_FAILED.
+    vm->memory = MAP_FAILED;
+    vm->stack = MAP_FAILED;
+    vm->module = arena_alloc(arena, sizeof(struct Module));
+    vm->module->extra_hosts = library != NULL ? library->hosts : NULL;
+    vm->module->extra_hosts_len = library != NULL ? library->hosts_len : 0;
+    vm->memory_limit = max_memory;
+    vm->env = NULL;
+    memset(&vm->fds, 0, sizeof(vm->fds));
+    vm->memory = mmap(NULL, max_memory, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+    if (vm->memory == MAP_FAILED) panic("unable to reserve memory");
+    vm->stack = mmap(NULL, sizeof(uint32_t) * max_stack_len, PROT_NONE,
+        MAP_PRIVATE | MAP_ANON | MAP_NORESERVE, -1, 0);
+    if (vm->stack == MAP_FAILED) panic("unable to reserve stack");
+    vm->stack_len = 0;
+    vm_growStack(vm, initial_stack_len);
+    vm->stack_top = 0;
+    vm->memory_file_len = 0;
+    vm->exit_jmp = NULL;
+    startup_phase("runtime setup", 0, 0, 0, 0);
+
+    // ZIG_WASI_LAZY_DECODE decodes each function on its first call. That
+    // writes to the shared module, so library modules, whose instances may
+    // run on several threads, are always decoded up front.
+    bool lazy_decode = library == NULL && getenv("ZIG_WASI_LAZY_DECODE") != NULL;
+    // Decoded images are cached next to the WASI cache; lazily decoded
+    // modules are incomplete and never cached. Registered host functions
+    // are resolved anew by every process, so modules using them are not
+    // cached either.
+    bool use_image_cache = cache_dir != -1 && !lazy_decode &&
+        getenv("ZIG_WASI_NO_IMAGE_CACHE") == NULL && vm->module->extra_hosts_len == 0;
+    // ZIG_WASI_SNAPSHOT skips the guest's startup code by resuming from the
+    // state an earlier run saved at its first invocation-dependent host
+    // call. Lazily decoded code is laid out in call order, so program
+    // counters would not carry over.
+    bool use_snapshot = library == NULL && cache_dir != -1 &&
+        getenv("ZIG_WASI_SNAPSHOT") != NULL && !lazy_decode;
+    // ZIG_WASI_SNAPSHOT_LAZY pages memory in from the snapshot on first
+    // access. Forked children do not inherit the userfaultfd registration,
+    // so the fork server and daemon always restore eagerly.
+    bool lazy_restore = getenv("ZIG_WASI_SNAPSHOT_LAZY") != NULL &&
+        getenv("ZIG_WASI_FORK_SERVER") == NULL && getenv("ZIG_WASI_DAEMON_LISTEN") == NULL;
+    uint64_t key = use_image_cache || use_snapshot ? image_key(module_file) : 0;
+    if (use_image_cache || use_snapshot) startup_phase("hash module", module_file.len, 0, 0, 0);
+    uint32_t start_fn_idx;
+    if (use_image_cache && image_load(vm, arena, cache_dir, key, &start_fn_idx)) {
+        munmap(module_file.ptr, module_file.len);
+        startup_phase("load cached image", vm->module->memory_init_len, vm->module->functions_len, vm->module->code_end.opcode, 0);
+    } else {
+        start_fn_idx = vm_load(vm, arena, module_file, use_image_cache ? cache_dir : -1, lazy_decode,
+            panic_jmp != NULL);
+        if (use_image_cache) {
+            // Switch to the image just written so that this process shares
+            // its pages with concurrent runs, and drop the private copy.
+            char *image = (char *)vm->module->opcodes;
+            size_t image_len = align_forward(
+                (char *)(vm->module->operands + vm->module->code_end.operand) - image, host_page_size);
+            struct ByteSlice module_mapping = vm->module->mapping;
+            if (image_save(vm, cache_dir, key, start_fn_idx) &&
+                image_load(vm, arena, cache_dir, key, &start_fn_idx))
+            {
+                madvise(image, image_len, MADV_DONTNEED);
+                if (module_mapping.ptr != NULL) munmap(module_mapping.ptr, module_mapping.len);
+            }
+            startup_phase("save image", 0, 0, 0, 0);
+        }
+    }
+
+    vm->snapshot_dir = -1;
+    if (library != NULL) return;
+    if (start_fn_idx == UINT32_MAX) panic("_start symbol not found");
+    // Returning from _start ends the run like proc_exit(0).
+    vm->pc.opcode = host_return_pc;
+    vm->pc.operand = 0;
+    if (use_snapshot && snap_restore(vm, cache_dir, key, lazy_restore)) {
+        startup_phase("restore snapshot", vm->memory_len, 0, 0, 0);
+    } else {
+        if (use_snapshot) {
+            vm->snapshot_dir = cache_dir;
+            vm->snapshot_key = key;
+        }
+        vm_call(vm, &vm->module->functions[start_fn_idx - vm->module->imports_len]);
+    }
+}
+
+/// Memory every instance of a module starts from: a sparse memfd that
+/// instances map privately where there is one, else a plain copy.
+struct InitialMemory {
+    uint32_t len;
+    int fd;
+    char *copy;
+};
+
+/// A VM with its own memory, stack, globals, table and fds that runs a
+/// shared module repeatedly, every run starting from the state vm_setup
+/// left the module's first VM in. Instances on different threads may run
+/// at the same time.
+struct Instance {
+    struct VirtualMachine vm;
+    const struct InitialMemory *init;
+    uint64_t *globals;
+    uint32_t *table;
+    uint32_t *data_lens;
+    uint32_t *stack;
+    uint32_t stack_top;
+    struct ProgramCounter pc;
+};
+
+static void inst_captureMemory(struct InitialMemory *init, const struct VirtualMachine *vm,
+    struct Arena *arena)
+{
+    init->len = vm->memory_len;
+    init->fd = -1;
+    init->copy = NULL;
+#ifdef __linux__
+    int fd = init->len != 0 ? memfd_create("zig-wasi-memory", MFD_CLOEXEC) : -1;
+    bool ok = fd != -1 && ftruncate(fd, init->len) == 0;
+    // Zero pages stay holes in the file.
+    for (size_t offset = 0; ok && offset < init->len; offset += snapshot_page_size) {
+        if (snap_pageIsZero(vm->memory + offset)) continue;
+        ok = pwrite(fd, vm->memory + offset, snapshot_page_size, offset) == snapshot_page_size;
+    }
+    if (ok) {
+        init->fd = fd;
+        return;
+    }
+    if (fd != -1) close(fd);
+#endif
+    init->copy = arena_alloc(arena, init->len);
+    memcpy(init->copy, vm->memory, init->len);
+}
+
+static void inst_init(struct Instance *inst, const struct VirtualMachine *vm,
+    const struct InitialMemory *init, struct Arena *arena)
+{
+    const struct Module *module = vm->module;
+    struct VirtualMachine *inst_vm = &inst->vm;
+    *inst_vm = *vm;
+    inst->init = init;
+
+    inst_vm->memory = mmap(NULL, max_memory, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+    if (inst_vm->memory == MAP_FAILED) panic("unable to reserve memory");
+    inst_vm->memory_file_len = 0;
+    if (init->fd != -1) {
+        // Discarding a page of this mapping brings back its initial contents.
+        if (mmap(inst_vm->memory, init->len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+                init->fd, 0) == MAP_FAILED)
+            panic("unable to map initial memory");
+        inst_vm->memory_file_len = init->len;
+    } else {
+        memcpy(inst_vm->memory, init->copy, init->len);
+    }
+    inst_vm->stack = mmap(NULL, sizeof(uint32_t) * max_stack_len, PROT_NONE,
+        MAP_PRIVATE | MAP_ANON | MAP_NORESERVE, -1, 0);
+    if (inst_vm->stack == MAP_FAILED) panic("unable to reserve stack");
+    inst_vm->stack_len = 0;
+    vm_growStack(inst_vm, vm->stack_len);
+    memcpy(inst_vm->stack, vm->stack, sizeof(uint32_t) * vm->stack_top);
+
+    inst_vm->globals = arena_alloc(arena, sizeof(uint64_t) * module->globals_len);
+    memcpy(inst_vm->globals, vm->globals, sizeof(uint64_t) * module->globals_len);
+    inst_vm->table = arena_alloc(arena, sizeof(uint32_t) * module->table_len);
+    memcpy(inst_vm->table, vm->table, sizeof(uint32_t) * module->table_len);
+    inst_vm->datas = arena_alloc(arena, sizeof(struct DataSegment) * module->datas_len);
+    memcpy(inst_vm->datas, vm->datas, sizeof(struct DataSegment) * module->datas_len);
+    memset(inst_vm->fds.guest_fds, 0, sizeof(inst_vm->fds.guest_fds));
+
+    inst->globals = arena_alloc(arena, sizeof(uint64_t) * module->globals_len);
+    memcpy(inst->globals, vm->globals, sizeof(uint64_t) * module->globals_len);
+    inst->table = arena_alloc(arena, sizeof(uint32_t) * module->table_len);
+    memcpy(inst->table, vm->table, sizeof(uint32_t) * module->table_len);
+    inst->data_lens = arena_alloc(arena, sizeof(uint32_t) * module->datas_len);
+    for (uint32_t data_i = 0; data_i < module->datas_len; data_i += 1)
+        inst->data_lens[data_i] = vm->datas[data_i].len;
+    inst->stack = arena_alloc(arena, sizeof(uint32_t) * vm->stack_top);
+    memcpy(inst->stack, vm->stack, sizeof(uint32_t) * vm->stack_top);
+    inst->stack_top = vm->stack_top;
+    inst->pc = vm->pc;
+}
+
+/// Runs _start, or resumes the snapshot, until proc_exit and returns the
+/// exit code. The instance must be reset before it runs again.
+static int inst_run(struct Instance *inst, const char **args) {
+    jmp_buf exit_jmp;
+    inst->vm.args = args;
+    inst->vm.exit_code = 0;
+    inst->vm.exit_jmp = &exit_jmp;
+    if (setjmp(exit_jmp) == 0) vm_run(&inst->vm);
+    inst->vm.exit_jmp = NULL;
+    return inst->vm.exit_code;
+}
+
+/// Runs vm to the end while recording a memo, saves it to dir_fd and
+/// returns the exit code.
+static int memo_run(struct VirtualMachine *vm, int dir_fd, uint64_t key) {
+    jmp_buf exit_jmp;
+    vm->exit_code = 0;
+    vm->exit_jmp = &exit_jmp;
+    memo.recording = true;
+    if (setjmp(exit_jmp) == 0) vm_run(vm);
+    vm->exit_jmp = NULL;
+    memo_save(&vm->fds, dir_fd, key, vm->exit_code);
+    return vm->exit_code;
+}
+
+/// Returns the instance to its state before the first run. Only memory
+/// the run touched costs anything to restore when there is a memfd.
+static void inst_reset(struct Instance *inst) {
+    struct VirtualMachine *vm = &inst->vm;
+    const struct Module *module = vm->module;
+    if (vm->memory_file_len != 0) {
+        // Private copies of initial pages revert to the file and pages
+        // past it to zero; the kernel skips page tables that were never
+        // populated.
+        err_wrap("resetting memory", madvise(vm->memory, vm->memory_len, MADV_DONTNEED));
+    } else {
+        memcpy(vm->memory, inst->init->copy, inst->init->len);
+        memset(vm->memory + inst->init->len, 0, vm->memory_len - inst->init->len);
+    }
+    vm->memory_len = inst->init->len;
+    memcpy(vm->globals, inst->globals, sizeof(uint64_t) * module->globals_len);
+    memcpy(vm->table, inst->table, sizeof(uint32_t) * module->table_len);
+    for (uint32_t data_i = 0; data_i < module->datas_len; data_i += 1)
+        vm->datas[data_i].len = inst->data_lens[data_i];
+    memcpy(vm->stack, inst->stack, sizeof(uint32_t) * inst->stack_top);
+    vm->stack_top = inst->stack_top;
+    vm->pc = inst->pc;
+    for (int fd = 0; fd < max_tracked_fds; fd += 1) {
+        if ((vm->fds.guest_fds[fd / 8] & (1 << (fd % 8))) != 0) close(fd);
+    }
+    memset(vm->fds.guest_fds, 0, sizeof(vm->fds.guest_fds));
+}
+
+/// One of the threads started by inst_runThreads.
+struct InstanceThread {
+    struct Instance inst;
+    pthread_t thread;
+    const char **args;
+    int runs;
+    int exit_code;
+};
+
+static void *inst_threadMain(void *arg) {
+    struct InstanceThread *it = arg;
+    for (int run_i = 0; run_i < it->runs; run_i += 1) {
+        if (run_i != 0) inst_reset(&it->inst);
+        it->exit_code = inst_run(&it->inst, it->args);
+    }
+    return NULL;
+}
+
+/// Runs the module runs times on each of threads_len threads at once, each
+/// thread with its own instance, and returns the first nonzero exit code
+/// of the threads' last runs.
+static int inst_runThreads(const struct VirtualMachine *vm, struct Arena *arena,
+    const char **args, int threads_len, int runs)
+{
+    struct InitialMemory init;
+    inst_captureMemory(&init, vm, arena);
+    struct InstanceThread *threads = arena_alloc(arena, sizeof(struct InstanceThread) * threads_len);
+    for (int thread_i = 0; thread_i < threads_len; thread_i += 1) {
+        struct InstanceThread *it = &threads[thread_i];
+        inst_init(&it->inst, vm, &init, arena);
+        // Only one instance may save the pending snapshot.
+        if (thread_i != 0) it->inst.vm.snapshot_dir = -1;
+        it->args = args;
+        it->runs = runs;
+        it->exit_code = 0;
+    }
+    // The first thread is this one.
+    for (int thread_i = 1; thread_i < threads_len; thread_i += 1) {
+        if (pthread_create(&threads[thread_i].thread, NULL, inst_threadMain, &threads[thread_i]) != 0)
+            panic("unable to start instance thread");
+    }
+    inst_threadMain(&threads[0]);
+    int exit_code = threads[0].exit_code;
+    for (int thread_i = 1; thread_i < threads_len; thread_i += 1) {
+        pthread_join(threads[thread_i].thread, NULL);
+        if (exit_code == 0) exit_code = threads[thread_i].exit_code;
+    }
+    return exit_code;
+}
+
+/// One line of a batch manifest, split at tabs: the file the run's stdout
+/// and stderr go to, relative to its working directory, or "-" to keep the
+/// batch's own; then the run's working directory; then the engine's
+/// arguments after the program name, as for a fork request. The module
+/// argument is only the guest's argv[0]: every run executes the module the
+/// batch loaded.
+struct BatchRun {
+    const char *output;
+    char *args[max_fork_request_args + 2];
+    /// Why the run failed without running the module, or NULL.
+    const char *error;
+};
+
+/// State shared by the threads of a batch.
+struct Batch {
+    struct BatchRun *runs;
+    uint32_t runs_len;
+    /// Index of the next run a thread takes.
+    uint32_t next_run;
+    /// Serializes the report lines.
+    pthread_mutex_t report_lock;
+    /// Whether any run failed.
+    bool failed;
+};
+
+/// One of the threads started by batch_runAll.
+struct BatchThread {
+    struct Instance inst;
+    pthread_t thread;
+    struct Batch *batch;
+};
+
+/// Splits the manifest in place, skipping empty lines and lines starting
+/// with '#'. runs has room for every line. A malformed line still becomes
+/// a run, which fails with its error set.
+static uint32_t batch_parse(char *manifest, struct BatchRun *runs) {
+    uint32_t runs_len = 0;
+    char *line = manifest;
+    while (*line != 0) {
+        char *line_end = strchr(line, '\n');
+        if (line_end != NULL) *line_end = 0;
+        if (*line != 0 && *line != '#') {
+            struct BatchRun *run = &runs[runs_len];
+            uint32_t args_len = 0;
+            char *field = line;
+            run->output = field;
+            run->error = NULL;
+            while ((field = strchr(field, '\t')) != NULL) {
+                *field = 0;
+                field += 1;
+                if (args_len == max_fork_request_args + 1) {
+                    run->error = "too many arguments in batch manifest line";
+                    break;
+                }
+                run->args[args_len++] = field;
+            }
+            run->args[args_len] = NULL;
+            if (run->error == NULL && args_len < 5) run->error = "malformed batch manifest line";
+            runs_len += 1;
+        }
+        if (line_end == NULL) break;
+        line = line_end + 1;
+    }
+    return runs_len;
+}
+
+/// Runs one manifest line on inst and returns its exit code, or -1 with
+/// run->error set if the line is malformed or its working directory,
+/// output, zig lib dir or cache dir cannot be opened.
+static int batch_runOne(struct Instance *inst, struct BatchRun *run) {
+    if (run->error != NULL) return -1;
+    int dir_fd = open(run->args[0], O_DIRECTORY|O_RDONLY|O_CLOEXEC);
+    if (dir_fd == -1) {
+        run->error = "unable to open working directory";
+        return -1;
+    }
+    int out_fd = -1;
+    if (strcmp(run->output, "-") != 0) {
+        out_fd = openat(dir_fd, run->output, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0666);
+        if (out_fd == -1) {
+            run->error = "unable to open output";
+            close(dir_fd);
+            return -1;
+        }
+    }
+
+    // One run's missing directory must not end the whole batch.
+    struct Invocation inv;
+    inv.cache_dir = -1;
+    inv.cwd = -1;
+    inv.zig_lib_dir = -1;
+    jmp_buf open_jmp;
+    panic_jmp = &open_jmp;
+    if (setjmp(open_jmp) != 0) {
+        panic_jmp = NULL;
+        run->error = panic_msg;
+        if (inv.cache_dir != -1) close(inv.cache_dir);
+        if (inv.cwd != -1) close(inv.cwd);
+        if (out_fd != -1) close(out_fd);
+        close(dir_fd);
+        return -1;
+    }
+    inv_init(&inv, run->args, dir_fd, out_fd);
+    panic_jmp = NULL;
+    inv_bind(&inv, &inst->vm);
+    int exit_code = inst_run(inst, inv.argv);
+    inst_reset(inst);
+    inv_deinit(&inv);
+
+    if (out_fd != -1) close(out_fd);
+    close(dir_fd);
+    return exit_code;
+}
+
+static void *batch_threadMain(void *arg) {
+    struct BatchThread *bt = arg;
+    struct Batch *batch = bt->batch;
+    for (;;) {
+        uint32_t run_i = __atomic_fetch_add(&batch->next_run, 1, __ATOMIC_RELAXED);
+        if (run_i >= batch->runs_len) break;
+        uint64_t start_ns = monotonic_ns();
+        int exit_code = batch_runOne(&bt->inst, &batch->runs[run_i]);
+        uint64_t elapsed_ns = monotonic_ns() - start_ns;
+
+        pthread_mutex_lock(&batch->report_lock);
+        if (exit_code != 0) batch->failed = true;
+        const char *error = batch->runs[run_i].error;
+        if (error != NULL) fprintf(stderr, "zig-wasi batch: run %" PRIu32 ": %s\n", run_i, error);
+        fprintf(stderr, "{\"run\":%" PRIu32 ",\"exit\":%d,\"ms\":%.3f}\n",
+            run_i, exit_code, elapsed_ns / 1e6);
+        pthread_mutex_unlock(&batch->report_lock);
+    }
+    return NULL;
+}
+
+/// ZIG_WASI_BATCH=<manifest>: runs every line of the manifest, described
+/// at BatchRun, against the loaded module on jobs_len threads, each with
+/// an instance that is reset between runs. Prints one JSON line per run
+/// to stderr, in order of completion, and returns 1 if any run failed.
+static int batch_runAll(const struct VirtualMachine *vm, struct Arena *arena,
+    const char *manifest_path, int jobs_len)
+{
+    struct Batch batch;
+    const struct ByteSlice manifest_file = map_file(manifest_path);
+    char *manifest = arena_alloc(arena, manifest_file.len + 1);
+    memcpy(manifest, manifest_file.ptr, manifest_file.len);
+    manifest[manifest_file.len] = 0;
+    munmap(manifest_file.ptr, manifest_file.len);
+    size_t lines_len = 1;
+    for (size_t i = 0; i < manifest_file.len; i += 1) lines_len += manifest[i] == '\n';
+    batch.runs = arena_alloc(arena, sizeof(struct BatchRun) * lines_len);
+    batch.runs_len = batch_parse(manifest, batch.runs);
+    batch.next_run = 0;
+    pthread_mutex_init(&batch.report_lock, NULL);
+    batch.failed = false;
+
+    struct InitialMemory init;
+    inst_captureMemory(&init, vm, arena);
+    struct BatchThread *threads = arena_alloc(arena, sizeof(struct BatchThread) * jobs_len);
+    for (int thread_i = 0; thread_i < jobs_len; thread_i += 1) {
+        inst_init(&threads[thread_i].inst, vm, &init, arena);
+        // Only one instance may save the pending snapshot.
+        if (thread_i != 0) threads[thread_i].inst.vm.snapshot_dir = -1;
+        threads[thread_i].batch = &batch;
+    }
+    // The first thread is this one.
+    for (int thread_i = 1; thread_i < jobs_len; thread_i += 1) {
+        if (pthread_create(&threads[thread_i].thread, NULL, batch_threadMain, &threads[thread_i]) != 0)
+            panic("unable to start batch thread");
     }
+    batch_threadMain(&threads[0]);
+    for (int thread_i = 1; thread_i < jobs_len; thread_i += 1)
+        pthread_join(threads[thread_i].thread, NULL);
+    return batch.failed ? 1 : 0;
+}
 
-    {
-        new_argv[new_argv_i] = "--pkg-begin";
-        new_argv_i += 1;
+#define max_daemon_modules 16
+#define max_daemon_jobs 256
+/// The client's stdin, stdout, stderr and working directory.
+#define daemon_request_fds 4
+/// How long a client may take to send its request once connected.
+#define daemon_request_timeout_ms 1000
+/// Reply telling the client to run the module itself, because the daemon
+/// could not load it.
+#define daemon_declined INT32_MIN
+
+/// A module the daemon has loaded and keeps ready to be forked into
+/// instances.
+struct DaemonModule {
+    bool loaded;
+    uint64_t key;
+    /// Request count when the module was last used, to evict the least
+    /// recently used one when all slots are taken.
+    uint64_t last_used;
+    struct Arena arena;
+    struct VirtualMachine vm;
+};
 
-        new_argv[new_argv_i] = "build_options";
-        new_argv_i += 1;
+/// A running instance and the client connection waiting for its status.
+struct DaemonJob {
+    pid_t pid;
+    int conn;
+    struct DaemonModule *module;
+};
 
-        char *build_options_path = new_argv_buf + new_argv_buf_i;
-        memcpy(new_argv_buf + new_argv_buf_i, rel_cmake_bin_path, rel_cmake_bin_path_len);
-        new_argv_buf_i += rel_cmake_bin_path_len;
-        new_argv_buf[new_argv_buf_i] = '/';
-        new_argv_buf_i += 1;
-        memcpy(new_argv_buf + new_argv_buf_i, "config.zig", strlen("config.zig"));
-        new_argv_buf_i += strlen("config.zig");
-        new_argv_buf[new_argv_buf_i] = 0;
-        new_argv_buf_i += 1;
+static struct DaemonModule dm_modules[max_daemon_modules];
+static uint64_t dm_requests;
+static struct DaemonJob dm_jobs[max_daemon_jobs];
+static uint32_t dm_jobs_len;
+static char dm_request[max_fork_request_len + 1];
+
+/// Receives a request: a little-endian u32 length and that many bytes of
+/// NUL terminated engine arguments, without the program name. The length
+/// carries the daemon_request_fds descriptors as SCM_RIGHTS.
+static bool dm_recvRequest(int conn, uint32_t *request_len, int *fds) {
+    uint32_t len;
+    struct iovec iov;
+    iov.iov_base = &len;
+    iov.iov_len = sizeof(len);
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int) * daemon_request_fds)];
+    } control;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    ssize_t n;
+    do n = recvmsg(conn, &msg, 0); while (n == -1 && errno == EINTR);
+    if (n <= 0) return false;
+
+    int fds_len = 0;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+        int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (int i = 0; i < count; i += 1) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(cmsg) + sizeof(int) * i, sizeof(int));
+            if (fds_len < daemon_request_fds) fds[fds_len++] = fd; else close(fd);
+        }
+    }
+    bool ok = fds_len == daemon_request_fds && (msg.msg_flags & MSG_CTRUNC) == 0 &&
+        read_all(conn, (char *)&len + n, sizeof(len) - n) &&
+        len != 0 && len <= max_fork_request_len && read_all(conn, dm_request, len) &&
+        dm_request[len - 1] == 0;
+    if (!ok) {
+        for (int i = 0; i < fds_len; i += 1) close(fds[i]);
+        return false;
+    }
+    *request_len = len;
+    return true;
+}
 
-        new_argv[new_argv_i] = build_options_path;
-        new_argv_i += 1;
+static bool dm_moduleBusy(const struct DaemonModule *module) {
+    for (uint32_t job_i = 0; job_i < dm_jobs_len; job_i += 1) {
+        if (dm_jobs[job_i].module == module) return true;
+    }
+    return false;
+}
 
-        new_argv[new_argv_i] = "--pkg-end";
-        new_argv_i += 1;
+/// Picks a slot for a new module: a free one, or else the least recently
+/// used module without running instances, which is unloaded. Returns NULL
+/// if every module is busy.
+static struct DaemonModule *dm_freeSlot(void) {
+    struct DaemonModule *victim = NULL;
+    for (uint32_t module_i = 0; module_i < max_daemon_modules; module_i += 1) {
+        struct DaemonModule *module = &dm_modules[module_i];
+        if (!module->loaded) return module;
+        if (!dm_moduleBusy(module) && (victim == NULL || module->last_used < victim->last_used))
+            victim = module;
     }
+    if (victim != NULL) {
+        vm_release(&victim->vm);
+        arena_release(&victim->arena);
+        victim->loaded = false;
+    }
+    return victim;
+}
 
-    {
-        new_argv[new_argv_i] = "-target";
-        new_argv_i += 1;
+/// Returns the loaded module for path, loading it on first use, or NULL
+/// if it cannot be read, is malformed or there is no room for it. The key
+/// is the module's content hash, so a rebuilt module is loaded afresh.
+static struct DaemonModule *dm_module(const char *path, const char *cmake_binary_dir_path) {
+    struct ByteSlice module_file;
+    if (!try_map_file(path, &module_file)) return NULL;
+    uint64_t key = image_key(module_file);
+    for (uint32_t module_i = 0; module_i < max_daemon_modules; module_i += 1) {
+        struct DaemonModule *module = &dm_modules[module_i];
+        if (module->loaded && module->key == key) {
+            munmap(module_file.ptr, module_file.len);
+            module->last_used = dm_requests;
+            return module;
+        }
+    }
+    struct DaemonModule *module = dm_freeSlot();
+    if (module == NULL) {
+        munmap(module_file.ptr, module_file.len);
+        return NULL;
+    }
+    int cache_dir = open_cache_dir(AT_FDCWD, cmake_binary_dir_path);
+    arena_init(&module->arena, arena_capacity);
+
+    // A malformed module must not take the daemon down.
+    jmp_buf load_jmp;
+    panic_jmp = &load_jmp;
+    if (setjmp(load_jmp) != 0) {
+        panic_jmp = NULL;
+        // As in zw_module_load, the module file may already be unmapped.
+        if (module->vm.memory != MAP_FAILED) {
+            munmap(module->vm.memory, max_memory);
+            if (module->vm.stack != MAP_FAILED)
+                munmap(module->vm.stack, sizeof(uint32_t) * max_stack_len);
+        }
+        arena_release(&module->arena);
+        close(cache_dir);
+        return NULL;
+    }
+    vm_setup(&module->vm, &module->arena, module_file, cache_dir, NULL);
+    panic_jmp = NULL;
+    close(cache_dir);
+    module->loaded = true;
+    module->key = key;
+    module->last_used = dm_requests;
+    return module;
+}
 
-        new_argv[new_argv_i] = ZIG_TRIPLE_ARCH "-" ZIG_TRIPLE_OS;
-        new_argv_i += 1;
+static void dm_runChild(struct DaemonModule *module, char **args, const int *fds, int listen_fd) {
+    close(listen_fd);
+    for (uint32_t job_i = 0; job_i < dm_jobs_len; job_i += 1) close(dm_jobs[job_i].conn);
+    sigchld_deinit();
+    signal(SIGPIPE, SIG_DFL);
+    for (int i = 0; i < 3; i += 1) {
+        if (fds[i] == i) continue;
+        dup2(fds[i], i);
+        close(fds[i]);
     }
+    close(fds[3]);
+
+    struct Invocation inv;
+    inv_init(&inv, args, AT_FDCWD, -1);
+    struct VirtualMachine *vm = &module->vm;
+    inv_bind(&inv, vm);
+    // The handle the module was loaded with is gone.
+    if (vm->snapshot_dir != -1) vm->snapshot_dir = inv.cache_dir;
+    vm_run(vm);
+    exit(0);
+}
 
-    if (isatty(STDERR_FILENO) != 0) {
-        new_argv[new_argv_i] = "--color";
-        new_argv_i += 1;
+static void dm_reply(int conn, int32_t status) {
+    write_all(conn, &status, sizeof(status));
+    close(conn);
+}
 
-        new_argv[new_argv_i] = "on";
-        new_argv_i += 1;
+static void dm_handle(int conn, int listen_fd) {
+    int fds[daemon_request_fds];
+    uint32_t request_len;
+    // A client that stalls mid-request must not hold up everyone else.
+    struct timeval timeout = {
+        .tv_sec = daemon_request_timeout_ms / 1000,
+        .tv_usec = daemon_request_timeout_ms % 1000 * 1000,
+    };
+    setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    dm_requests += 1;
+    if (!dm_recvRequest(conn, &request_len, fds)) {
+        close(conn);
+        return;
     }
+    char *args[max_fork_request_args + 2];
+    uint32_t args_len = 0;
+    args[args_len++] = "zig-wasi";
+    const char *error = NULL;
+    for (uint32_t i = 0; i < request_len; i += strlen(dm_request + i) + 1) {
+        if (args_len == max_fork_request_args + 1) {
+            error = "too many arguments";
+            break;
+        }
+        args[args_len++] = dm_request + i;
+    }
+    args[args_len] = NULL;
+
+    struct DaemonModule *module = NULL;
+    if (error == NULL && args_len < 5) error = "missing arguments";
+    if (error == NULL && dm_jobs_len == max_daemon_jobs) error = "too many running instances";
+    if (error == NULL && fchdir(fds[3]) == -1) error = "unable to enter working directory";
+    if (error == NULL && (module = dm_module(args[4], args[2])) == NULL) {
+        // The client runs the module itself and reports why it failed.
+        for (int i = 0; i < daemon_request_fds; i += 1) close(fds[i]);
+        dm_reply(conn, daemon_declined);
+        return;
+    }
+    pid_t pid = -1;
+    if (error == NULL && (pid = fork()) == -1) error = "unable to fork";
+    if (pid == 0) dm_runChild(module, args, fds, listen_fd);
+
+    if (error != NULL) dprintf(fds[2], "zig-wasi daemon: %s\n", error);
+    for (int i = 0; i < daemon_request_fds; i += 1) close(fds[i]);
+    if (error != NULL) {
+        dm_reply(conn, 1);
+        return;
+    }
+    dm_jobs[dm_jobs_len].pid = pid;
+    dm_jobs[dm_jobs_len].conn = conn;
+    dm_jobs[dm_jobs_len].module = module;
+    dm_jobs_len += 1;
+}
 
-    new_argv[new_argv_i] = NULL;
-
-    const struct ByteSlice compressed_bytes = read_file_alloc(wasm_file);
+/// ZIG_WASI_DAEMON_LISTEN=<socket path>: serves run requests from
+/// ZIG_WASI_DAEMON clients. Modules stay loaded across requests and every
+/// request runs in a fresh instance forked from its module, with the
+/// client's standard streams and working directory. The client gets the
+/// instance's exit status as a little-endian i32.
+static void dm_serve(const char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) panic("daemon socket path too long");
+    strcpy(addr.sun_path, path);
+    int listen_fd = err_wrap("creating daemon socket", socket(AF_UNIX, SOCK_STREAM, 0));
+    unlink(path);
+    err_wrap("binding daemon socket", bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)));
+    err_wrap("listening on daemon socket", listen(listen_fd, 64));
+    sigchld_init();
+    // A client that goes away must not take the daemon with it.
+    signal(SIGPIPE, SIG_IGN);
+
+    struct pollfd fds[2];
+    fds[0].fd = listen_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = sigchld_pipe[0];
+    fds[1].events = POLLIN;
+    for (;;) {
+        if (poll(fds, 2, -1) == -1) {
+            if (errno == EINTR) continue;
+            err_wrap("waiting for daemon requests", -1);
+        }
+        if (fds[1].revents & POLLIN) {
+            int status;
+            pid_t pid;
+            while ((pid = sigchld_reap(&status)) != -1) {
+                for (uint32_t job_i = 0; job_i < dm_jobs_len; job_i += 1) {
+                    if (dm_jobs[job_i].pid != pid) continue;
+                    dm_reply(dm_jobs[job_i].conn, status);
+                    dm_jobs_len -= 1;
+                    dm_jobs[job_i] = dm_jobs[dm_jobs_len];
+                    break;
+                }
+            }
+        }
+        if (fds[0].revents & POLLIN) {
+            int conn = accept(listen_fd, NULL, NULL);
+            if (conn != -1) dm_handle(conn, listen_fd);
+        }
+    }
+}
 
-    const size_t max_uncompressed_size = 2500000;
-    char *mod_ptr = arena_alloc(max_uncompressed_size);
-    size_t mod_len = ZSTD_decompress(mod_ptr, max_uncompressed_size,
-            compressed_bytes.ptr, compressed_bytes.len);
+/// ZIG_WASI_DAEMON=<socket path>: hands this invocation to the daemon
+/// listening there. Returns false, for the caller to run the module
+/// itself, if no daemon accepts the request or it cannot load the module.
+static bool dm_runClient(const char *path, char **argv, int *exit_status) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) return false;
+    strcpy(addr.sun_path, path);
+
+    uint32_t len = 0;
+    for (size_t arg_i = 1; argv[arg_i] != NULL; arg_i += 1) {
+        size_t arg_len = strlen(argv[arg_i]) + 1;
+        if (len + arg_len > max_fork_request_len) return false;
+        memcpy(dm_request + len, argv[arg_i], arg_len);
+        len += arg_len;
+    }
+    if (len == 0) return false;
 
-    int cwd = err_wrap("opening cwd", open(".", O_DIRECTORY|O_RDONLY|O_CLOEXEC));
-    int zig_lib_dir = err_wrap("opening zig lib dir", open(zig_lib_dir_path, O_DIRECTORY|O_RDONLY|O_CLOEXEC));
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock == -1) return false;
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        close(sock);
+        return false;
+    }
+    int cwd = open(".", O_DIRECTORY | O_RDONLY | O_CLOEXEC);
+    if (cwd == -1) {
+        close(sock);
+        return false;
+    }
+    int fds[daemon_request_fds] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO, cwd };
+    struct iovec iov;
+    iov.iov_base = &len;
+    iov.iov_len = sizeof(len);
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(fds))];
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    ssize_t n;
+    do n = sendmsg(sock, &msg, 0); while (n == -1 && errno == EINTR);
+    close(cwd);
+    if (n != sizeof(len) || !write_all(sock, dm_request, len)) {
+        close(sock);
+        return false;
+    }
 
-    add_preopen(0, "stdin", STDIN_FILENO);
-    add_preopen(1, "stdout", STDOUT_FILENO);
-    add_preopen(2, "stderr", STDERR_FILENO);
-    add_preopen(3, ".", cwd);
-    add_preopen(4, "/cache", cache_dir);
-    add_preopen(5, "/lib", zig_lib_dir);
+    int32_t status;
+    if (!read_all(sock, &status, sizeof(status))) panic("daemon dropped the connection");
+    close(sock);
+    if (status == daemon_declined) return false;
+    *exit_status = status;
+    return true;
+}
 
-    uint32_t i = 0;
+/// A module loaded through the library, and the memory its instances
+/// start from. The decoded image, when it came from the cache, stays
+/// mapped until the process exits.
+struct zw_module {
+    struct Arena arena;
+    struct VirtualMachine vm;
+    struct InitialMemory init;
+    int cache_dir;
+};
 
-    if (mod_ptr[0] != 0 || mod_ptr[1] != 'a' || mod_ptr[2] != 's' || mod_ptr[3] != 'm') {
-        panic("bad magic");
-    }
-    i += 4;
+/// Holds the instance's copies of the module's mutable arrays, its
+/// argument and environment strings and its preopen names.
+#define zw_instance_arena_capacity (64ul * 1024ul * 1024ul)
 
-    uint32_t version = read_u32_le(mod_ptr + i);
-    i += 4;
-    if (version != 1) panic("bad wasm version");
+struct zw_instance {
+    struct Instance inst;
+    struct Arena arena;
+    /// Set when a registered host function trapped.
+    bool trapped;
+};
 
-    uint32_t section_starts[13];
-    memset(&section_starts, 0, sizeof(uint32_t) * 13);
+static pthread_once_t zw_process_once = PTHREAD_ONCE_INIT;
 
-    while (i < mod_len) {
-        uint8_t section_id = mod_ptr[i];
-        i += 1;
-        uint32_t section_len = read32_uleb128(mod_ptr, &i);
-        section_starts[section_id] = i;
-        i += section_len;
-    }
+static void zw_initProcess(void) {
+    detect_host_features();
+    host_initTable();
+    startup_init();
+}
 
-    // Map type indexes to offsets into the module.
-    struct TypeInfo *types;
-    {
-        i = section_starts[Section_type];
-        uint32_t types_len = read32_uleb128(mod_ptr, &i);
-        types = arena_alloc(sizeof(struct TypeInfo) * types_len);
-        for (size_t type_i = 0; type_i < types_len; type_i += 1) {
-            struct TypeInfo *info = &types[type_i];
-            if (mod_ptr[i] != 0x60) panic("bad type byte");
-            i += 1;
+static struct zw_instance *zw_instanceOf(struct VirtualMachine *vm) {
+    return (struct zw_instance *)((char *)vm - offsetof(struct zw_instance, inst.vm));
+}
 
-            info->param_count = read32_uleb128(mod_ptr, &i);
-            if (info->param_count > 32) panic("found a type with over 32 parameters");
-            info->param_types = 0;
-            for (uint32_t param_i = 0; param_i < info->param_count; param_i += 1) {
-                int64_t param_type = read64_ileb128(mod_ptr, &i);
-                switch (param_type) {
-                    case -1: case -3: bs_unset(&info->param_types, param_i); break;
-                    case -2: case -4:   bs_set(&info->param_types, param_i); break;
-                    default: panic("unexpected param type");
-                }
-            }
+/// Dispatches a call to a function registered through zw_module_options.
+static void host_callRegistered(struct VirtualMachine *vm) {
+    const struct Module *module = vm->module;
+    const struct Import *imp = &module->imports[vm->import_idx];
+    const struct zw_host_function *host = &module->extra_hosts[imp->host_idx - host_functions_len];
+    const struct TypeInfo *type = &module->types[imp->type_idx];
+    uint64_t args[32];
+    uint64_t results[32];
+    for (uint32_t param_i = type->param_count; param_i > 0; param_i -= 1) {
+        args[param_i - 1] = bs_isSet(&type->param_types, param_i - 1) ?
+            vm_pop_u64(vm) : vm_pop_u32(vm);
+    }
+    struct zw_instance *instance = zw_instanceOf(vm);
+    int32_t trap = host->callback(instance, host->context, args, results);
+    if (trap != 0) {
+        if (vm->exit_jmp == NULL) panic("host function trapped");
+        panic_msg = "host function trapped";
+        instance->trapped = true;
+        vm->exit_code = trap;
+        longjmp(*vm->exit_jmp, 1);
+    }
+    for (uint32_t result_i = 0; result_i < type->result_count; result_i += 1) {
+        if (bs_isSet(&type->result_types, result_i))
+            vm_push_u64(vm, results[result_i]);
+        else
+            vm_push_u32(vm, (uint32_t)results[result_i]);
+    }
+}
 
-            info->result_count = read32_uleb128(mod_ptr, &i);
-            info->result_types = 0;
-            for (uint32_t result_i = 0; result_i < info->result_count; result_i += 1) {
-                int64_t result_type = read64_ileb128(mod_ptr, &i);
-                switch (result_type) {
-                    case -1: case -3: bs_unset(&info->result_types, result_i); break;
-                    case -2: case -4:   bs_set(&info->result_types, result_i); break;
-                    default: panic("unexpected result type");
-                }
-            }
+struct zw_module *zw_module_load(const char *path, const struct zw_module_options *options) {
+    static const struct zw_module_options default_options;
+    pthread_once(&zw_process_once, zw_initProcess);
+    if (options == NULL) options = &default_options;
+    struct ByteSlice module_file;
+    if (!try_map_file(path, &module_file)) {
+        panic_msg = "unable to read module";
+        return NULL;
+    }
+    struct zw_module *module = malloc(sizeof(struct zw_module));
+    if (module == NULL) panic("out of memory");
+    module->cache_dir = -1;
+    if (options->cache_dir != NULL) {
+        mkdir(options->cache_dir, 0777);
+        module->cache_dir = open(options->cache_dir, O_DIRECTORY | O_RDONLY | O_CLOEXEC);
+    }
+    arena_init(&module->arena, arena_capacity);
+
+    // With panic_jmp set, loading starts no helper threads, so every panic
+    // while parsing and decoding unwinds to here.
+    jmp_buf load_jmp;
+    jmp_buf *prev_jmp = panic_jmp;
+    panic_jmp = &load_jmp;
+    if (setjmp(load_jmp) != 0) {
+        panic_jmp = prev_jmp;
+        // The module file may have been unmapped already, so it is left
+        // alone; vm_setup maps the stack right after memory.
+        if (module->vm.memory != MAP_FAILED) {
+            munmap(module->vm.memory, max_memory);
+            if (module->vm.stack != MAP_FAILED)
+                munmap(module->vm.stack, sizeof(uint32_t) * max_stack_len);
         }
+        if (module->cache_dir != -1) close(module->cache_dir);
+        arena_release(&module->arena);
+        free(module);
+        return NULL;
     }
+    vm_setup(&module->vm, &module->arena, module_file, module->cache_dir, options);
+    inst_captureMemory(&module->init, &module->vm, &module->arena);
+    panic_jmp = prev_jmp;
+    return module;
+}
 
-    // Count the imported functions so we can correct function references.
-    struct Import *imports;
-    uint32_t imports_len;
-    {
-        i = section_starts[Section_import];
-        imports_len = read32_uleb128(mod_ptr, &i);
-        imports = arena_alloc(sizeof(struct Import) * imports_len);
-        for (size_t imp_i = 0; imp_i < imports_len; imp_i += 1) {
-            struct Import *imp = &imports[imp_i];
-
-            struct ByteSlice mod_name = read_name(mod_ptr, &i);
-            if (mod_name.len == strlen("wasi_snapshot_preview1") &&
-                memcmp(mod_name.ptr, "wasi_snapshot_preview1", mod_name.len) == 0) {
-                imp->mod = ImpMod_wasi_snapshot_preview1;
-            } else panic("unknown import module");
-
-            struct ByteSlice sym_name = read_name(mod_ptr, &i);
-            if (sym_name.len == strlen("args_get") &&
-                memcmp(sym_name.ptr, "args_get", sym_name.len) == 0) {
-                imp->name = ImpName_args_get;
-            } else if (sym_name.len == strlen("args_sizes_get") &&
-                memcmp(sym_name.ptr, "args_sizes_get", sym_name.len) == 0) {
-                imp->name = ImpName_args_sizes_get;
-            } else if (sym_name.len == strlen("clock_time_get") &&
-                memcmp(sym_name.ptr, "clock_time_get", sym_name.len) == 0) {
-                imp->name = ImpName_clock_time_get;
-            } else if (sym_name.len == strlen("debug") &&
-                memcmp(sym_name.ptr, "debug", sym_name.len) == 0) {
-                imp->name = ImpName_debug;
-            } else if (sym_name.len == strlen("debug_slice") &&
-                memcmp(sym_name.ptr, "debug_slice", sym_name.len) == 0) {
-                imp->name = ImpName_debug_slice;
-            } else if (sym_name.len == strlen("environ_get") &&
-                memcmp(sym_name.ptr, "environ_get", sym_name.len) == 0) {
-                imp->name = ImpName_environ_get;
-            } else if (sym_name.len == strlen("environ_sizes_get") &&
-                memcmp(sym_name.ptr, "environ_sizes_get", sym_name.len) == 0) {
-                imp->name = ImpName_environ_sizes_get;
-            } else if (sym_name.len == strlen("fd_close") &&
-                memcmp(sym_name.ptr, "fd_close", sym_name.len) == 0) {
-                imp->name = ImpName_fd_close;
-            } else if (sym_name.len == strlen("fd_fdstat_get") &&
-                memcmp(sym_name.ptr, "fd_fdstat_get", sym_name.len) == 0) {
-                imp->name = ImpName_fd_fdstat_get;
-            } else if (sym_name.len == strlen("fd_filestat_get") &&
-                memcmp(sym_name.ptr, "fd_filestat_get", sym_name.len) == 0) {
-                imp->name = ImpName_fd_filestat_get;
-            } else if (sym_name.len == strlen("fd_filestat_set_size") &&
-                memcmp(sym_name.ptr, "fd_filestat_set_size", sym_name.len) == 0) {
-                imp->name = ImpName_fd_filestat_set_size;
-            } else if (sym_name.len == strlen("fd_filestat_set_times") &&
-                memcmp(sym_name.ptr, "fd_filestat_set_times", sym_name.len) == 0) {
-                imp->name = ImpName_fd_filestat_set_times;
-            } else if (sym_name.len == strlen("fd_pread") &&
-                memcmp(sym_name.ptr, "fd_pread", sym_name.len) == 0) {
-                imp->name = ImpName_fd_pread;
-            } else if (sym_name.len == strlen("fd_prestat_dir_name") &&
-                memcmp(sym_name.ptr, "fd_prestat_dir_name", sym_name.len) == 0) {
-                imp->name = ImpName_fd_prestat_dir_name;
-            } else if (sym_name.len == strlen("fd_prestat_get") &&
-                memcmp(sym_name.ptr, "fd_prestat_get", sym_name.len) == 0) {
-                imp->name = ImpName_fd_prestat_get;
-            } else if (sym_name.len == strlen("fd_pwrite") &&
-                memcmp(sym_name.ptr, "fd_pwrite", sym_name.len) == 0) {
-                imp->name = ImpName_fd_pwrite;
-            } else if (sym_name.len == strlen("fd_read") &&
-                memcmp(sym_name.ptr, "fd_read", sym_name.len) == 0) {
-                imp->name = ImpName_fd_read;
-            } else if (sym_name.len == strlen("fd_readdir") &&
-                memcmp(sym_name.ptr, "fd_readdir", sym_name.len) == 0) {
-                imp->name = ImpName_fd_readdir;
-            } else if (sym_name.len == strlen("fd_write") &&
-                memcmp(sym_name.ptr, "fd_write", sym_name.len) == 0) {
-                imp->name = ImpName_fd_write;
-            } else if (sym_name.len == strlen("path_create_directory") &&
-                memcmp(sym_name.ptr, "path_create_directory", sym_name.len) == 0) {
-                imp->name = ImpName_path_create_directory;
-            } else if (sym_name.len == strlen("path_filestat_get") &&
-                memcmp(sym_name.ptr, "path_filestat_get", sym_name.len) == 0) {
-                imp->name = ImpName_path_filestat_get;
-            } else if (sym_name.len == strlen("path_open") &&
-                memcmp(sym_name.ptr, "path_open", sym_name.len) == 0) {
-                imp->name = ImpName_path_open;
-            } else if (sym_name.len == strlen("path_remove_directory") &&
-                memcmp(sym_name.ptr, "path_remove_directory", sym_name.len) == 0) {
-                imp->name = ImpName_path_remove_directory;
-            } else if (sym_name.len == strlen("path_rename") &&
-                memcmp(sym_name.ptr, "path_rename", sym_name.len) == 0) {
-                imp->name = ImpName_path_rename;
-            } else if (sym_name.len == strlen("path_unlink_file") &&
-                memcmp(sym_name.ptr, "path_unlink_file", sym_name.len) == 0) {
-                imp->name = ImpName_path_unlink_file;
-            } else if (sym_name.len == strlen("proc_exit") &&
-                memcmp(sym_name.ptr, "proc_exit", sym_name.len) == 0) {
-                imp->name = ImpName_proc_exit;
-            } else if (sym_name.len == strlen("random_get") &&
-                memcmp(sym_name.ptr, "random_get", sym_name.len) == 0) {
-                imp->name = ImpName_random_get;
-            } else panic("unknown import name");
+void zw_module_free(struct zw_module *module) {
+    if (module->init.fd != -1) close(module->init.fd);
+    if (module->cache_dir != -1) close(module->cache_dir);
+    vm_release(&module->vm);
+    arena_release(&module->arena);
+    free(module);
+}
 
-            uint32_t desc = read32_uleb128(mod_ptr, &i);
-            if (desc != 0) panic("external kind not function");
-            imp->type_idx = read32_uleb128(mod_ptr, &i);
-        }
+/// Copies a NULL terminated string list into the arena.
+static const char **zw_copyStrings(struct Arena *arena, const char *const *strings) {
+    size_t strings_len = 0;
+    while (strings != NULL && strings[strings_len] != NULL) strings_len += 1;
+    const char **copy = arena_alloc(arena, sizeof(const char *) * (strings_len + 1));
+    for (size_t string_i = 0; string_i < strings_len; string_i += 1) {
+        size_t len = strlen(strings[string_i]) + 1;
+        char *string = arena_allocAligned(arena, len, 1);
+        memcpy(string, strings[string_i], len);
+        copy[string_i] = string;
     }
+    copy[strings_len] = NULL;
+    return copy;
+}
 
-    // Find _start in the exports
-    uint32_t start_fn_idx;
-    {
-        i = section_starts[Section_export];
-        uint32_t count = read32_uleb128(mod_ptr, &i);
-        for (; count > 0; count -= 1) {
-            struct ByteSlice name = read_name(mod_ptr, &i);
-            uint32_t desc = read32_uleb128(mod_ptr, &i);
-            start_fn_idx = read32_uleb128(mod_ptr, &i);
-            if (desc == 0 && name.len == strlen("_start") &&
-                memcmp(name.ptr, "_start", name.len) == 0)
-            {
-                break;
-            }
+struct zw_instance *zw_instance_new(struct zw_module *module, const struct zw_instance_options *options) {
+    static const struct zw_instance_options default_options;
+    if (options == NULL) options = &default_options;
+    if (options->preopens_len > max_preopens - 3) {
+        panic_msg = "too many preopens";
+        return NULL;
+    }
+    struct FdTable fds;
+    memset(&fds, 0, sizeof(fds));
+    add_preopen(&fds, 0, "stdin", STDIN_FILENO);
+    add_preopen(&fds, 1, "stdout", STDOUT_FILENO);
+    add_preopen(&fds, 2, "stderr", STDERR_FILENO);
+    for (size_t preopen_i = 0; preopen_i < options->preopens_len; preopen_i += 1) {
+        const struct zw_preopen *preopen = &options->preopens[preopen_i];
+        int host_fd = open(preopen->host_path, O_DIRECTORY | O_RDONLY | O_CLOEXEC);
+        if (host_fd == -1) {
+            for (uint32_t i = 3; i < fds.preopens_len; i += 1) close(fds.preopens[i].host_fd);
+            panic_msg = "unable to open preopen";
+            return NULL;
         }
-        if (count == 0) panic("_start symbol not found");
+        add_preopen(&fds, 3 + preopen_i, preopen->guest_path, host_fd);
     }
 
-    // Map function indexes to offsets into the module and type index.
-    struct Function *functions;
-    uint32_t functions_len;
-    {
-        i = section_starts[Section_function];
-        functions_len = read32_uleb128(mod_ptr, &i);
-        functions = arena_alloc(sizeof(struct Function) * functions_len);
-        for (size_t func_i = 0; func_i < functions_len; func_i += 1) {
-            struct Function *func = &functions[func_i];
-            func->id = imports_len + func_i;
-            func->type_idx = read32_uleb128(mod_ptr, &i);
-        }
+    struct zw_instance *instance = malloc(sizeof(struct zw_instance));
+    if (instance == NULL) panic("out of memory");
+    arena_init(&instance->arena, zw_instance_arena_capacity);
+    inst_init(&instance->inst, &module->vm, &module->init, &instance->arena);
+    struct VirtualMachine *vm = &instance->inst.vm;
+    vm->args = zw_copyStrings(&instance->arena, options->argv);
+    vm->env = zw_copyStrings(&instance->arena, options->env);
+    for (uint32_t i = 3; i < fds.preopens_len; i += 1) {
+        size_t len = fds.preopens[i].name_len + 1;
+        char *name = arena_allocAligned(&instance->arena, len, 1);
+        memcpy(name, fds.preopens[i].name, len);
+        fds.preopens[i].name = name;
     }
+    vm->fds = fds;
+    if (options->memory_limit != 0 && options->memory_limit < max_memory)
+        vm->memory_limit = options->memory_limit;
+    instance->trapped = false;
+    return instance;
+}
 
-    // Allocate and initialize globals.
-    uint64_t *globals;
-    {
-        i = section_starts[Section_global];
-        uint32_t globals_len = read32_uleb128(mod_ptr, &i);
-        globals = arena_alloc(sizeof(uint64_t) * globals_len);
-        for (size_t glob_i = 0; glob_i < globals_len; glob_i += 1) {
-            uint64_t *global = &globals[glob_i];
-            uint32_t content_type = read32_uleb128(mod_ptr, &i);
-            uint32_t mutability = read32_uleb128(mod_ptr, &i);
-            if (mutability != 1) panic("expected mutable global");
-            if (content_type != 0x7f) panic("unexpected content type");
-            uint8_t opcode = mod_ptr[i];
-            i += 1;
-            if (opcode != WasmOp_i32_const) panic("expected i32_const op");
-            uint32_t init = read32_ileb128(mod_ptr, &i);
-            *global = (uint32_t)init;
-        }
+void zw_instance_free(struct zw_instance *instance) {
+    struct VirtualMachine *vm = &instance->inst.vm;
+    for (int fd = 0; fd < max_tracked_fds; fd += 1) {
+        if ((vm->fds.guest_fds[fd / 8] & (1 << (fd % 8))) != 0) close(fd);
     }
+    for (uint32_t i = 3; i < vm->fds.preopens_len; i += 1) close(vm->fds.preopens[i].host_fd);
+    munmap(vm->memory, max_memory);
+    munmap(vm->stack, sizeof(uint32_t) * max_stack_len);
+    arena_release(&instance->arena);
+    free(instance);
+}
 
-    // Allocate and initialize memory.
-    uint32_t memory_len;
-    {
-        i = section_starts[Section_memory];
-        uint32_t memories_len = read32_uleb128(mod_ptr, &i);
-        if (memories_len != 1) panic("unexpected memory count");
-        uint32_t flags = read32_uleb128(mod_ptr, &i);
-        (void)flags;
-        memory_len = read32_uleb128(mod_ptr, &i) * wasm_page_size;
+void zw_instance_reset(struct zw_instance *instance) {
+    inst_reset(&instance->inst);
+    instance->trapped = false;
+}
 
-        i = section_starts[Section_data];
-        uint32_t datas_count = read32_uleb128(mod_ptr, &i);
-        for (; datas_count > 0; datas_count -= 1) {
-            uint32_t mode = read32_uleb128(mod_ptr, &i);
-            if (mode != 0) panic("expected mode 0");
-            enum WasmOp opcode = mod_ptr[i];
-            i += 1;
-            if (opcode != WasmOp_i32_const) panic("expected opcode i32_const");
-            uint32_t offset = read32_uleb128(mod_ptr, &i);
-            enum WasmOp end = mod_ptr[i];
-            if (end != WasmOp_end) panic("expected end opcode");
-            i += 1;
-            uint32_t bytes_len = read32_uleb128(mod_ptr, &i);
-            memcpy(memory + offset, mod_ptr + i, bytes_len);
-            i += bytes_len;
+enum zw_result zw_instance_call(struct zw_instance *instance, const char *name,
+    const uint64_t *args, size_t args_len, uint64_t *results, size_t results_len,
+    int32_t *exit_code)
+{
+    struct VirtualMachine *vm = &instance->inst.vm;
+    const struct Module *module = vm->module;
+    size_t name_len = strlen(name);
+    const struct Export *exp = NULL;
+    for (uint32_t export_i = 0; export_i < module->exports_len; export_i += 1) {
+        if (module->exports[export_i].name_len == name_len &&
+            memcmp(module->exports[export_i].name, name, name_len) == 0)
+        {
+            exp = &module->exports[export_i];
+            break;
+        }
+    }
+    // Re-exported imports are not callable from the host.
+    if (exp == NULL || exp->func_idx < module->imports_len) return ZW_NOT_FOUND;
+    struct Function *func = &module->functions[exp->func_idx - module->imports_len];
+    const struct TypeInfo *type = &module->types[func->type_idx];
+    if (args_len != type->param_count || results_len != type->result_count) return ZW_BAD_SIGNATURE;
+
+    uint64_t needed_len = (uint64_t)vm->stack_top + 2 * args_len;
+    if (needed_len > vm->stack_len) vm_growStack(vm, needed_len);
+    for (uint32_t param_i = 0; param_i < type->param_count; param_i += 1) {
+        if (bs_isSet(&type->param_types, param_i))
+            vm_push_u64(vm, args[param_i]);
+        else
+            vm_push_u32(vm, (uint32_t)args[param_i]);
+    }
+    vm->pc.opcode = host_return_pc;
+    vm->pc.operand = 0;
+
+    // proc_exit and host function traps unwind through exit_jmp, traps
+    // of the guest itself through panic_jmp.
+    jmp_buf exit_jmp;
+    jmp_buf trap_jmp;
+    jmp_buf *prev_jmp = panic_jmp;
+    enum zw_result result;
+    vm->exit_jmp = &exit_jmp;
+    if (setjmp(trap_jmp) != 0) {
+        instance->trapped = true;
+        if (exit_code != NULL) *exit_code = -1;
+        result = ZW_TRAP;
+    } else if (setjmp(exit_jmp) == 0) {
+        panic_jmp = &trap_jmp;
+        vm_call(vm, func);
+        vm_run(vm);
+        for (uint32_t result_i = type->result_count; result_i > 0; result_i -= 1) {
+            results[result_i - 1] = bs_isSet(&type->result_types, result_i - 1) ?
+                vm_pop_u64(vm) : vm_pop_u32(vm);
         }
+        result = ZW_OK;
+    } else {
+        if (exit_code != NULL) *exit_code = vm->exit_code;
+        result = instance->trapped ? ZW_TRAP : ZW_EXIT;
     }
+    panic_jmp = prev_jmp;
+    vm->exit_jmp = NULL;
+    return result;
+}
 
-    uint32_t *table = NULL;
-    {
-        i = section_starts[Section_table];
-        uint32_t table_count = read32_uleb128(mod_ptr, &i);
-        if (table_count > 1) {
-            panic("expected only one table section");
-        } else if (table_count == 1) {
-            uint32_t element_type = read32_uleb128(mod_ptr, &i);
-            (void)element_type;
-            uint32_t has_max = read32_uleb128(mod_ptr, &i);
-            if (has_max != 1) panic("expected has_max==1");
-            uint32_t initial = read32_uleb128(mod_ptr, &i);
-            (void)initial;
-            uint32_t maximum = read32_uleb128(mod_ptr, &i);
+const char *zw_last_error(void) {
+    return panic_msg;
+}
 
-            i = section_starts[Section_element];
-            uint32_t element_section_count = read32_uleb128(mod_ptr, &i);
-            if (element_section_count != 1) panic("expected one element section");
-            uint32_t flags = read32_uleb128(mod_ptr, &i);
-            (void)flags;
-            enum WasmOp opcode = mod_ptr[i];
-            i += 1;
-            if (opcode != WasmOp_i32_const) panic("expected op i32_const");
-            uint32_t offset = read32_uleb128(mod_ptr, &i);
-            enum WasmOp end = mod_ptr[i];
-            if (end != WasmOp_end) panic("expected op end");
-            i += 1;
-            uint32_t elem_count = read32_uleb128(mod_ptr, &i);
+uint8_t *zw_instance_memory(struct zw_instance *instance, size_t *len) {
+    *len = instance->inst.vm.memory_len;
+    return (uint8_t *)instance->inst.vm.memory;
+}
 
-            table = arena_alloc(sizeof(uint32_t) * maximum);
-            memset(table, 0, sizeof(uint32_t) * maximum);
+int zw_instance_read(struct zw_instance *instance, uint32_t offset, void *buf, size_t len) {
+    const struct VirtualMachine *vm = &instance->inst.vm;
+    if (offset > vm->memory_len || len > vm->memory_len - offset) return -1;
+    memcpy(buf, vm->memory + offset, len);
+    return 0;
+}
 
-            for (uint32_t elem_i = 0; elem_i < elem_count; elem_i += 1) {
-                table[elem_i + offset] = read32_uleb128(mod_ptr, &i);
-            }
+int zw_instance_write(struct zw_instance *instance, uint32_t offset, const void *buf, size_t len) {
+    struct VirtualMachine *vm = &instance->inst.vm;
+    if (offset > vm->memory_len || len > vm->memory_len - offset) return -1;
+    memcpy(vm->memory + offset, buf, len);
+    return 0;
+}
+
+int zw_main(int argc, char **argv) {
+    detect_host_features();
+    host_initTable();
+    startup_init();
+
+    const char *daemon_listen = getenv("ZIG_WASI_DAEMON_LISTEN");
+    if (daemon_listen != NULL) dm_serve(daemon_listen);
+    const char *daemon = getenv("ZIG_WASI_DAEMON");
+    int exit_status;
+    if (daemon != NULL && dm_runClient(daemon, argv, &exit_status)) return exit_status;
+
+    const char *wasm_file = argv[4];
+    struct Invocation inv;
+    inv_init(&inv, argv, AT_FDCWD, -1);
+
+    startup_phase("arguments", 0, 0, 0, 0);
+    const struct ByteSlice module_file = map_file(wasm_file);
+    startup_phase("map module", module_file.len, 0, 0, 0);
+
+    struct Arena arena;
+    arena_init(&arena, arena_capacity);
+
+    // ZIG_WASI_MEMO=1 replays the outputs of an earlier run with the same
+    // module, arguments and inputs instead of running the guest; see
+    // struct Memo. Runs that serve or repeat are never memoized.
+    bool use_memo = getenv("ZIG_WASI_MEMO") != NULL && getenv("ZIG_WASI_FORK_SERVER") == NULL &&
+        getenv("ZIG_WASI_BATCH") == NULL && getenv("ZIG_WASI_REPEAT") == NULL &&
+        getenv("ZIG_WASI_THREADS") == NULL;
+    uint64_t run_key = 0;
+    if (use_memo) {
+        run_key = memo_key(image_key(module_file), inv.argv);
+        int exit_code;
+        if (memo_replay(&inv.fds, inv.cache_dir, run_key, &exit_code)) {
+            startup_phase("replay memo", 0, 0, 0, 0);
+            startup_print(&arena);
+            arena_release(&arena);
+            return exit_code;
         }
     }
 
     struct VirtualMachine vm;
-#ifndef NDEBUG
-    memset(&vm, 0xaa, sizeof(struct VirtualMachine)); // to match the zig version
-#endif
-    vm.stack = arena_alloc(sizeof(uint32_t) * 10000000),
-    vm.mod_ptr = mod_ptr;
-    vm.opcodes = arena_alloc(2000000);
-    vm.operands = arena_alloc(sizeof(uint32_t) * 2000000);
-    vm.stack_top = 0;
-    vm.functions = functions;
-    vm.types = types;
-    vm.globals = globals;
-    vm.memory = memory;
-    vm.memory_len = memory_len;
-    vm.imports = imports;
-    vm.imports_len = imports_len;
-    vm.args = new_argv;
-    vm.table = table;
-
-    {
-        uint32_t code_i = section_starts[Section_code];
-        uint32_t codes_len = read32_uleb128(mod_ptr, &code_i);
-        if (codes_len != functions_len) panic("code/function length mismatch");
-        struct ProgramCounter pc;
-        pc.opcode = 0;
-        pc.operand = 0;
-        struct StackInfo stack;
-        for (uint32_t func_i = 0; func_i < functions_len; func_i += 1) {
-            struct Function *func = &functions[func_i];
-            uint32_t size = read32_uleb128(mod_ptr, &code_i);
-            uint32_t code_begin = code_i;
-
-            stack.top_index = 0;
-            stack.top_offset = 0;
-            struct TypeInfo *type_info = &vm.types[func->type_idx];
-            for (uint32_t param_i = 0; param_i < type_info->param_count; param_i += 1)
-                si_push(&stack, bs_isSet(&type_info->param_types, param_i));
-            uint32_t params_size = stack.top_offset;
-
-            for (uint32_t local_sets_count = read32_uleb128(mod_ptr, &code_i);
-                 local_sets_count > 0; local_sets_count -= 1)
-            {
-                uint32_t local_set_count = read32_uleb128(mod_ptr, &code_i);
-                enum StackType local_type;
-                switch (read64_ileb128(mod_ptr, &code_i)) {
-                    case -1: case -3: local_type = ST_32; break;
-                    case -2: case -4: local_type = ST_64; break;
-                    default: panic("unexpected local type");
-                }
-                for (; local_set_count > 0; local_set_count -= 1)
-                    si_push(&stack, local_type);
-            }
-            func->locals_size = stack.top_offset - params_size;
+    vm_setup(&vm, &arena, module_file, inv.cache_dir, NULL);
+    inv_bind(&inv, &vm);
+
+    if (getenv("ZIG_WASI_ARENA_STATS")) arena_printStats(&arena);
+    startup_print(&arena);
+
+    const char *fork_server = getenv("ZIG_WASI_FORK_SERVER");
+    if (fork_server != NULL) fs_serve(&vm, &inv, atoi(fork_server));
+
+    // ZIG_WASI_BATCH_JOBS=<n> runs the batch manifest's lines n at a time.
+    const char *batch = getenv("ZIG_WASI_BATCH");
+    if (batch != NULL) {
+        const char *jobs = getenv("ZIG_WASI_BATCH_JOBS");
+        int jobs_len = jobs != NULL ? atoi(jobs) : 1;
+        if (jobs_len < 1) panic("ZIG_WASI_BATCH_JOBS must be at least 1");
+        if (jobs_len > 1 && vm.module->decoder != NULL)
+            panic("ZIG_WASI_BATCH_JOBS cannot be combined with ZIG_WASI_LAZY_DECODE");
+        return batch_runAll(&vm, &arena, batch, jobs_len);
+    }
 
-            func->entry_pc = pc;
-            //fprintf(stderr, "decoding func id %u with pc %u:%u\n", func->id, pc.opcode, pc.operand);
-            vm_decodeCode(&vm, type_info, &code_i, &pc, &stack);
-            if (code_i != code_begin + size) panic("bad code size");
-        }
-        //fprintf(stderr, "%u opcodes\n%u operands\n", pc.opcode, pc.operand);
+    // ZIG_WASI_REPEAT=<n> runs the module n times in this process and
+    // exits with the last run's code. ZIG_WASI_THREADS=<n> does that on n
+    // threads at once, every thread with its own instance of the module.
+    const char *repeat = getenv("ZIG_WASI_REPEAT");
+    const char *threads = getenv("ZIG_WASI_THREADS");
+    if (repeat != NULL || threads != NULL) {
+        int runs = repeat != NULL ? atoi(repeat) : 1;
+        int threads_len = threads != NULL ? atoi(threads) : 1;
+        if (threads_len < 1) panic("ZIG_WASI_THREADS must be at least 1");
+        // Lazy decoding writes to the module on first call.
+        if (threads_len > 1 && vm.module->decoder != NULL)
+            panic("ZIG_WASI_THREADS cannot be combined with ZIG_WASI_LAZY_DECODE");
+        return inst_runThreads(&vm, &arena, inv.argv, threads_len, runs);
     }
 
-    vm_call(&vm, &vm.functions[start_fn_idx - imports_len]);
+    if (use_memo) return memo_run(&vm, inv.cache_dir, run_key);
     vm_run(&vm);
 
+    arena_release(&arena);
     return 0;
 }
+
+#ifndef ZIG_WASI_LIBRARY
+int main(int argc, char **argv) {
+    return zw_main(argc, argv);
+}
+#endif
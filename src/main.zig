@@ -1,5 +1,5 @@
 const std = @import("std");
-const cReader = @import("io/c_reader.zig").cReader;
+const builtin = @import("builtin");
 const assert = std.debug.assert;
 const fs = std.fs;
 const mem = std.mem;
@@ -7,16 +7,12 @@ const wasm = std.wasm;
 const wasi = std.os.wasi;
 const os = std.os;
 const math = std.math;
-const leb = std.leb;
 const decode_log = std.log.scoped(.decode);
 const stats_log = std.log.scoped(.stats);
 const trace_log = std.log.scoped(.trace);
 const cpu_log = std.log.scoped(.cpu);
 const func_log = std.log.scoped(.func);
 
-const SEEK = enum(c_int) { SET, CUR, END };
-pub extern "c" fn fseek(stream: *std.c.FILE, offset: c_long, whence: SEEK) c_int;
-
 pub fn log(
     comptime level: std.log.Level,
     comptime scope: @TypeOf(.EnumLiteral),
@@ -72,33 +68,32 @@ fn main2(args: []const [*:0]const u8) !void {
 
     var start_fn_idx: u32 = undefined;
     {
-        const module_file = std.c.fopen(wasm_file, "rb") orelse return error.FileNotFound;
-        defer _ = std.c.fclose(module_file);
-        const module_reader = cReader(module_file);
+        const module_bytes = try mapFile(wasm_file);
+        defer os.munmap(module_bytes);
+        var module_reader_instance = ModuleReader{ .bytes = module_bytes };
+        const module_reader = &module_reader_instance;
 
-        var magic: [4]u8 = undefined;
-        try module_reader.readNoEof(&magic);
-        if (!mem.eql(u8, &magic, "\x00asm")) return error.NotWasm;
+        if (!mem.eql(u8, try module_reader.readSlice(4), "\x00asm")) return error.NotWasm;
 
         const version = try module_reader.readIntLittle(u32);
         if (version != 1) return error.BadWasmVersion;
 
-        while (@intToEnum(wasm.Section, try module_reader.readByte()) != .type)
-            assert(fseek(module_file, @intCast(c_long, try leb.readULEB128(u32, module_reader)), .CUR) == 0);
-        _ = try leb.readULEB128(u32, module_reader);
+        try module_reader.indexSections();
+
+        _ = try module_reader.seekSection(.type);
 
         var max_param_count: u64 = 0;
-        vm.types = try arena.alloc(TypeInfo, try leb.readULEB128(u32, module_reader));
+        vm.types = try arena.alloc(TypeInfo, try module_reader.readULEB128(u32));
         for (vm.types) |*@"type"| {
-            assert(try leb.readILEB128(i33, module_reader) == -0x20);
+            assert(try module_reader.readILEB128(i33) == -0x20);
 
-            @"type".param_count = try leb.readULEB128(u32, module_reader);
+            @"type".param_count = try module_reader.readULEB128(u32);
             assert(@"type".param_count <= 32);
             @"type".param_types = TypeInfo.ParamTypes.initEmpty();
             max_param_count = @max(@"type".param_count, max_param_count);
             var param_index: u32 = 0;
             while (param_index < @"type".param_count) : (param_index += 1) {
-                const param_type = try leb.readILEB128(i33, module_reader);
+                const param_type = try module_reader.readILEB128(i33);
                 @"type".param_types.setValue(param_index, switch (param_type) {
                     -1, -3 => false,
                     -2, -4 => true,
@@ -106,12 +101,12 @@ fn main2(args: []const [*:0]const u8) !void {
                 });
             }
 
-            @"type".result_count = try leb.readULEB128(u32, module_reader);
+            @"type".result_count = try module_reader.readULEB128(u32);
             assert(@"type".result_count <= 1);
             @"type".result_types = TypeInfo.ResultTypes.initEmpty();
             var result_index: u32 = 0;
             while (result_index < @"type".result_count) : (result_index += 1) {
-                const result_type = try leb.readILEB128(i33, module_reader);
+                const result_type = try module_reader.readILEB128(i33);
                 @"type".result_types.setValue(result_index, switch (result_type) {
                     -1, -3 => false,
                     -2, -4 => true,
@@ -120,32 +115,20 @@ fn main2(args: []const [*:0]const u8) !void {
             }
         }
 
-        while (@intToEnum(wasm.Section, try module_reader.readByte()) != .import)
-            assert(fseek(module_file, @intCast(c_long, try leb.readULEB128(u32, module_reader)), .CUR) == 0);
-        _ = try leb.readULEB128(u32, module_reader);
+        _ = try module_reader.seekSection(.import);
 
         {
-            vm.imports = try arena.alloc(Import, try leb.readULEB128(u32, module_reader));
-
-            comptime var max_str_len: usize = 0;
-            inline for (.{ Import.Mod, Import.Name }) |Enum| {
-                inline for (comptime std.meta.fieldNames(Enum)) |str| {
-                    max_str_len = @max(str.len, max_str_len);
-                }
-            }
-            var str_buf: [max_str_len]u8 = undefined;
+            vm.imports = try arena.alloc(Import, try module_reader.readULEB128(u32));
 
             for (vm.imports) |*import| {
-                const mod = str_buf[0..try leb.readULEB128(u32, module_reader)];
-                try module_reader.readNoEof(mod);
+                const mod = try module_reader.readSlice(try module_reader.readULEB128(u32));
                 import.mod = std.meta.stringToEnum(Import.Mod, mod).?;
 
-                const name = str_buf[0..try leb.readULEB128(u32, module_reader)];
-                try module_reader.readNoEof(name);
+                const name = try module_reader.readSlice(try module_reader.readULEB128(u32));
                 import.name = std.meta.stringToEnum(Import.Name, name).?;
 
                 const kind = @intToEnum(wasm.ExternalKind, try module_reader.readByte());
-                const idx = try leb.readULEB128(u32, module_reader);
+                const idx = try module_reader.readULEB128(u32);
                 switch (kind) {
                     .function => import.type_idx = idx,
                     .table, .memory, .global => unreachable,
@@ -153,83 +136,67 @@ fn main2(args: []const [*:0]const u8) !void {
             }
         }
 
-        while (@intToEnum(wasm.Section, try module_reader.readByte()) != .function)
-            assert(fseek(module_file, @intCast(c_long, try leb.readULEB128(u32, module_reader)), .CUR) == 0);
-        _ = try leb.readULEB128(u32, module_reader);
+        _ = try module_reader.seekSection(.function);
 
-        vm.functions = try arena.alloc(Function, try leb.readULEB128(u32, module_reader));
+        vm.functions = try arena.alloc(Function, try module_reader.readULEB128(u32));
         for (vm.functions) |*function, func_idx| {
             function.id = @intCast(u32, vm.imports.len + func_idx);
-            function.type_idx = try leb.readULEB128(u32, module_reader);
+            function.type_idx = try module_reader.readULEB128(u32);
         }
 
-        while (@intToEnum(wasm.Section, try module_reader.readByte()) != .table)
-            assert(fseek(module_file, @intCast(c_long, try leb.readULEB128(u32, module_reader)), .CUR) == 0);
-        _ = try leb.readULEB128(u32, module_reader);
+        _ = try module_reader.seekSection(.table);
 
         {
-            const table_count = try leb.readULEB128(u32, module_reader);
+            const table_count = try module_reader.readULEB128(u32);
             if (table_count == 1) {
-                assert(try leb.readILEB128(i33, module_reader) == -0x10);
+                assert(try module_reader.readILEB128(i33) == -0x10);
                 const limits_kind = try module_reader.readByte();
-                vm.table = try arena.alloc(u32, try leb.readULEB128(u32, module_reader));
+                vm.table = try arena.alloc(u32, try module_reader.readULEB128(u32));
                 switch (limits_kind) {
                     0x00 => {},
-                    0x01 => _ = try leb.readULEB128(u32, module_reader),
+                    0x01 => _ = try module_reader.readULEB128(u32),
                     else => unreachable,
                 }
             } else assert(table_count == 0);
         }
 
-        while (@intToEnum(wasm.Section, try module_reader.readByte()) != .memory)
-            assert(fseek(module_file, @intCast(c_long, try leb.readULEB128(u32, module_reader)), .CUR) == 0);
-        _ = try leb.readULEB128(u32, module_reader);
+        _ = try module_reader.seekSection(.memory);
 
         {
-            assert(try leb.readULEB128(u32, module_reader) == 1);
+            assert(try module_reader.readULEB128(u32) == 1);
             const limits_kind = try module_reader.readByte();
-            vm.memory_len = try leb.readULEB128(u32, module_reader) * wasm.page_size;
+            vm.memory_len = try module_reader.readULEB128(u32) * wasm.page_size;
             switch (limits_kind) {
                 0x00 => {},
-                0x01 => _ = try leb.readULEB128(u32, module_reader),
+                0x01 => _ = try module_reader.readULEB128(u32),
                 else => unreachable,
             }
         }
 
-        while (@intToEnum(wasm.Section, try module_reader.readByte()) != .global)
-            assert(fseek(module_file, @intCast(c_long, try leb.readULEB128(u32, module_reader)), .CUR) == 0);
-        _ = try leb.readULEB128(u32, module_reader);
+        _ = try module_reader.seekSection(.global);
 
-        vm.globals = try arena.alloc(u32, try leb.readULEB128(u32, module_reader));
+        vm.globals = try arena.alloc(u32, try module_reader.readULEB128(u32));
         for (vm.globals) |*global| {
-            assert(try leb.readILEB128(i33, module_reader) == -1);
+            assert(try module_reader.readILEB128(i33) == -1);
             _ = @intToEnum(Mutability, try module_reader.readByte());
             assert(@intToEnum(wasm.Opcode, try module_reader.readByte()) == .i32_const);
-            global.* = @bitCast(u32, try leb.readILEB128(i32, module_reader));
+            global.* = @bitCast(u32, try module_reader.readILEB128(i32));
             assert(@intToEnum(wasm.Opcode, try module_reader.readByte()) == .end);
         }
 
-        while (@intToEnum(wasm.Section, try module_reader.readByte()) != .@"export")
-            assert(fseek(module_file, @intCast(c_long, try leb.readULEB128(u32, module_reader)), .CUR) == 0);
-        _ = try leb.readULEB128(u32, module_reader);
+        _ = try module_reader.seekSection(.@"export");
 
         {
             var found_start_fn = false;
-            const start_name = "_start";
-            var str_buf: [start_name.len]u8 = undefined;
 
-            var export_count = try leb.readULEB128(u32, module_reader);
+            var export_count = try module_reader.readULEB128(u32);
             while (export_count > 0) : (export_count -= 1) {
-                const name_len = try leb.readULEB128(u32, module_reader);
-                var is_start_fn = false;
-                if (name_len == start_name.len) {
-                    try module_reader.readNoEof(&str_buf);
-                    is_start_fn = mem.eql(u8, &str_buf, start_name);
-                    found_start_fn = found_start_fn or is_start_fn;
-                } else assert(fseek(module_file, @intCast(c_long, name_len), .CUR) == 0);
+                const name = try module_reader.readSlice(try module_reader.readULEB128(u32));
+                const is_start_fn = mem.eql(u8, name, "_start");
+                found_start_fn = found_start_fn or is_start_fn;
 
                 const kind = @intToEnum(wasm.ExternalKind, try module_reader.readByte());
-                const idx = try leb.readULEB128(u32, module_reader);
+                const idx = try module_reader.readULEB128(u32);
                 switch (kind) {
                     .function => if (is_start_fn) {
                         start_fn_idx = idx;
@@ -240,55 +207,64 @@ fn main2(args: []const [*:0]const u8) !void {
             assert(found_start_fn);
         }
 
-        while (@intToEnum(wasm.Section, try module_reader.readByte()) != .element)
-            assert(fseek(module_file, @intCast(c_long, try leb.readULEB128(u32, module_reader)), .CUR) == 0);
-        _ = try leb.readULEB128(u32, module_reader);
+        _ = try module_reader.seekSection(.element);
 
         {
-            var segment_count = try leb.readULEB128(u32, module_reader);
+            var segment_count = try module_reader.readULEB128(u32);
             while (segment_count > 0) : (segment_count -= 1) {
-                const flags = @intCast(u3, try leb.readULEB128(u32, module_reader));
+                const flags = @intCast(u3, try module_reader.readULEB128(u32));
                 assert(flags & 0b001 == 0b000);
-                if (flags & 0b010 == 0b010) assert(try leb.readULEB128(u32, module_reader) == 0);
+                if (flags & 0b010 == 0b010) assert(try module_reader.readULEB128(u32) == 0);
 
                 assert(@intToEnum(wasm.Opcode, try module_reader.readByte()) == .i32_const);
-                var offset = @bitCast(u32, try leb.readILEB128(i32, module_reader));
+                var offset = @bitCast(u32, try module_reader.readILEB128(i32));
                 assert(@intToEnum(wasm.Opcode, try module_reader.readByte()) == .end);
 
                 const element_type = if (flags & 0b110 != 0b110) idx: {
                     if (flags & 0b010 == 0b010) assert(try module_reader.readByte() == 0x00);
                     break :idx -0x10;
-                } else try leb.readILEB128(i33, module_reader);
+                } else try module_reader.readILEB128(i33);
                 assert(element_type == -0x10);
 
-                var element_count = try leb.readULEB128(u32, module_reader);
+                var element_count = try module_reader.readULEB128(u32);
                 while (element_count > 0) : ({
                     offset += 1;
                     element_count -= 1;
                 }) {
                     if (flags & 0b010 == 0b010)
                         assert(try module_reader.readByte() == 0xD2);
-                    vm.table[offset] = try leb.readULEB128(u32, module_reader);
+                    vm.table[offset] = try module_reader.readULEB128(u32);
                     if (flags & 0b010 == 0b010)
                         assert(@intToEnum(wasm.Opcode, try module_reader.readByte()) == .end);
                 }
             }
         }
 
-        while (@intToEnum(wasm.Section, try module_reader.readByte()) != .code)
-            assert(fseek(module_file, @intCast(c_long, try leb.readULEB128(u32, module_reader)), .CUR) == 0);
-        _ = try leb.readULEB128(u32, module_reader);
+        const code_len = try module_reader.seekSection(.code);
 
         var max_frame_size: u64 = 0;
         {
-            vm.opcodes = try arena.alloc(u8, 5000000);
-            vm.operands = try arena.alloc(u32, 5000000);
-
-            assert(try leb.readULEB128(u32, module_reader) == vm.functions.len);
+            // Every instruction is at least one byte and decodes to at most one
+            // opcode and three operands per byte, so the code section size
+            // bounds the decoded image.
+            const operands_capacity = 3 * @as(usize, code_len);
+            const image = try os.mmap(
+                null,
+                mem.alignForward(code_len, 64) + operands_capacity * @sizeOf(u32),
+                os.PROT.READ | os.PROT.WRITE,
+                os.MAP.PRIVATE | os.MAP.ANONYMOUS,
+                -1,
+                0,
+            );
+            if (builtin.os.tag == .linux) os.madvise(image.ptr, image.len, os.MADV.HUGEPAGE) catch {};
+            vm.opcodes = image[0..code_len];
+            vm.operands = @ptrCast([*]u32, @alignCast(@alignOf(u32), image.ptr + mem.alignForward(code_len, 64)))[0..operands_capacity];
+
+            assert(try module_reader.readULEB128(u32) == vm.functions.len);
             var pc = ProgramCounter{ .opcode = 0, .operand = 0 };
             var stack: StackInfo = undefined;
             for (vm.functions) |*func| {
-                _ = try leb.readULEB128(u32, module_reader);
+                _ = try module_reader.readULEB128(u32);
 
                 stack = .{};
                 const type_info = vm.types[func.type_idx];
@@ -299,10 +275,10 @@ fn main2(args: []const [*:0]const u8) !void {
                 ));
                 const params_size = stack.top_offset;
 
-                var local_sets_count = try leb.readULEB128(u32, module_reader);
+                var local_sets_count = try module_reader.readULEB128(u32);
                 while (local_sets_count > 0) : (local_sets_count -= 1) {
-                    var local_set_count = try leb.readULEB128(u32, module_reader);
-                    const local_type = switch (try leb.readILEB128(i33, module_reader)) {
+                    var local_set_count = try module_reader.readULEB128(u32);
+                    const local_type = switch (try module_reader.readILEB128(i33)) {
                         -1, -3 => StackInfo.EntryType.i32,
                         -2, -4 => StackInfo.EntryType.i64,
                         else => unreachable,
@@ -343,24 +319,37 @@ fn main2(args: []const [*:0]const u8) !void {
             stats_log.debug("{} max label depth", .{max_label_depth});
             stats_log.debug("{} max frame size", .{max_frame_size});
             stats_log.debug("{} max param count", .{max_param_count});
+
+            // Pack the operands right behind the opcodes, give the unused tail
+            // of the mapping back and make the image read-only.
+            const operands_offset = mem.alignForward(pc.opcode, 64);
+            const operands = @ptrCast([*]u32, @alignCast(@alignOf(u32), image.ptr + operands_offset))[0..pc.operand];
+            mem.copy(u32, operands, vm.operands[0..pc.operand]);
+            vm.opcodes = vm.opcodes[0..pc.opcode];
+            vm.operands = operands;
+            // The mapping itself need not end on a page boundary.
+            const image_len = @min(
+                mem.alignForward(operands_offset + @as(usize, pc.operand) * @sizeOf(u32), mem.page_size),
+                image.len,
+            );
+            if (image_len < image.len) os.munmap(@alignCast(mem.page_size, image[image_len..]));
+            try os.mprotect(image[0..image_len], os.PROT.READ);
         }
 
-        while (@intToEnum(wasm.Section, try module_reader.readByte()) != .data)
-            assert(fseek(module_file, @intCast(c_long, try leb.readULEB128(u32, module_reader)), .CUR) == 0);
-        _ = try leb.readULEB128(u32, module_reader);
+        _ = try module_reader.seekSection(.data);
 
         {
-            var segment_count = try leb.readULEB128(u32, module_reader);
+            var segment_count = try module_reader.readULEB128(u32);
             while (segment_count > 0) : (segment_count -= 1) {
-                const flags = @intCast(u2, try leb.readULEB128(u32, module_reader));
+                const flags = @intCast(u2, try module_reader.readULEB128(u32));
                 assert(flags & 0b001 == 0b000);
-                if (flags & 0b010 == 0b010) assert(try leb.readULEB128(u32, module_reader) == 0);
+                if (flags & 0b010 == 0b010) assert(try module_reader.readULEB128(u32) == 0);
 
                 assert(@intToEnum(wasm.Opcode, try module_reader.readByte()) == .i32_const);
-                const offset = @bitCast(u32, try leb.readILEB128(i32, module_reader));
+                const offset = @bitCast(u32, try module_reader.readILEB128(i32));
                 assert(@intToEnum(wasm.Opcode, try module_reader.readByte()) == .end);
 
-                const length = try leb.readULEB128(u32, module_reader);
+                const length = try module_reader.readULEB128(u32);
                 try module_reader.readNoEof(vm.memory[offset..][0..length]);
             }
         }
@@ -372,6 +361,115 @@ fn main2(args: []const [*:0]const u8) !void {
     vm.run();
 }
 
+/// Maps the whole file read-only so the loader can parse it in place.
+fn mapFile(path: [*:0]const u8) ![]align(mem.page_size) const u8 {
+    const file = try fs.cwd().openFileZ(path, .{});
+    defer file.close();
+    const bytes = try os.mmap(
+        null,
+        @intCast(usize, (try file.stat()).size),
+        os.PROT.READ,
+        os.MAP.PRIVATE,
+        file.handle,
+        0,
+    );
+    if (builtin.os.tag == .linux) {
+        os.madvise(bytes.ptr, bytes.len, os.MADV.SEQUENTIAL) catch {};
+        os.madvise(bytes.ptr, bytes.len, os.MADV.WILLNEED) catch {};
+    }
+    return bytes;
+}
+
+/// Forward-only cursor over the mapped module. Sections are indexed in one
+/// pass up front and integers are decoded straight from memory.
+const ModuleReader = struct {
+    bytes: []const u8,
+    pos: usize = 0,
+    /// Offset of each section's contents and its length, indexed by id;
+    /// a zero start means the section is absent.
+    section_starts: [13]usize = [1]usize{0} ** 13,
+    section_lens: [13]u32 = [1]u32{0} ** 13,
+
+    fn indexSections(r: *ModuleReader) !void {
+        while (r.pos < r.bytes.len) {
+            const id = try r.readByte();
+            const len = try r.readULEB128(u32);
+            if (id >= r.section_starts.len) return error.BadSectionId;
+            r.section_starts[id] = r.pos;
+            r.section_lens[id] = len;
+            _ = try r.readSlice(len);
+        }
+    }
+
+    /// Positions the reader at the contents of a section and returns its length.
+    fn seekSection(r: *ModuleReader, section: wasm.Section) !u32 {
+        const id = @enumToInt(section);
+        if (r.section_starts[id] == 0) return error.MissingSection;
+        r.pos = r.section_starts[id];
+        return r.section_lens[id];
+    }
+
+    fn readByte(r: *ModuleReader) !u8 {
+        if (r.pos >= r.bytes.len) return error.EndOfStream;
+        const byte = r.bytes[r.pos];
+        r.pos += 1;
+        return byte;
+    }
+
+    fn readSlice(r: *ModuleReader, len: usize) ![]const u8 {
+        if (len > r.bytes.len - r.pos) return error.EndOfStream;
+        const slice = r.bytes[r.pos..][0..len];
+        r.pos += len;
+        return slice;
+    }
+
+    fn readNoEof(r: *ModuleReader, buf: []u8) !void {
+        mem.copy(u8, buf, try r.readSlice(buf.len));
+    }
+
+    fn readIntLittle(r: *ModuleReader, comptime T: type) !T {
+        return mem.readIntLittle(T, (try r.readSlice(@sizeOf(T)))[0..@sizeOf(T)]);
+    }
+
+    fn readULEB128(r: *ModuleReader, comptime T: type) !T {
+        // Most integers in a module fit in a single byte.
+        if (r.pos < r.bytes.len and r.bytes[r.pos] < 0x80) {
+            defer r.pos += 1;
+            return r.bytes[r.pos];
+        }
+        var result: u64 = 0;
+        var shift: u32 = 0;
+        while (true) {
+            const byte = try r.readByte();
+            result |= @as(u64, byte & 0x7f) << @intCast(u6, shift);
+            if (byte & 0x80 == 0) break;
+            shift += 7;
+            if (shift >= @bitSizeOf(T)) return error.Overflow;
+        }
+        return math.cast(T, result) orelse error.Overflow;
+    }
+
+    fn readILEB128(r: *ModuleReader, comptime T: type) !T {
+        if (r.pos < r.bytes.len and r.bytes[r.pos] < 0x80) {
+            defer r.pos += 1;
+            return @intCast(T, @bitCast(i8, r.bytes[r.pos] << 1) >> 1);
+        }
+        var result: u64 = 0;
+        var shift: u32 = 0;
+        while (true) {
+            const byte = try r.readByte();
+            result |= @as(u64, byte & 0x7f) << @intCast(u6, shift);
+            shift += 7;
+            if (byte & 0x80 == 0) {
+                if (shift < 64 and byte & 0x40 != 0) result |= ~@as(u64, 0) << @intCast(u6, shift);
+                break;
+            }
+            if (shift >= @bitSizeOf(T)) return error.Overflow;
+        }
+        return math.cast(T, @bitCast(i64, result)) orelse error.Overflow;
+    }
+};
+
 const Opcode = enum {
     @"unreachable",
     br_void,
@@ -720,7 +818,7 @@ const VirtualMachine = struct {
 
     fn decodeCode(
         vm: *VirtualMachine,
-        reader: anytype,
+        reader: *ModuleReader,
         func_type_info: TypeInfo,
         pc: *ProgramCounter,
         stack: *StackInfo,
@@ -750,7 +848,7 @@ const VirtualMachine = struct {
             assert(stack.top_offset >= labels[0].stack_offset);
             const opcode = try reader.readByte();
             var prefixed_opcode: u8 = if (@intToEnum(wasm.Opcode, opcode) == .prefixed)
-                @intCast(u8, try leb.readULEB128(u32, reader))
+                @intCast(u8, try reader.readULEB128(u32))
             else
                 undefined;
 
@@ -1093,7 +1191,7 @@ const VirtualMachine = struct {
                 .f64_reinterpret_i64,
                 => {},
                 .block, .loop, .@"if" => |opc| {
-                    const block_type = try leb.readILEB128(i33, reader);
+                    const block_type = try reader.readILEB128(i33);
                     if (unreachable_depth == 0) {
                         label_i += 1;
                         max_label_depth = @max(label_i, max_label_depth);
@@ -1251,7 +1349,7 @@ const VirtualMachine = struct {
                 .br,
                 .br_if,
                 => |opc| {
-                    const label_idx = try leb.readULEB128(u32, reader);
+                    const label_idx = try reader.readULEB128(u32);
                     if (unreachable_depth == 0) {
                         const label = &labels[label_i - label_idx];
                         const operand_count = label.operandCount();
@@ -1297,10 +1395,10 @@ const VirtualMachine = struct {
                     }
                 },
                 .br_table => {
-                    const labels_len = try leb.readULEB128(u32, reader);
+                    const labels_len = try reader.readULEB128(u32);
                     var i: u32 = 0;
                     while (i <= labels_len) : (i += 1) {
-                        const label_idx = try leb.readULEB128(u32, reader);
+                        const label_idx = try reader.readULEB128(u32);
                         if (unreachable_depth != 0) continue;
                         const label = &labels[label_i - label_idx];
                         if (i == 0) {
@@ -1356,7 +1454,7 @@ const VirtualMachine = struct {
                     unreachable_depth += 1;
                 },
                 .call => {
-                    const fn_id = try leb.readULEB128(u32, reader);
+                    const fn_id = try reader.readULEB128(u32);
                     if (unreachable_depth == 0) {
                         const type_info = &vm.types[
                             if (fn_id < vm.imports.len) type_idx: {
@@ -1389,8 +1487,8 @@ const VirtualMachine = struct {
                     }
                 },
                 .call_indirect => {
-                    const type_idx = try leb.readULEB128(u32, reader);
-                    assert(try leb.readULEB128(u32, reader) == 0);
+                    const type_idx = try reader.readULEB128(u32);
+                    assert(try reader.readULEB128(u32) == 0);
                     if (unreachable_depth == 0) {
                         opcodes[pc.opcode] = @enumToInt(Opcode.call_indirect);
                         pc.opcode += 1;
@@ -1437,7 +1535,7 @@ const VirtualMachine = struct {
                 .local_set,
                 .local_tee,
                 => |opc| {
-                    const local_idx = try leb.readULEB128(u32, reader);
+                    const local_idx = try reader.readULEB128(u32);
                     if (unreachable_depth == 0) {
                         const local_type = stack.local(local_idx);
                         opcodes[pc.opcode] = @enumToInt(switch (opc) {
@@ -1472,7 +1570,7 @@ const VirtualMachine = struct {
                 .global_get,
                 .global_set,
                 => |opc| {
-                    const global_idx = try leb.readULEB128(u32, reader);
+                    const global_idx = try reader.readULEB128(u32);
                     if (unreachable_depth == 0) {
                         const global_type = StackInfo.EntryType.i32; // all globals assumed to be i32
                         opcodes[pc.opcode] = @enumToInt(switch (opc) {
@@ -1522,8 +1620,8 @@ const VirtualMachine = struct {
                 .i64_store16,
                 .i64_store32,
                 => |opc| {
-                    const alignment = try leb.readULEB128(u32, reader);
-                    const offset = try leb.readULEB128(u32, reader);
+                    const alignment = try reader.readULEB128(u32);
+                    const offset = try reader.readULEB128(u32);
                     _ = alignment;
                     if (unreachable_depth == 0) {
                         switch (opc) {
@@ -1620,7 +1718,7 @@ const VirtualMachine = struct {
                 .f32_const,
                 => |opc| {
                     const value = switch (opc) {
-                        .i32_const => @bitCast(u32, try leb.readILEB128(i32, reader)),
+                        .i32_const => @bitCast(u32, try reader.readILEB128(i32)),
                         .f32_const => try reader.readIntLittle(u32),
                         else => unreachable,
                     };
@@ -1642,7 +1740,7 @@ const VirtualMachine = struct {
                 .f64_const,
                 => |opc| {
                     const value = switch (opc) {
-                        .i64_const => @bitCast(u64, try leb.readILEB128(i64, reader)),
+                        .i64_const => @bitCast(u64, try reader.readILEB128(i64)),
                         .f64_const => try reader.readIntLittle(u64),
                         else => unreachable,
                     };
@@ -0,0 +1,132 @@
+#ifndef ZIGWASI_H
+#define ZIGWASI_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// A decoded module. It is loaded once and any number of instances are
+/// created from it; they share its code.
+struct zw_module;
+
+/// Memory, stack, globals and fds of one guest. An instance runs on one
+/// thread at a time; different instances may run on different threads.
+struct zw_instance;
+
+/// Results of zw_instance_call.
+enum zw_result {
+    /// The export returned; its results were stored.
+    ZW_OK = 0,
+    /// The guest called proc_exit. The instance must be reset before it
+    /// is called again.
+    ZW_EXIT = 1,
+    /// The guest trapped, for example by reaching unreachable, copying,
+    /// filling or initializing memory out of bounds or overflowing its
+    /// stack, or a host function trapped. Plain loads and stores are not
+    /// bounds checked. The instance must be reset before it is called
+    /// again.
+    ZW_TRAP = 2,
+    /// There is no exported function of that name.
+    ZW_NOT_FOUND = -1,
+    /// The number of arguments or results does not match the export.
+    ZW_BAD_SIGNATURE = -2,
+};
+
+/// Called when the guest calls a registered host function. args holds the
+/// parameters and results receives the results, 32-bit values in the low
+/// half. Returning nonzero traps: the running zw_instance_call returns
+/// ZW_TRAP with the returned value as exit code.
+typedef int32_t (*zw_host_callback)(struct zw_instance *instance, void *context,
+    const uint64_t *args, uint64_t *results);
+
+struct zw_host_function {
+    const char *module_name;
+    const char *name;
+    /// Parameter types, a colon and result types, each 'i' for i32 and
+    /// f32 or 'I' for i64 and f64, for example "iI:i".
+    const char *signature;
+    zw_host_callback callback;
+    void *context;
+};
+
+struct zw_module_options {
+    /// Directory for the decoded image and function caches, or NULL to
+    /// cache nothing. Modules with host functions are never cached as
+    /// images.
+    const char *cache_dir;
+    /// Resolve imports before WASI does. The array must outlive the module.
+    const struct zw_host_function *hosts;
+    size_t hosts_len;
+};
+
+struct zw_preopen {
+    /// The name the guest sees, like "." or "/lib".
+    const char *guest_path;
+    const char *host_path;
+};
+
+struct zw_instance_options {
+    /// NULL terminated; copied. NULL for no arguments.
+    const char *const *argv;
+    /// NULL terminated "NAME=value" strings; copied. NULL for none.
+    const char *const *env;
+    /// Directories given to the guest as fds 3 and up, after stdin, stdout
+    /// and stderr. At most 7.
+    const struct zw_preopen *preopens;
+    size_t preopens_len;
+    /// Bytes the guest's memory may grow to, or 0 for the engine's limit.
+    uint64_t memory_limit;
+};
+
+/// Loads and decodes a module, which may be zstd compressed. Returns NULL
+/// if the file cannot be read or the module is malformed; zw_last_error
+/// says why. options may be NULL. Load modules from one thread at a time.
+struct zw_module *zw_module_load(const char *path, const struct zw_module_options *options);
+
+/// Frees the module. Its instances must be freed first.
+void zw_module_free(struct zw_module *module);
+
+/// Creates an instance in the module's initial state, or returns NULL if
+/// there are too many preopens or one cannot be opened; zw_last_error
+/// says why. options may be NULL.
+struct zw_instance *zw_instance_new(struct zw_module *module, const struct zw_instance_options *options);
+
+void zw_instance_free(struct zw_instance *instance);
+
+/// Returns the instance to the module's initial state and closes the fds
+/// the guest opened.
+void zw_instance_reset(struct zw_instance *instance);
+
+/// Calls an exported function, 32-bit arguments in the low half. On
+/// ZW_EXIT and ZW_TRAP, exit_code, if not NULL, receives the code: the
+/// guest's exit code, the value a trapping host function returned, or -1
+/// when the guest itself trapped.
+enum zw_result zw_instance_call(struct zw_instance *instance, const char *name,
+    const uint64_t *args, size_t args_len, uint64_t *results, size_t results_len,
+    int32_t *exit_code);
+
+/// Describes the last failed zw_module_load, zw_instance_new or trapping
+/// zw_instance_call on this thread. The string is static.
+const char *zw_last_error(void);
+
+/// The guest's linear memory. It stays at the same address, but its
+/// length changes when the guest grows it.
+uint8_t *zw_instance_memory(struct zw_instance *instance, size_t *len);
+
+/// Copy between the guest's memory and the host. Return -1, copying
+/// nothing, if the range is out of bounds.
+int zw_instance_read(struct zw_instance *instance, uint32_t offset, void *buf, size_t len);
+int zw_instance_write(struct zw_instance *instance, uint32_t offset, const void *buf, size_t len);
+
+/// Runs the engine's command line in this process: zig lib dir, CMake
+/// binary dir, root name, module, then the module's own arguments.
+int zw_main(int argc, char **argv);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif